@@ -0,0 +1,42 @@
+#!/bin/sh
+# Counts the FUSE callbacks made by a find/cat workload, run twice, for each
+# cache configuration of fs (see -o stats).
+#
+# ./bench-fuse.sh <diskname> [mountpoint]
+
+DISK=$1
+MNT=${2:-/tmp/uv6-bench}
+if [ -z "$DISK" ]; then
+    echo "usage: $0 <diskname> [mountpoint]"
+    exit 1
+fi
+mkdir -p "$MNT"
+LOG=$(mktemp) || exit 1
+trap 'rm -f "$LOG"' EXIT
+
+run() {
+    name=$1
+    opts=$2
+    ./fs -f -o "stats$opts" "$DISK" "$MNT" 2> "$LOG" &
+    pid=$!
+    # attend que le montage soit visible
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        grep -q " $MNT fuse" /proc/mounts && break
+        sleep 0.2
+    done
+    start=$(date +%s%N)
+    for pass in 1 2; do
+        find "$MNT" > /dev/null
+        find "$MNT" -type f -exec cat {} + > /dev/null
+    done
+    end=$(date +%s%N)
+    fusermount -u "$MNT"
+    wait $pid
+    echo "== $name ($(( (end - start) / 1000000 )) ms)"
+    cat "$LOG"
+}
+
+run "no cache" ",entry_timeout=0,attr_timeout=0,negative_timeout=0"
+run "defaults" ""
+run "read-only" ",ro"
+run "read-only, 128 KiB reads" ",ro,max_read=131072,max_readahead=131072"
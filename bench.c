@@ -0,0 +1,391 @@
+/**
+ * @file bench.c
+ * @brief microbenchmarks of the core functions, on a fixture image built
+ *        from scratch with a fixed seed, with the results in JSON
+ *
+ * ./bench [image] > results.json
+ *
+ * The image given is overwritten; by default, it is a temporary file,
+ * removed at the end. Each benchmark is calibrated to take at least
+ * BENCH_MIN_NS, then run BENCH_REPS times; the median and the minimum time
+ * per operation are reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "unixv6fs.h"
+#include "mount.h"
+#include "error.h"
+#include "inode.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "bmblock.h"
+#include "sha.h"
+#include "latency.h"
+#include "journal.h"
+
+#define BENCH_MIN_NS 20000000u
+#define BENCH_REPS 5
+#define BENCH_SEED 42
+
+#define FIXTURE_BLOCKS 32000
+#define FIXTURE_INODES 1024
+#define FIXTURE_DIRS 8
+#define FIXTURE_FILES 64            /* per directory */
+#define FIXTURE_BIG_SIZE 900000
+#define WRITE_FILES 4
+#define WRITE_CHUNK 4096
+#define WRITES_PER_FILE (MAX_SIZE_FILE / WRITE_CHUNK)
+#define BM_ELEMENTS 65536
+#define BENCH_TEMPLATE "/tmp/uv6-bench-XXXXXX"
+
+struct bench_ctx {
+    const char *image;
+    char copy[sizeof(BENCH_TEMPLATE)];  /* private copy of the image for run_mount, "" until made */
+    uint64_t untimed_ns;                /* part of a run not to be counted (see bench_time) */
+    struct unix_filesystem u;
+    uint16_t big_inr;
+    uint16_t dir_inr;
+    uint16_t write_inr[WRITE_FILES];
+    struct bmblock_array *bm;
+    uint64_t seed;
+    uint8_t buf[MAX_SIZE_FILE];
+};
+
+struct bench {
+    const char *name;
+    int (*setup)(struct bench_ctx *c);              /* before each run, not timed; may be NULL */
+    int (*run)(struct bench_ctx *c, uint64_t iters);
+    uint64_t fixed_iters;                           /* 0 to calibrate */
+    uint64_t bytes_per_op;                          /* 0 if not meaningful */
+};
+
+/**
+ * @brief a deterministic pseudo-random number
+ */
+static uint64_t bench_rand(struct bench_ctx *c)
+{
+    c->seed = c->seed * 6364136223846793005u + 1442695040888963407u;
+    return c->seed >> 33;
+}
+
+/* ---------------------------------------------------------------- fixture */
+
+/**
+ * @brief creates a file and writes size bytes of pseudo-random data
+ * @return the inode number; <0 on error
+ */
+static int fixture_file(struct bench_ctx *c, const char *path, int32_t size)
+{
+    int inr = direntv6_create(&c->u, path, IALLOC);
+    if (inr < 0 || size == 0) return inr;
+    for (int32_t i = 0; i < size; ++i) c->buf[i] = (uint8_t) bench_rand(c);
+    struct filev6 fv6;
+    int err = filev6_open(&c->u, (uint16_t) inr, &fv6);
+    if (err == 0) err = filev6_writebytes(&c->u, &fv6, c->buf, size);
+    return (err < 0) ? err : inr;
+}
+
+/**
+ * @brief builds the fixture: FIXTURE_DIRS directories of FIXTURE_FILES small
+ * files, one large file and WRITE_FILES empty files for the write benchmark
+ * @return 0 on success; <0 on error
+ */
+static int fixture_build(struct bench_ctx *c)
+{
+    int err = mountv6_mkfs(c->image, FIXTURE_BLOCKS, FIXTURE_INODES);
+    if (err == 0) err = mountv6(c->image, &c->u);
+    char path[MAXPATHLEN_UV6 + 1];
+    for (int d = 0; (d < FIXTURE_DIRS) && (err >= 0); ++d) {
+        snprintf(path, sizeof(path), "/d%d", d);
+        err = direntv6_create(&c->u, path, IFDIR | IALLOC);
+        if (d == 0) c->dir_inr = (uint16_t) err;
+        for (int f = 0; (f < FIXTURE_FILES) && (err >= 0); ++f) {
+            snprintf(path, sizeof(path), "/d%d/f%d", d, f);
+            err = fixture_file(c, path, 500 + (int32_t) (bench_rand(c) % 3500));
+        }
+    }
+    if (err >= 0) err = fixture_file(c, "/big", FIXTURE_BIG_SIZE);
+    if (err >= 0) c->big_inr = (uint16_t) err;
+    for (int w = 0; (w < WRITE_FILES) && (err >= 0); ++w) {
+        snprintf(path, sizeof(path), "/w%d", w);
+        err = fixture_file(c, path, 0);
+        if (err >= 0) c->write_inr[w] = (uint16_t) err;
+    }
+    c->bm = bm_alloc(0, BM_ELEMENTS - 1);
+    if (c->bm == NULL) err = ERR_NOMEM;
+    return (err < 0) ? err : 0;
+}
+
+/* ------------------------------------------------------------- benchmarks */
+
+static int setup_bm_half(struct bench_ctx *c)
+{
+    for (uint64_t x = 0; x < BM_ELEMENTS; ++x) {
+        if (x < BM_ELEMENTS / 2) bm_set(c->bm, x);
+        else bm_clear(c->bm, x);
+    }
+    return 0;
+}
+
+/* frees a bit of the full half, then allocates the first free bit as inode_alloc does */
+static int run_bm_find_next(struct bench_ctx *c, uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; ++i) {
+        bm_clear(c->bm, bench_rand(c) % (BM_ELEMENTS / 2));
+        int x = bm_find_next(c->bm);
+        if (x < 0) return x;
+        bm_set(c->bm, (uint64_t) x);
+    }
+    return 0;
+}
+
+static int run_bm_set(struct bench_ctx *c, uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; ++i) {
+        bm_set(c->bm, bench_rand(c) % BM_ELEMENTS);
+    }
+    return 0;
+}
+
+static int run_inode_read(struct bench_ctx *c, uint64_t iters)
+{
+    struct inode ino;
+    int nb = c->u.s.s_isize * INODES_PER_SECTOR;
+    for (uint64_t i = 0; i < iters; ++i) {
+        int err = inode_read(&c->u, (uint16_t) (ROOT_INUMBER + i % (nb - ROOT_INUMBER)), &ino);
+        if (err < 0 && err != ERR_UNALLOCATED_INODE) return err;
+    }
+    return 0;
+}
+
+static int run_inode_findsector(struct bench_ctx *c, uint64_t iters)
+{
+    struct inode ino;
+    int err = inode_read(&c->u, c->big_inr, &ino);
+    int nb = (FIXTURE_BIG_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    for (uint64_t i = 0; (i < iters) && (err >= 0); ++i) {
+        err = inode_findsector(&c->u, &ino, (int32_t) (bench_rand(c) % nb));
+    }
+    return (err < 0) ? err : 0;
+}
+
+static int run_dirlookup(struct bench_ctx *c, uint64_t iters)
+{
+    char path[MAXPATHLEN_UV6 + 1];
+    for (uint64_t i = 0; i < iters; ++i) {
+        uint64_t r = bench_rand(c);
+        snprintf(path, sizeof(path), "/d%d/f%d", (int) (r % FIXTURE_DIRS), (int) ((r >> 8) % FIXTURE_FILES));
+        int err = direntv6_dirlookup(&c->u, ROOT_INUMBER, path);
+        if (err < 0) return err;
+    }
+    return 0;
+}
+
+/* one operation lists a whole directory */
+static int run_readdir(struct bench_ctx *c, uint64_t iters)
+{
+    char name[DIRENT_MAXLEN + 1];
+    uint16_t child = 0;
+    for (uint64_t i = 0; i < iters; ++i) {
+        struct directory_reader d;
+        int err = direntv6_opendir(&c->u, c->dir_inr, &d);
+        while (err >= 0 && (err = direntv6_readdir(&d, name, &child)) > 0);
+        if (err < 0) return err;
+    }
+    return 0;
+}
+
+/* one operation reads the whole large file, sector by sector */
+static int run_readblock(struct bench_ctx *c, uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; ++i) {
+        struct filev6 fv6;
+        int err = filev6_open(&c->u, c->big_inr, &fv6);
+        while (err >= 0 && (err = filev6_readblock(&fv6, c->buf)) > 0);
+        if (err < 0) return err;
+    }
+    return 0;
+}
+
+/* empties the files written by run_writebytes */
+static int setup_writebytes(struct bench_ctx *c)
+{
+    for (int w = 0; w < WRITE_FILES; ++w) {
+        struct filev6_handle *h = NULL;
+        int err = filev6_handle_open(&c->u, c->write_inr[w], &h);
+        if (err == 0) err = filev6_handle_truncate(h, 0);
+        if (err == 0) err = filev6_handle_flush(&c->u, h);
+        filev6_handle_close(h);
+        if (err < 0) return err;
+    }
+    /* the truncated sectors go back to the free bitmap at the commit */
+    return journal_commit(&c->u);
+}
+
+/* appends WRITE_CHUNK bytes, filling the files one after the other */
+static int run_writebytes(struct bench_ctx *c, uint64_t iters)
+{
+    struct filev6 fv6;
+    int err = 0;
+    for (uint64_t i = 0; (i < iters) && (err >= 0); ++i) {
+        if (i % WRITES_PER_FILE == 0) err = filev6_open(&c->u, c->write_inr[i / WRITES_PER_FILE], &fv6);
+        if (err >= 0) err = filev6_writebytes(&c->u, &fv6, c->buf, WRITE_CHUNK);
+    }
+    return (err < 0) ? err : 0;
+}
+
+/**
+ * @brief creates an empty temporary file
+ * @param path BENCH_TEMPLATE, replaced by the name of the file (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+static int bench_tempfile(char *path)
+{
+    strcpy(path, BENCH_TEMPLATE);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        path[0] = '\0';
+        return ERR_IO;
+    }
+    close(fd);
+    return 0;
+}
+
+/* copies the image once, after a commit, so that run_mount leaves the mounted one alone */
+static int setup_mount(struct bench_ctx *c)
+{
+    if (c->copy[0] != '\0') return 0;
+    int err = journal_commit(&c->u);
+    if (err == 0) err = bench_tempfile(c->copy);
+    if (err < 0) return err;
+    FILE *in = fopen(c->image, "rb");
+    FILE *out = fopen(c->copy, "wb");
+    size_t n = 0;
+    while ((in != NULL) && (out != NULL) && (n = fread(c->buf, 1, sizeof(c->buf), in)) > 0) {
+        if (fwrite(c->buf, 1, n, out) != n) break;
+    }
+    if ((in == NULL) || (out == NULL) || ferror(in) || (n > 0)) err = ERR_IO;
+    if (in != NULL) fclose(in);
+    if ((out != NULL) && (fclose(out) != 0)) err = ERR_IO;
+    return err;
+}
+
+/* only the mount is timed: the umount commits the journal and syncs the copy */
+static int run_mount(struct bench_ctx *c, uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; ++i) {
+        struct unix_filesystem u;
+        int err = mountv6(c->copy, &u);
+        if (err < 0) return err;
+        uint64_t start = latency_now();
+        umountv6(&u);
+        c->untimed_ns += latency_now() - start;
+    }
+    return 0;
+}
+
+static int run_sha(struct bench_ctx *c, uint64_t iters)
+{
+    struct inode ino;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    int err = inode_read(&c->u, c->big_inr, &ino);
+    for (uint64_t i = 0; (i < iters) && (err >= 0); ++i) {
+        err = sha_inode(&c->u, &ino, digest);
+    }
+    return (err < 0) ? err : 0;
+}
+
+static const struct bench BENCHES[] = {
+    { "bm_find_next", setup_bm_half, run_bm_find_next, 0, 0 },
+    { "bm_set", setup_bm_half, run_bm_set, 0, 0 },
+    { "inode_read", NULL, run_inode_read, 0, 0 },
+    { "inode_findsector", NULL, run_inode_findsector, 0, 0 },
+    { "direntv6_dirlookup", NULL, run_dirlookup, 0, 0 },
+    { "direntv6_readdir", NULL, run_readdir, 0, 0 },
+    { "filev6_readblock", NULL, run_readblock, 0, FIXTURE_BIG_SIZE },
+    { "filev6_writebytes", setup_writebytes, run_writebytes, WRITE_FILES * WRITES_PER_FILE, WRITE_CHUNK },
+    { "mountv6", setup_mount, run_mount, 0, 0 },
+    { "sha_inode", NULL, run_sha, 0, FIXTURE_BIG_SIZE },
+};
+
+#define NB_BENCHES (sizeof(BENCHES) / sizeof(BENCHES[0]))
+
+/**
+ * @brief times one run of iters operations, after the setup, without the
+ *        part the run puts in c->untimed_ns
+ * @return the time in nanoseconds; 0 on error
+ */
+static uint64_t bench_time(struct bench_ctx *c, const struct bench *b, uint64_t iters)
+{
+    c->seed = BENCH_SEED;
+    c->untimed_ns = 0;
+    if (b->setup != NULL && b->setup(c) < 0) return 0;
+    uint64_t start = latency_now();
+    if (b->run(c, iters) < 0) return 0;
+    uint64_t ns = latency_now() - start - c->untimed_ns;
+    return ns ? ns : 1;
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct bench_ctx c;
+    static char image[sizeof(BENCH_TEMPLATE)];
+    c.image = (argc > 1) ? argv[1] : image;
+    c.seed = BENCH_SEED;
+    int err = (argc > 1) ? 0 : bench_tempfile(image);
+    if (err == 0) err = fixture_build(&c);
+    if (err < 0) {
+        fprintf(stderr, "fixture: %s\n", ERR_MESSAGES[err - ERR_FIRST]);
+        if (image[0] != '\0') remove(image);
+        return 1;
+    }
+
+    printf("{\"image\": {\"blocks\": %d, \"inodes\": %d, \"dirs\": %d, \"files_per_dir\": %d},\n",
+           FIXTURE_BLOCKS, FIXTURE_INODES, FIXTURE_DIRS, FIXTURE_FILES);
+    printf(" \"benchmarks\": [");
+    for (size_t k = 0; (k < NB_BENCHES) && (err == 0); ++k) {
+        const struct bench *b = &BENCHES[k];
+        uint64_t iters = b->fixed_iters;
+        if (iters == 0) {
+            for (iters = 1; ; iters *= 2) {
+                uint64_t ns = bench_time(&c, b, iters);
+                if (ns == 0 || ns >= BENCH_MIN_NS) break;
+            }
+        }
+        double per_op[BENCH_REPS];
+        for (int rep = 0; (rep < BENCH_REPS) && (err == 0); ++rep) {
+            uint64_t ns = bench_time(&c, b, iters);
+            if (ns == 0) {
+                fprintf(stderr, "%s: error\n", b->name);
+                err = 1;
+            }
+            per_op[rep] = (double) ns / iters;
+        }
+        if (err != 0) break;
+        qsort(per_op, BENCH_REPS, sizeof(double), double_cmp);
+        double median = per_op[BENCH_REPS / 2];
+        printf("%s\n  {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.1f, \"ns_per_op_min\": %.1f, "
+               "\"ops_per_s\": %.0f", k ? "," : "", b->name, (unsigned long long) iters, median, per_op[0],
+               1e9 / median);
+        if (b->bytes_per_op) printf(", \"mb_per_s\": %.1f", b->bytes_per_op / median * 1e3);
+        printf("}");
+        fflush(stdout);
+    }
+    if (err == 0) printf("\n]}\n");
+
+    bm_free(c.bm);
+    umountv6(&c.u);
+    if (c.copy[0] != '\0') remove(c.copy);
+    if (image[0] != '\0') remove(image);
+    return err;
+}
@@ -28,6 +28,7 @@ struct bmblock_array *bm_alloc(uint64_t min, uint64_t max)
     bmblock->cursor=0;
     bmblock->min=min;
     bmblock->max=max;
+    bmblock->used=0;
     return bmblock;
 }
 
@@ -72,6 +73,7 @@ void bm_set(struct bmblock_array *bmblock_array, uint64_t x)
             /*le minimum correspondant à la bonne case du tableau(index)*/
             size_t min_index= bmblock_array->min + (BITS_PER_VECTOR*index);
             uint64_t mask= UINT64_C(1)<<(x-min_index);
+            if(!(bmblock_array->bm[index] & mask)) ++(bmblock_array->used);
             bmblock_array->bm[index] |= mask;
         }
     }
@@ -90,6 +92,7 @@ void bm_clear(struct bmblock_array *bmblock_array, uint64_t x)
             /*le minimum correspondant à la bonne case du tableau(index)*/
             size_t min_index= bmblock_array->min + (BITS_PER_VECTOR*index);
             uint64_t mask= ( ~(UINT64_C(0)) ) ^ ( UINT64_C(1)<<(x-min_index) );
+            if(bmblock_array->bm[index] & ~mask) --(bmblock_array->used);
             bmblock_array->bm[index] &= mask;
             if(bmblock_array->cursor>index) bmblock_array->cursor=index;
         }
@@ -113,12 +116,95 @@ int bm_find_next(struct bmblock_array *bmblock_array)
                     return bmblock_array->min+bmblock_array->cursor*BITS_PER_VECTOR+i;
                 }
             }
+            // les bits libres restants sont au-delà de max
+            ++(bmblock_array->cursor);
         } else {
             ++(bmblock_array->cursor);
         }
     }
     return ERR_BITMAP_FULL;
 }
+
+/**
+ * @brief return the first unused bit from goal on, wrapping around to min
+ * @param bmblock_array the array we want to search for place
+ * @param goal the preferred value (min is used if goal is out of range)
+ * @return <0 on failure, the value of the unused bit otherwise
+ */
+int bm_find_next_from(struct bmblock_array *bmblock_array, uint64_t goal)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+    if((goal<bmblock_array->min)||(goal>bmblock_array->max)) goal=bmblock_array->min;
+    uint64_t nb_bits = bmblock_array->max-bmblock_array->min+1;
+    uint64_t start = goal-bmblock_array->min;
+    // le mot du but est revu en dernier, entier, pour les bits libres avant le but
+    for(size_t k=0; k<=bmblock_array->length; ++k) {
+        size_t index = (start/BITS_PER_VECTOR+k)%bmblock_array->length;
+        uint64_t free_bits = ~bmblock_array->bm[index];
+        if(k==0) free_bits &= UINT64_C(-1)<<(start%BITS_PER_VECTOR);
+        if(free_bits!=0) {
+            uint64_t bit = index*BITS_PER_VECTOR+__builtin_ctzll(free_bits);
+            if(bit<nb_bits) return bmblock_array->min+bit;
+        }
+    }
+    return ERR_BITMAP_FULL;
+}
+
+/**
+ * @brief return the first of the first length consecutive unused bits
+ * @param bmblock_array the array we want to search for place
+ * @param length the number of consecutive unused bits wanted
+ * @return <0 on failure, the value of the first bit of the run otherwise
+ */
+int bm_find_run(struct bmblock_array *bmblock_array, uint64_t length)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+    if(length==0) return ERR_BAD_PARAMETER;
+    uint64_t run=0;
+    for(uint64_t x=bmblock_array->min; x<=bmblock_array->max; ++x) {
+        uint64_t bit = x-bmblock_array->min;
+        // un mot plein interrompt la suite d'un coup
+        if((bit%BITS_PER_VECTOR==0)&&(bmblock_array->bm[bit/BITS_PER_VECTOR]==UINT64_C(-1))) {
+            run=0;
+            x+=BITS_PER_VECTOR-1;
+            continue;
+        }
+        if(bmblock_array->bm[bit/BITS_PER_VECTOR] & (UINT64_C(1)<<(bit%BITS_PER_VECTOR))) {
+            run=0;
+        } else if(++run==length) {
+            return x-length+1;
+        }
+    }
+    return ERR_BITMAP_FULL;
+}
+
+/**
+ * @brief recount the bits set, once the array was filled (e.g. at mount)
+ * @param bmblock_array the array to recount
+ */
+void bm_recount(struct bmblock_array *bmblock_array)
+{
+    if(bmblock_array!=NULL) {
+        uint64_t used = 0;
+        // les bits au-delà de max ne sont jamais mis à 1
+        for(size_t i=0; i<bmblock_array->length; ++i) {
+            used += (uint64_t) __builtin_popcountll(bmblock_array->bm[i]);
+        }
+        bmblock_array->used=used;
+    }
+}
+
+/**
+ * @brief return the number of unused elements, without scanning the array
+ * @param bmblock_array the array
+ * @return the number of bits at 0 between min and max
+ */
+uint64_t bm_count_free(const struct bmblock_array *bmblock_array)
+{
+    if(bmblock_array==NULL) return 0;
+    return bmblock_array->max - bmblock_array->min + 1 - bmblock_array->used;
+}
+
 /**
  * @brief auxiliar method used in bm_print to print an uint64_t in the right order
  * @param uint64_t u the unsigned int we want to print
@@ -149,6 +235,7 @@ void bm_print(struct bmblock_array *bmblock_array)
         printf("min: %lu\n",bmblock_array->min);
         printf("max: %lu\n",bmblock_array->max);
         printf("cursor: %lu\n",bmblock_array->cursor);
+        printf("used: %lu\n",bmblock_array->used);
         puts("content: ");
         for(int i=0; i<bmblock_array->length; ++i) {
             printf("%d:  ",i);
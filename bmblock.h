@@ -20,6 +20,7 @@ struct bmblock_array {
     uint64_t cursor; /* stocke l’index du dernier entier de 64 bits utilisé */
     uint64_t min; /* index minimal des éléments référencés par le bmblock_array */
     uint64_t max; /* index maximal des éléments référencés par le bmblock_array */
+    uint64_t used; /* nombre de bits à 1, tenu à jour par bm_set et bm_clear */
     uint64_t bm[1]; /* tableau de contenu de bmblock_array dont chaque case contient 64 elements */
 };
 
@@ -63,6 +64,35 @@ void bm_clear(struct bmblock_array *bmblock_array, uint64_t x);
  */
 int bm_find_next(struct bmblock_array *bmblock_array);
 
+/**
+ * @brief return the first unused bit from goal on, wrapping around to min
+ * @param bmblock_array the array we want to search for place
+ * @param goal the preferred value (min is used if goal is out of range)
+ * @return <0 on failure, the value of the unused bit otherwise
+ */
+int bm_find_next_from(struct bmblock_array *bmblock_array, uint64_t goal);
+
+/**
+ * @brief return the first of the first length consecutive unused bits
+ * @param bmblock_array the array we want to search for place
+ * @param length the number of consecutive unused bits wanted
+ * @return <0 on failure, the value of the first bit of the run otherwise
+ */
+int bm_find_run(struct bmblock_array *bmblock_array, uint64_t length);
+
+/**
+ * @brief recount the bits set, once the array was filled (e.g. at mount)
+ * @param bmblock_array the array to recount
+ */
+void bm_recount(struct bmblock_array *bmblock_array);
+
+/**
+ * @brief return the number of unused elements, without scanning the array
+ * @param bmblock_array the array
+ * @return the number of bits at 0 between min and max
+ */
+uint64_t bm_count_free(const struct bmblock_array *bmblock_array);
+
 /**
  * @brief usefull to see (and debug) content of a bmblock_array
  * @param bmblock_array the array we want to see
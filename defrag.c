@@ -0,0 +1,249 @@
+/**
+ * @file defrag.c
+ * @brief moving the data of fragmented files into contiguous runs of sectors
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "defrag.h"
+#include "unixv6fs.h"
+#include "error.h"
+#include "sector.h"
+#include "inode.h"
+#include "filev6.h"
+#include "journal.h"
+
+#define MAX_SMALL_FILE (ADDR_SMALL_LENGTH*SECTOR_SIZE)
+#define NB_INDIRECT(nb) (((nb)+ADDRESSES_PER_SECTOR-1)/ADDRESSES_PER_SECTOR)
+
+/**
+ * @brief the number of runs of contiguous sectors of a block map
+ */
+static int defrag_extents(const uint16_t *sectors, int nb)
+{
+    int extents = (nb>0) ? 1 : 0;
+    for(int k=1; k<nb; ++k) {
+        if(sectors[k]!=sectors[k-1]+1) ++extents;
+    }
+    return extents;
+}
+
+/**
+ * @brief push the writes to the disk (the order of the writes on both sides
+ *        of a call is then kept on the disk)
+ * @return 0 on success; <0 on error
+ */
+static int defrag_sync(struct unix_filesystem *u)
+{
+    return (fsync(fileno(u->f))==0) ? 0 : ERR_IO;
+}
+
+/**
+ * @brief copy a file into the run of need sectors from first (already reserved),
+ *        then switch its inode to the copy and free the old sectors
+ * @return 0 on success; <0 on error (the file and its sectors are then unchanged)
+ */
+static int defrag_move(struct unix_filesystem *u, uint16_t inr, struct inode *ino,
+                       const uint16_t *sectors, int nb, int nb_indirect, int first)
+{
+    int need = nb_indirect+nb;
+    uint8_t *buf = calloc(need, SECTOR_SIZE);
+    if(buf==NULL) return ERR_NOMEM;
+
+    // les secteurs indirects en tête, puis les données lues extent par extent
+    uint16_t *addresses = (uint16_t *)buf;
+    for(int k=0; k<nb_indirect*ADDRESSES_PER_SECTOR; ++k) {
+        addresses[k] = (k<nb) ? (uint16_t)(first+nb_indirect+k) : 0;
+    }
+    int err=0;
+    for(int k=0; (k<nb)&&(err==0); ) {
+        int last=k+1;
+        while((last<nb)&&(sectors[last]==sectors[last-1]+1)) ++last;
+        err=SECTOR_TAGGED(SECTOR_TAG_FILE, journal_read(u,sectors[k],last-k,buf+(nb_indirect+k)*SECTOR_SIZE));
+        k=last;
+    }
+    // la copie est sur le disque avant que l'inode ne la désigne
+    if(err==0) err=SECTOR_TAGGED(SECTOR_TAG_FILE, sectors_write(u->f,first,need,buf));
+    if(err==0) err=defrag_sync(u);
+    free(buf);
+    if(err<0) return err;
+
+    struct inode moved = *ino;
+    memset(moved.i_addr,0,sizeof(moved.i_addr));
+    for(int k=0; k<(nb_indirect ? nb_indirect : nb); ++k) {
+        moved.i_addr[k] = (uint16_t)(first+k);
+    }
+    if((err=inode_write(u,inr,&moved))<0) return err;
+
+    // l'ancienne copie n'est plus désignée : ses secteurs sont libérés par
+    // le commit de l'inode
+    for(int k=0; k<nb; ++k) journal_free(u,sectors[k]);
+    for(int k=0; k<nb_indirect; ++k) journal_free(u,ino->i_addr[k]);
+    *ino = moved;
+    return 0;
+}
+
+/**
+ * @brief move the data of a file into the first free run of sectors long enough for it
+ * @param u the mounted filesystem
+ * @param inr the inode number of the file
+ * @return 1 if the file was moved, 0 if it was already contiguous (or empty); <0 on error
+ */
+int defrag_file(struct unix_filesystem *u, uint16_t inr)
+{
+    M_REQUIRE_NON_NULL(u);
+    uint16_t sectors[MAX_FILE_SECTORS];
+    struct inode ino;
+    mountv6_lock_exclusive(u);
+    int err = inode_read(u,inr,&ino);
+    int nb = (err<0) ? err : filev6_blockmap(u,&ino,sectors);
+    if(nb<0 || defrag_extents(sectors,nb)<=1) {
+        mountv6_unlock(u);
+        return (nb<0) ? nb : 0;
+    }
+    int nb_indirect = (inode_getsize(&ino)>MAX_SMALL_FILE) ? NB_INDIRECT(nb) : 0;
+    int first = bm_find_run(u->fbm,nb_indirect+nb);
+    if(first<0) {
+        mountv6_unlock(u);
+        return first;
+    }
+    for(int k=0; k<nb_indirect+nb; ++k) bm_set(u->fbm,first+k);
+    err=defrag_move(u,inr,&ino,sectors,nb,nb_indirect,first);
+    if(err<0) {
+        for(int k=0; k<nb_indirect+nb; ++k) bm_clear(u->fbm,first+k);
+    } else {
+        err=journal_commit(u);
+    }
+    mountv6_unlock(u);
+    return (err<0) ? err : 1;
+}
+
+/**
+ * @brief count the extents of all the files and list the fragmented ones
+ * @param u the mounted filesystem
+ * @param stats files, fragmented and extents_after are set (OUT)
+ * @param fragmented room for all the inode numbers (OUT, may be NULL)
+ * @return 0 on success; <0 on error
+ */
+static int defrag_scan(struct unix_filesystem *u, struct defrag_stats *stats, uint16_t *fragmented)
+{
+    int nb_inodes = u->s.s_isize*INODES_PER_SECTOR;
+    struct inode *inodes = calloc(nb_inodes, sizeof(struct inode));
+    uint16_t *sectors = malloc(MAX_FILE_SECTORS*sizeof(uint16_t));
+    int err = (inodes==NULL || sectors==NULL) ? ERR_NOMEM : 0;
+    mountv6_lock_shared(u);
+    if(err==0) err=inode_read_all(u,inodes);
+    stats->files=stats->fragmented=0;
+    stats->extents_after=0;
+    for(int inr=ROOT_INUMBER; (inr<nb_inodes)&&(err>=0); ++inr) {
+        if(!(inodes[inr].i_mode & IALLOC)) continue;
+        int nb = filev6_blockmap(u,&inodes[inr],sectors);
+        if(nb<=0) {
+            err = (nb<0) ? nb : 0;
+            continue;
+        }
+        int extents = defrag_extents(sectors,nb);
+        ++stats->files;
+        stats->extents_after += extents;
+        if(extents>1) {
+            if(fragmented!=NULL) fragmented[stats->fragmented]=(uint16_t)inr;
+            ++stats->fragmented;
+        }
+    }
+    mountv6_unlock(u);
+    free(inodes);
+    free(sectors);
+    return err;
+}
+
+/**
+ * @brief read the given files from the disk (not from the page cache), by
+ *        DEFRAG_READ_CHUNK bytes, one after the other
+ * @return the throughput in MB/s; <0 on error
+ */
+static double defrag_read(struct unix_filesystem *u, const uint16_t *files, unsigned int nb)
+{
+    uint8_t *buf = malloc(DEFRAG_READ_CHUNK);
+    if(buf==NULL) return ERR_NOMEM;
+    (void)defrag_sync(u);
+    posix_fadvise(fileno(u->f),0,0,POSIX_FADV_DONTNEED);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t bytes=0;
+    int err=0;
+    for(unsigned int k=0; (k<nb)&&(err>=0); ++k) {
+        struct filev6_handle *h=NULL;
+        if((err=filev6_handle_open(u,files[k],&h))<0) break;
+        int32_t offset=0;
+        while((err=filev6_handle_read(h,buf,DEFRAG_READ_CHUNK,offset))>0) {
+            offset+=err;
+            bytes+=err;
+        }
+        filev6_handle_close(h);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(buf);
+    if(err<0) return err;
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return (secs>0) ? bytes/secs/1e6 : 0.0;
+}
+
+/**
+ * @brief defragment all the files of the filesystem, one at a time
+ * @param u the mounted filesystem
+ * @param stats what has been done (OUT)
+ * @return 0 on success; <0 on error
+ */
+int defrag_all(struct unix_filesystem *u, struct defrag_stats *stats)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(stats);
+    memset(stats,0,sizeof(*stats));
+    uint16_t *fragmented = malloc(u->s.s_isize*INODES_PER_SECTOR*sizeof(uint16_t));
+    if(fragmented==NULL) return ERR_NOMEM;
+    int err=defrag_scan(u,stats,fragmented);
+    stats->extents_before=stats->extents_after;
+    if(err==0) {
+        double mbs=defrag_read(u,fragmented,stats->fragmented);
+        if(mbs<0) err=(int)mbs;
+        stats->read_before=mbs;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(unsigned int k=0; (k<stats->fragmented)&&(err==0); ++k) {
+        int r=defrag_file(u,fragmented[k]);
+        if(r==ERR_BITMAP_FULL) {
+            ++stats->no_room;
+        } else if(r<0) {
+            err=r;
+        } else if(r==1) {
+            ++stats->moved;
+            struct inode ino;
+            if(inode_read(u,fragmented[k],&ino)==0) {
+                int nb=(inode_getsize(&ino)+SECTOR_SIZE-1)/SECTOR_SIZE;
+                stats->sectors_moved += nb + ((inode_getsize(&ino)>MAX_SMALL_FILE) ? NB_INDIRECT(nb) : 0);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if(err==0) {
+        // files et fragmented restent ceux d'avant
+        struct defrag_stats after=*stats;
+        err=defrag_scan(u,&after,NULL);
+        stats->extents_after=after.extents_after;
+    }
+    if(err==0) {
+        double mbs=defrag_read(u,fragmented,stats->fragmented);
+        if(mbs<0) err=(int)mbs;
+        stats->read_after=mbs;
+    }
+    free(fragmented);
+    return err;
+}
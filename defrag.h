@@ -0,0 +1,57 @@
+#pragma once
+
+/**
+ * @file defrag.h
+ * @brief moving the data of fragmented files into contiguous runs of sectors
+ */
+
+#include <stdint.h>
+#include "mount.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* number of bytes per read when measuring the read throughput (as asked by the FUSE daemon) */
+#define DEFRAG_READ_CHUNK 131072
+
+struct defrag_stats {
+    unsigned int files;       /* number of files (and directories) with data */
+    unsigned int fragmented;  /* number of them in more than one extent */
+    unsigned int moved;       /* number of files moved into a contiguous run */
+    unsigned int no_room;     /* fragmented files for which no free run was long enough */
+    uint64_t extents_before;  /* total number of extents (runs of contiguous sectors) before */
+    uint64_t extents_after;   /* and after */
+    uint64_t sectors_moved;   /* data and indirect sectors copied */
+    double read_before;       /* MB/s of a cold sequential read of the fragmented files, before */
+    double read_after;        /* and after */
+    double seconds;           /* duration of the moves */
+};
+
+/**
+ * @brief move the data of a file into the first free run of sectors long
+ *        enough for it (indirect sectors first, then the data). The copy is
+ *        written and synced before the inode is switched to it, and the old
+ *        sectors are freed only then: after a crash, the file is either the
+ *        old one or the new one. The exclusive lock of the filesystem is held
+ *        meanwhile; the file must not be open through a filev6_handle.
+ * @param u the mounted filesystem
+ * @param inr the inode number of the file
+ * @return 1 if the file was moved, 0 if it was already contiguous (or empty);
+ *         <0 on error (ERR_BITMAP_FULL if no free run is long enough)
+ */
+int defrag_file(struct unix_filesystem *u, uint16_t inr);
+
+/**
+ * @brief defragment all the files of the filesystem, one at a time (see
+ *        defrag_file), and measure the fragmentation and the read throughput
+ *        of the fragmented files before and after
+ * @param u the mounted filesystem
+ * @param stats what has been done (OUT)
+ * @return 0 on success; <0 on error
+ */
+int defrag_all(struct unix_filesystem *u, struct defrag_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -9,6 +9,7 @@
 #include "error.h"
 #include "filev6.h"
 #include "inode.h"
+#include "journal.h"
 
 /**
  * @brief opens a directory reader for the specified inode 'inr'
@@ -24,7 +25,7 @@ int direntv6_opendir(const struct unix_filesystem *u, uint16_t inr, struct direc
     M_REQUIRE_NON_NULL(d);
 
     memset(d,0,sizeof(struct directory_reader));
-    if((err=filev6_open(u,inr,&d->fv6))<0) return err;
+    if((err=SECTOR_TAGGED(SECTOR_TAG_DIR, filev6_open(u,inr,&d->fv6)))<0) return err;
     if(!(d->fv6.i_node.i_mode & IALLOC)&&(((d->fv6.i_node.i_mode)&IFMT)!=IFDIR))return ERR_UNALLOCATED_INODE;
     if(((d->fv6.i_node.i_mode)&IFMT)!=IFDIR)return ERR_INVALID_DIRECTORY_INODE;
     d->cur=0;
@@ -49,7 +50,7 @@ int direntv6_readdir(struct directory_reader *d, char *name, uint16_t *child_inr
     if(d->cur==d->last) {
         char buf[SECTOR_SIZE];
         memset(buf,0,SECTOR_SIZE);
-        int r=filev6_readblock(&(d->fv6),buf);
+        int r=SECTOR_TAGGED(SECTOR_TAG_DIR, filev6_readblock(&(d->fv6),buf));
         if(r<=0) return r;
         else {
             memcpy(d->dirs,buf, DIRENTRIES_PER_SECTOR * sizeof(struct direntv6));
@@ -66,6 +67,36 @@ int direntv6_readdir(struct directory_reader *d, char *name, uint16_t *child_inr
     return 1;
 }
 
+/**
+ * @brief moves the reader to the given entry, without reading the ones before it
+ * @param d the directory reader
+ * @param index the number of the entry the next direntv6_readdir returns
+ * @return 0 on success; <0 on error
+ */
+int direntv6_seekdir(struct directory_reader *d, int32_t index)
+{
+    M_REQUIRE_NON_NULL(d);
+    if(index < 0) return ERR_OFFSET_OUT_OF_RANGE;
+
+    /* les entrées ont une taille fixe : on se place au début de leur secteur */
+    const int32_t size = inode_getsize(&d->fv6.i_node);
+    const int32_t first = index - index % DIRENTRIES_PER_SECTOR;
+    if(first * (int32_t)sizeof(struct direntv6) >= size) {
+        d->fv6.offset = size;
+        d->cur = d->last = index;
+        return 0;
+    }
+    int err = filev6_lseek(&d->fv6, first * (int32_t)sizeof(struct direntv6));
+    if(err < 0) return err;
+    d->cur = d->last = first;
+
+    /* puis on saute les entrées de ce secteur qui précèdent index */
+    char name[DIRENT_MAXLEN + 1];
+    uint16_t child_inr = 0;
+    while(d->cur < index && (err = direntv6_readdir(d, name, &child_inr)) > 0);
+    return err < 0 ? err : 0;
+}
+
 /**
  * @brief debugging routine; print the subtree (note: recursive)
  * @param u a mounted filesystem
@@ -158,10 +189,10 @@ int direntv6_dirlookup_core(const struct unix_filesystem *u, uint16_t inr, const
 	if(ptr!=NULL) l-=strlen(ptr);
 	do{
 		if ((err=direntv6_readdir(&d, name, &child_inr))<0) return err;
-		/* Si nous somme déja dans le dossier ou fichier que l'on veut */
-		if(strncmp(name,entry,strlen(entry))==0) return child_inr;
-		/* Nous somme dans le dossier qui contient le sous-dossier ou fichier que l'on recherche */
-		if(strncmp(name,entry,l)==0) {
+		/* le nom doit correspondre exactement au prochain composant du chemin */
+		if((err>0) && (child_inr!=0) && (strlen(name)==(size_t)l) && (strncmp(name,entry,l)==0)) {
+			/* Si nous somme déja dans le dossier ou fichier que l'on veut */
+			if(ptr==NULL) return child_inr;
 			/* on modifie la taille qui devient la taille de notre nouvelle sequence à chercher */
 			length=strlen(ptr);
 			/* On cherche récursivement */
@@ -184,7 +215,7 @@ int direntv6_dirlookup(const struct unix_filesystem *u, uint16_t inr, const char
 {
 	M_REQUIRE_NON_NULL(u);
 	M_REQUIRE_NON_NULL(entry);
-    int num = direntv6_dirlookup_core(u, inr, entry, strlen(entry));
+    int num = SECTOR_TAGGED(SECTOR_TAG_DIR, direntv6_dirlookup_core(u, inr, entry, strlen(entry)));
     return num;
 }
 
@@ -221,20 +252,22 @@ int direntv6_create(struct unix_filesystem *u, const char *entry, uint16_t mode)
 	int num_inode = direntv6_dirlookup(u, ROOT_INUMBER, repertoire);
 	if(num_inode<=0) return ERR_BAD_PARAMETER;
 	/* Now we can continue because the parent exists */
-	int next = inode_alloc(u);
-	if(next<0) return next;
+	/* the new inode and the entry go in the same commit of the journal */
+	if((err=journal_begin(u))<0) return err;
+	int next = inode_alloc_near(u, (uint16_t)num_inode, mode);
 	struct inode ino;
 	memset(&ino,0,sizeof(ino));
 	ino.i_mode = mode;
-	if((err=inode_write(u,next,&ino))<0) return err;
+	err = (next<0) ? next : inode_write(u,next,&ino);
 	struct direntv6 dv6;
 	memset(&dv6,0,sizeof(dv6));
 	dv6.d_inumber= next;
 	strncpy(dv6.d_name, ptr, taille_elem);
 	struct filev6 fv6;
 	//on lit le repertoire parent
-	if ((err=filev6_open(u,num_inode,&fv6))<0) return err;
-	if((err=filev6_writebytes(u, &fv6, &dv6, sizeof(struct direntv6)))<0) return err;
+	if(err==0) err=filev6_open(u,num_inode,&fv6);
+	if(err==0) err=SECTOR_TAGGED(SECTOR_TAG_DIR, filev6_writebytes(u, &fv6, &dv6, sizeof(struct direntv6)));
+	journal_end(u);
 	
-    return next;
+    return (err<0) ? err : next;
 }
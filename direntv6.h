@@ -42,6 +42,14 @@ int direntv6_opendir(const struct unix_filesystem *u, uint16_t inr, struct direc
  */
 int direntv6_readdir(struct directory_reader *d, char *name, uint16_t *child_inr);
 
+/**
+ * @brief moves the reader to the given entry, without reading the ones before it
+ * @param d the directory reader
+ * @param index the number of the entry the next direntv6_readdir returns
+ * @return 0 on success; <0 on error
+ */
+int direntv6_seekdir(struct directory_reader *d, int32_t index);
+
 /**
  * @brief debugging routine; print the subtree (note: recursive)
  * @param u a mounted filesystem
@@ -3,6 +3,8 @@
  * @brief filesystem error messages
  */
 
+#include <errno.h>
+
 const char * const ERR_MESSAGES[] = {
     "", // no error
     "Not enough memory",
@@ -19,3 +21,20 @@ const char * const ERR_MESSAGES[] = {
     "bad parameter",
     "not enough sectors for inodes"
 };
+
+const int ERR_ERRNO[] = {
+    0, // no error
+    ENOMEM,
+    EIO,
+    EIO,
+    ENOENT,
+    ENAMETOOLONG,
+    ENOTDIR,
+    ENOENT,
+    EEXIST,
+    ENOSPC,
+    EFBIG,
+    EINVAL,
+    EINVAL,
+    ENOSPC
+};
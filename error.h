@@ -66,6 +66,14 @@ enum error_codes {
 extern
 const char * const ERR_MESSAGES[];
 
+/**
+* @brief the errno value matching each internal error (e.g. for FUSE
+* replies), indexed like ERR_MESSAGES. defined in error.c
+*
+*/
+extern
+const int ERR_ERRNO[];
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,230 @@
+/**
+ * @file export.c
+ * @brief copying a directory tree of the UNIX v6 filesystem to the host
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "export.h"
+#include "unixv6fs.h"
+#include "error.h"
+#include "sector.h"
+#include "inode.h"
+#include "filev6.h"
+#include "direntv6.h"
+
+struct export_job {
+    char *path;          /* path of the file on the host */
+    int32_t size;        /* size of the file in bytes */
+    int nb;              /* number of sectors of the file */
+    uint16_t *sectors;   /* block map of the file */
+};
+
+struct export_state {
+    struct unix_filesystem *u;
+    struct export_job *jobs;
+    int nb_jobs;
+    int capacity;
+    int next;            /* next job to be taken by a worker */
+    int err;             /* first error met by a worker */
+    pthread_mutex_t lock;
+    struct export_stats *stats;
+};
+
+/**
+ * @brief record a file to be copied by the workers
+ * @return 0 on success; <0 on error
+ */
+static int export_add_job(struct export_state *st, const char *path, const struct inode *ino)
+{
+    uint16_t sectors[MAX_FILE_SECTORS];
+    int nb = filev6_blockmap(st->u, ino, sectors);
+    if (nb < 0) return nb;
+
+    if (st->nb_jobs == st->capacity) {
+        int capacity = st->capacity ? 2 * st->capacity : 64;
+        struct export_job *bigger = realloc(st->jobs, capacity * sizeof(struct export_job));
+        if (bigger == NULL) return ERR_NOMEM;
+        st->jobs = bigger;
+        st->capacity = capacity;
+    }
+    struct export_job *job = &st->jobs[st->nb_jobs];
+    job->path = strdup(path);
+    job->sectors = malloc((nb ? nb : 1) * sizeof(uint16_t));
+    if ((job->path == NULL) || (job->sectors == NULL)) {
+        free(job->path);
+        free(job->sectors);
+        return ERR_NOMEM;
+    }
+    memcpy(job->sectors, sectors, nb * sizeof(uint16_t));
+    job->nb = nb;
+    job->size = inode_getsize(ino);
+    ++st->nb_jobs;
+
+    ++st->stats->files;
+    st->stats->bytes += job->size;
+    return 0;
+}
+
+/**
+ * @brief create the host directories of the subtree and record its files
+ * @param st the state of the export
+ * @param inr the directory to walk
+ * @param host_path the matching host directory (IN)
+ * @return 0 on success; <0 on error
+ */
+static int export_walk(struct export_state *st, uint16_t inr, const char *host_path)
+{
+    if ((mkdir(host_path, 0755) != 0) && (errno != EEXIST)) return ERR_IO;
+
+    struct directory_reader d;
+    int err = 0;
+    if ((err = direntv6_opendir(st->u, inr, &d)) < 0) return err;
+
+    char name[DIRENT_MAXLEN + 1];
+    uint16_t child_inr = 0;
+    while ((err = direntv6_readdir(&d, name, &child_inr)) > 0) {
+        /* free slots and the links to the directory itself and its parent */
+        if ((child_inr == 0) || (strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) continue;
+
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", host_path, name) >= (int) sizeof(path)) return ERR_FILENAME_TOO_LONG;
+        struct inode ino;
+        if ((err = inode_read(st->u, child_inr, &ino)) < 0) return err;
+        if ((ino.i_mode & IFMT) == IFDIR) {
+            ++st->stats->dirs;
+            err = export_walk(st, child_inr, path);
+        } else {
+            err = export_add_job(st, path, &ino);
+        }
+        if (err < 0) return err;
+    }
+    return err;
+}
+
+/**
+ * @brief copy one file to the host, one read per extent of at most EXPORT_CHUNK_SECTORS sectors
+ * @param buf room for EXPORT_CHUNK_SECTORS sectors
+ * @return 0 on success; <0 on error
+ */
+static int export_file(const struct export_state *st, const struct export_job *job, uint8_t *buf)
+{
+    int fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return ERR_IO;
+
+    int err = 0;
+    int first = 0;
+    while ((err == 0) && (first < job->nb)) {
+        int last = first + 1;
+        while ((last < job->nb) && (last - first < EXPORT_CHUNK_SECTORS)
+               && (job->sectors[last] == job->sectors[last - 1] + 1)) ++last;
+        if ((err = SECTOR_TAGGED(SECTOR_TAG_FILE, sectors_read(st->u->f, job->sectors[first], last - first, buf))) < 0) break;
+
+        /* the last sector of the file is only partly part of it */
+        size_t len = (size_t) (last - first) * SECTOR_SIZE;
+        if ((size_t) job->size - (size_t) first * SECTOR_SIZE < len) len = job->size - first * SECTOR_SIZE;
+        size_t done = 0;
+        while (done < len) {
+            ssize_t w = write(fd, buf + done, len - done);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                err = ERR_IO;
+                break;
+            }
+            done += w;
+        }
+        first = last;
+    }
+    if (close(fd) != 0 && err == 0) err = ERR_IO;
+    return err;
+}
+
+/**
+ * @brief worker thread: copies files until there is no job left or an error occured
+ */
+static void *export_worker(void *arg)
+{
+    struct export_state *st = arg;
+    uint8_t *buf = malloc(EXPORT_CHUNK_SECTORS * SECTOR_SIZE);
+    int err = (buf == NULL) ? ERR_NOMEM : 0;
+
+    while (err == 0) {
+        int index = -1;
+        pthread_mutex_lock(&st->lock);
+        if ((st->err == 0) && (st->next < st->nb_jobs)) index = st->next++;
+        pthread_mutex_unlock(&st->lock);
+        if (index < 0) break;
+        err = export_file(st, &st->jobs[index], buf);
+    }
+    if (err < 0) {
+        pthread_mutex_lock(&st->lock);
+        if (st->err == 0) st->err = err;
+        pthread_mutex_unlock(&st->lock);
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief recursively copy the content of a directory of the filesystem into
+ *        a host directory (created if needed). The tree is walked first, then
+ *        the files are copied by EXPORT_THREADS threads which read the data
+ *        extent by extent and write it byte for byte.
+ * @param u the mounted filesystem
+ * @param src_inr the inode number of the directory to export
+ * @param host_dir the path of the directory on the host (IN)
+ * @param stats what has been exported (OUT)
+ * @return 0 on success; <0 on error
+ */
+int export_tree(struct unix_filesystem *u, uint16_t src_inr, const char *host_dir, struct export_stats *stats)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(host_dir);
+    M_REQUIRE_NON_NULL(stats);
+    memset(stats, 0, sizeof(*stats));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct export_state st;
+    memset(&st, 0, sizeof(st));
+    st.u = u;
+    st.stats = stats;
+    pthread_mutex_init(&st.lock, NULL);
+
+    int err = export_walk(&st, src_inr, host_dir);
+
+    if (err == 0) {
+        pthread_t threads[EXPORT_THREADS];
+        int nb_threads = 0;
+        while ((nb_threads < EXPORT_THREADS) && (nb_threads < st.nb_jobs)
+               && (pthread_create(&threads[nb_threads], NULL, export_worker, &st) == 0)) {
+            ++nb_threads;
+        }
+        /* no thread could be started: copy in this one */
+        if ((nb_threads == 0) && (st.nb_jobs > 0)) export_worker(&st);
+        for (int i = 0; i < nb_threads; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        err = st.err;
+    }
+
+    for (int i = 0; i < st.nb_jobs; ++i) {
+        free(st.jobs[i].path);
+        free(st.jobs[i].sectors);
+    }
+    free(st.jobs);
+    pthread_mutex_destroy(&st.lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return err;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+/**
+ * @file export.h
+ * @brief copying a directory tree of the UNIX v6 filesystem to the host
+ */
+
+#include <stdint.h>
+#include "mount.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* number of threads writing the host files */
+#define EXPORT_THREADS 8
+
+/* number of sectors read per I/O (at most one extent) */
+#define EXPORT_CHUNK_SECTORS 128
+
+struct export_stats {
+    unsigned int files;   /* number of regular files written on the host */
+    unsigned int dirs;    /* number of directories created on the host */
+    uint64_t bytes;       /* number of bytes of file content copied */
+    double seconds;       /* duration of the whole export */
+};
+
+/**
+ * @brief recursively copy the content of a directory of the filesystem into
+ *        a host directory (created if needed). The tree is walked first, then
+ *        the files are copied by EXPORT_THREADS threads which read the data
+ *        extent by extent and write it byte for byte.
+ * @param u the mounted filesystem
+ * @param src_inr the inode number of the directory to export
+ * @param host_dir the path of the directory on the host (IN)
+ * @param stats what has been exported (OUT)
+ * @return 0 on success; <0 on error
+ */
+int export_tree(struct unix_filesystem *u, uint16_t src_inr, const char *host_dir, struct export_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
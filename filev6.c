@@ -3,16 +3,29 @@
  * @brief accessing the UNIX v6 filesystem -- file part of inode/file layer
  *
  */
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "mount.h"
+#include "journal.h"
 #include "filev6.h"
 #include "error.h"
 #include "inode.h"
 #include "unixv6fs.h"
-#include <math.h>
 
-#define MAX_SIZE_FILE 7*256*512
-#define MAX_SMALL_FILE 4*1000
+#define MAX_SMALL_FILE (ADDR_SMALL_LENGTH*SECTOR_SIZE)
+#define NB_SECTORS(size) (((size)+SECTOR_SIZE-1)/SECTOR_SIZE)
+#define NB_INDIRECT(nb) (((nb)+ADDRESSES_PER_SECTOR-1)/ADDRESSES_PER_SECTOR)
+
+/*
+ * Block map of a file: the disk sector of each SECTOR_SIZE part of the file
+ * and, for large files, the indirect sectors which hold those numbers.
+ */
+struct filev6_map {
+    uint16_t sectors[MAX_FILE_SECTORS];
+    uint16_t indirect[ADDR_SMALL_LENGTH];
+    int nb_indirect;
+};
 
 /**
  * @brief open up a file corresponding to a given inode; set offset to zero
@@ -60,11 +73,11 @@ int filev6_readblock(struct filev6 *fv6, void *buf)
         //offset ne désigne pas le dernier secteur à lire de l'inode
         if(bytes_read > SECTOR_SIZE) {
             bytes_read=SECTOR_SIZE;
-            if( (r=sector_read(fv6->u->f,sector_number,buf)) <0 ) return r;
+            if( (r=SECTOR_TAGGED(SECTOR_TAG_FILE, journal_read(fv6->u,sector_number,1,buf))) <0 ) return r;
         }
         //offset désigne le dernier secteur à lire de l'inode (le secteur n'a donc pas forcement 512 octets remplis)
         else {
-            if( (r=sector_read(fv6->u->f,sector_number,buf)) <0 ) return r;
+            if( (r=SECTOR_TAGGED(SECTOR_TAG_FILE, journal_read(fv6->u,sector_number,1,buf))) <0 ) return r;
         }
 
         fv6->offset+= bytes_read;
@@ -107,87 +120,433 @@ int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6)
 }
 
 /**
- * @brief write the len bytes of the given buffer on disk to the given filev6
+ * @brief load the block map of an inode (reads the indirect sectors of large files)
  * @param u the filesystem (IN)
- * @param fv6 the filev6 (IN)
+ * @param ino the inode (IN)
+ * @param map the block map of the file (OUT)
+ * @return 0 on success; <0 on errror
+ */
+static int filev6_map_load(const struct unix_filesystem *u, const struct inode *ino, struct filev6_map *map)
+{
+    int err=0;
+    int32_t size = inode_getsize(ino);
+    int nb = NB_SECTORS(size);
+    memset(map,0,sizeof(*map));
+
+    /* small file: the sectors are directly in i_addr */
+    if(size<=MAX_SMALL_FILE) {
+        memcpy(map->sectors,ino->i_addr,nb*sizeof(uint16_t));
+        return 0;
+    }
+    /* large file: each i_addr holds an indirect sector of ADDRESSES_PER_SECTOR sectors,
+     * read through the journal (its running transaction may hold a newer copy) */
+    map->nb_indirect = NB_INDIRECT(nb);
+    for(int i=0; i<map->nb_indirect; ++i) {
+        map->indirect[i]=ino->i_addr[i];
+        if((err=SECTOR_TAGGED(SECTOR_TAG_INODE, journal_read(u,map->indirect[i],1,&map->sectors[i*ADDRESSES_PER_SECTOR])))<0) return err;
+    }
+    return 0;
+}
+
+/**
+ * @brief get the sector of each SECTOR_SIZE part of a file
+ * @param u the filesystem (IN)
+ * @param inode the inode of the file (IN)
+ * @param sectors room for MAX_FILE_SECTORS sector numbers (OUT)
+ * @return the number of sectors of the file; <0 on errror
+ */
+int filev6_blockmap(const struct unix_filesystem *u, const struct inode *inode, uint16_t *sectors)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(inode);
+    M_REQUIRE_NON_NULL(sectors);
+    if(inode_getsize(inode)>MAX_SIZE_FILE) return ERR_FILE_TOO_LARGE;
+
+    int err=0;
+    struct filev6_map map;
+    if((err=filev6_map_load(u,inode,&map))<0) return err;
+    int nb = NB_SECTORS(inode_getsize(inode));
+    memcpy(sectors,map.sectors,nb*sizeof(uint16_t));
+    return nb;
+}
+
+/**
+ * @brief open a file for repeated reads: load its inode and its block map
+ * @param u the filesystem (IN)
+ * @param inr the inode number (IN)
+ * @param h the new handle, to be released by filev6_handle_close (OUT)
+ * @return 0 on success; <0 on errror
+ */
+int filev6_handle_open(const struct unix_filesystem *u, uint16_t inr, struct filev6_handle **h)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(h);
+    struct filev6_handle *fh = calloc(1, sizeof(struct filev6_handle));
+    if(fh==NULL) return ERR_NOMEM;
+    int err=0;
+    if((err=filev6_open(u,inr,&fh->fv6))<0
+       || (err=filev6_blockmap(u,&fh->fv6.i_node,fh->sectors))<0) {
+        free(fh);
+        return err;
+    }
+    fh->nb_sectors=err;
+    fh->size=inode_getsize(&fh->fv6.i_node);
+    pthread_mutex_init(&fh->lock,NULL);
+    *h=fh;
+    return 0;
+}
+
+/**
+ * @brief read the nb sectors of a block map into buf, one pread per extent
+ *        of contiguous sectors
+ * @return 0 on success; <0 on errror
+ */
+static int filev6_read_extents(const struct unix_filesystem *u, const uint16_t *sectors, int nb, uint8_t *buf)
+{
+    int err=0;
+    for(int k=0; k<nb; ) {
+        int last=k+1;
+        while((last<nb) && (sectors[last]==sectors[last-1]+1)) ++last;
+        if((err=SECTOR_TAGGED(SECTOR_TAG_FILE, journal_read(u,sectors[k],last-k,buf+k*SECTOR_SIZE)))<0) return err;
+        k=last;
+    }
+    return 0;
+}
+
+/**
+ * @brief fill the readahead window with nb sectors of the file from the first one
+ * @return 0 on success; <0 on errror
+ */
+static int filev6_handle_fill(struct filev6_handle *h, int first, int nb)
+{
+    int err=0;
+    if(h->ra==NULL && (h->ra=malloc(READAHEAD_SECTORS*SECTOR_SIZE))==NULL) return ERR_NOMEM;
+    h->ra_nb=0;
+    if((err=filev6_read_extents(h->fv6.u,&h->sectors[first],nb,h->ra))<0) return err;
+    h->ra_first=first;
+    h->ra_nb=nb;
+    return 0;
+}
+
+/**
+ * @brief read size bytes of an open file from the given offset; a read
+ *        following the previous one fills the whole readahead window
+ * @param h the handle (IN-OUT; the readahead window will be changed)
+ * @param buf room for size bytes (OUT)
+ * @param size the number of bytes to read
+ * @param offset where to start reading in the file
+ * @return the number of bytes read (0 at end of file); <0 on errror
+ */
+int filev6_handle_read(struct filev6_handle *h, void *buf, size_t size, int32_t offset)
+{
+    M_REQUIRE_NON_NULL(h);
+    M_REQUIRE_NON_NULL(buf);
+    if(offset<0) return ERR_OFFSET_OUT_OF_RANGE;
+
+    int err=0;
+    size_t done=0;
+    pthread_mutex_lock(&h->lock);
+    if(offset>=h->size) {
+        size=0;
+    } else if(size>(size_t)(h->size-offset)) {
+        size=h->size-offset;
+    }
+    /* a written file is entirely in its write-back cache */
+    if(h->cache!=NULL) {
+        memcpy(buf,h->cache+offset,size);
+        done=size;
+    }
+    while((err==0) && (done<size)) {
+        int32_t pos = offset+done;
+        int k = pos/SECTOR_SIZE;
+        if((k>=h->ra_first) && (k<h->ra_first+h->ra_nb)) {
+            size_t avail = (size_t)(h->ra_first+h->ra_nb)*SECTOR_SIZE-pos;
+            size_t len = (avail<size-done) ? avail : size-done;
+            memcpy((uint8_t*)buf+done,h->ra+(pos-h->ra_first*SECTOR_SIZE),len);
+            done+=len;
+            continue;
+        }
+        /* sequential reads get the whole window, others only what they need */
+        int nb = NB_SECTORS(pos%SECTOR_SIZE+size-done);
+        if(pos==h->next || k==h->ra_first+h->ra_nb) nb=READAHEAD_SECTORS;
+        if(nb>READAHEAD_SECTORS) nb=READAHEAD_SECTORS;
+        if(nb>h->nb_sectors-k) nb=h->nb_sectors-k;
+        err=filev6_handle_fill(h,k,nb);
+    }
+    h->next=offset+done;
+    pthread_mutex_unlock(&h->lock);
+    return (err<0) ? err : (int)done;
+}
+
+/**
+ * @brief release a handle opened by filev6_handle_open; unflushed writes are lost
+ * @param h the handle
+ */
+void filev6_handle_close(struct filev6_handle *h)
+{
+    if(h!=NULL) {
+        pthread_mutex_destroy(&h->lock);
+        free(h->ra);
+        free(h->cache);
+        free(h);
+    }
+}
+
+/**
+ * @brief give back to the free bitmap the given sectors, when the running
+ *        transaction of the journal commits (see journal_free)
+ * @param u the filesystem (IN)
+ * @param sectors the sectors to release (IN)
+ * @param nb the number of sectors
+ */
+static void filev6_release(struct unix_filesystem *u, const uint16_t *sectors, int nb)
+{
+    for(int k=0; k<nb; ++k) {
+        journal_free(u,sectors[k]);
+    }
+}
+
+/**
+ * @brief give back the sectors which an operation that then failed added
+ *        to a file: its data and indirect sectors past those of before
+ * @param u the filesystem (IN)
+ * @param before the inode of the file before the operation (IN)
+ * @param after the inode the operation built (IN)
+ */
+static void filev6_release_added(struct unix_filesystem *u, const struct inode *before, const struct inode *after)
+{
+    struct filev6_map old_map;
+    struct filev6_map new_map;
+    if((filev6_map_load(u,before,&old_map)<0)||(filev6_map_load(u,after,&new_map)<0)) return;
+    int old_nb = NB_SECTORS(inode_getsize(before));
+    int new_nb = NB_SECTORS(inode_getsize(after));
+    if(new_nb>old_nb) filev6_release(u,&new_map.sectors[old_nb],new_nb-old_nb);
+    if(new_map.nb_indirect>old_map.nb_indirect) {
+        filev6_release(u,&new_map.indirect[old_map.nb_indirect],new_map.nb_indirect-old_map.nb_indirect);
+    }
+}
+
+/**
+ * @brief the preferred sector for the next sectors of a file: right after
+ *        its last sector, or for an empty file, the part of the data area
+ *        which corresponds to its inode sector, so that the files of a
+ *        directory (whose inodes are close, see inode_alloc_near) are close
+ * @param u the filesystem (IN)
+ * @param inr the inode number of the file
+ * @param sectors the sectors of the file (IN)
+ * @param nb the number of sectors of the file
+ * @return the preferred sector
+ */
+static uint64_t filev6_goal(const struct unix_filesystem *u, uint16_t inr, const uint16_t *sectors, int nb)
+{
+    if(nb>0) return (uint64_t)sectors[nb-1]+1;
+    uint32_t data = u->s.s_fsize-u->s.s_block_start;
+    return u->s.s_block_start+(uint64_t)(inr/INODES_PER_SECTOR)*data/u->s.s_isize;
+}
+
+/**
+ * @brief reserve nb free sectors in the free bitmap, the first free ones from goal on;
+ *        if there are none left, the running transaction is committed first
+ *        when it has freed sectors
+ * @param u the filesystem (IN)
+ * @param sectors the reserved sectors (OUT)
+ * @param nb the number of sectors to reserve
+ * @param goal the preferred first sector (see filev6_goal)
+ * @return 0 on success; <0 on errror (nothing is reserved then)
+ */
+static int filev6_alloc(struct unix_filesystem *u, uint16_t *sectors, int nb, uint64_t goal)
+{
+    for(int k=0; k<nb; ++k) {
+        int next = bm_find_next_from(u->fbm,goal);
+        // les secteurs libérés par la transaction ne reviennent qu'à son commit
+        if((next<0) && (journal_freed(u)>0) && (journal_commit(u)==0)) {
+            next = bm_find_next_from(u->fbm,goal);
+        }
+        if(next<0) {
+            filev6_release(u,sectors,k);
+            return next;
+        }
+        bm_set(u->fbm,next);
+        sectors[k]=next;
+        goal=(uint64_t)next+1;
+    }
+    return 0;
+}
+
+/**
+ * @brief report that file content is written in place to nb sectors: the
+ *        next commit of the journal syncs it (see journal_data), and the
+ *        Merkle trees read these sectors again (see merkle_update)
+ * @param u the filesystem (IN)
+ * @param sectors the sectors written (IN)
+ * @param nb the number of sectors
+ */
+static void filev6_written(struct unix_filesystem *u, const uint16_t *sectors, int nb)
+{
+    journal_data(u);
+    if(u->written==NULL) return;
+    ++u->write_seq;
+    for(int k=0; k<nb; ++k) {
+        if(sectors[k]<u->s.s_fsize) u->written[sectors[k]]=u->write_seq;
+    }
+}
+
+/**
+ * @brief write len bytes of data to nb sectors, one I/O per run of contiguous
+ *        sectors; the end of the last sector is padded with zeros
+ * @param u the filesystem (IN)
+ * @param sectors the sectors where to write the data (IN)
+ * @param nb the number of sectors
+ * @param data the bytes to write (IN)
+ * @param len the number of bytes, at most nb*SECTOR_SIZE
+ * @param meta whether the data is the content of a directory, which goes through the journal
+ * @return 0 on success; <0 on errror
+ */
+static int filev6_write_extents(struct unix_filesystem *u, const uint16_t *sectors, int nb, const uint8_t *data, int len, int meta)
+{
+    static const uint8_t zeros[SECTOR_SIZE];
+    int err=0;
+    int first=0;
+    for(int k=0; meta && (k<nb); ++k) {
+        uint8_t secteur[SECTOR_SIZE];
+        int nb_bytes = (len-k*SECTOR_SIZE<SECTOR_SIZE) ? len-k*SECTOR_SIZE : SECTOR_SIZE;
+        memset(secteur,0,SECTOR_SIZE);
+        memcpy(secteur,data+k*SECTOR_SIZE,nb_bytes);
+        if((err=journal_write(u,sectors[k],1,secteur))<0) return err;
+    }
+    if(meta) return 0;
+    if(nb>0) filev6_written(u,sectors,nb);
+    while(first<nb) {
+        int last=first+1;
+        while((last<nb)&&(sectors[last]==sectors[last-1]+1)) ++last;
+        /* the data of the run, plus the padding of the last sector if the run ends the data */
+        struct iovec iov[2];
+        int iovcnt=1;
+        int begin=first*SECTOR_SIZE;
+        int end=(last*SECTOR_SIZE<len) ? last*SECTOR_SIZE : len;
+        iov[0].iov_base=(void *)(data+begin);
+        iov[0].iov_len=end-begin;
+        if(end%SECTOR_SIZE!=0) {
+            iov[1].iov_base=(void *)zeros;
+            iov[1].iov_len=SECTOR_SIZE-end%SECTOR_SIZE;
+            ++iovcnt;
+        }
+        if((err=SECTOR_TAGGED(SECTOR_TAG_FILE, sectors_writev(u->f,sectors[first],iov,iovcnt)))<0) return err;
+        first=last;
+    }
+    return 0;
+}
+
+/**
+ * @brief store the block map of a file into its inode (and its indirect sectors)
+ * @param u the filesystem (IN)
+ * @param ino the inode, whose size must already be the new one (IN-OUT)
+ * @param map the block map of the file (IN-OUT; new indirect sectors are added)
+ * @param first_dirty the first entry of the map which changed
+ * @return 0 on success; <0 on errror
+ */
+static int filev6_map_store(struct unix_filesystem *u, struct inode *ino, struct filev6_map *map, int first_dirty)
+{
+    int err=0;
+    int nb = NB_SECTORS(inode_getsize(ino));
+    memset(ino->i_addr,0,sizeof(ino->i_addr));
+
+    if(inode_getsize(ino)<=MAX_SMALL_FILE) {
+        memcpy(ino->i_addr,map->sectors,nb*sizeof(uint16_t));
+        ino->i_mode &= ~ILARG;
+        return 0;
+    }
+
+    /* the direct addresses of a small file which grows all move into indirect sectors */
+    if(map->nb_indirect==0) first_dirty=0;
+    int nb_indirect = NB_INDIRECT(nb);
+    int old_indirect = map->nb_indirect;
+    if(nb_indirect>old_indirect) {
+        if((err=filev6_alloc(u,&map->indirect[old_indirect],nb_indirect-old_indirect,(uint64_t)map->sectors[nb-1]+1))<0) return err;
+        map->nb_indirect=nb_indirect;
+    }
+    for(int i=first_dirty/ADDRESSES_PER_SECTOR; i<nb_indirect; ++i) {
+        if((err=SECTOR_TAGGED(SECTOR_TAG_INODE, journal_write(u,map->indirect[i],1,&map->sectors[i*ADDRESSES_PER_SECTOR])))<0) {
+            filev6_release(u,&map->indirect[old_indirect],nb_indirect-old_indirect);
+            map->nb_indirect=old_indirect;
+            return err;
+        }
+    }
+    memcpy(ino->i_addr,map->indirect,nb_indirect*sizeof(uint16_t));
+    ino->i_mode |= ILARG;
+    return 0;
+}
+
+/**
+ * @brief append the len bytes of the given buffer to the given filev6; only
+ *        fv6->i_node is updated, the caller writes the inode to disk
+ * @param u the filesystem (IN)
+ * @param fv6 the filev6 (IN-OUT)
  * @param buf the data we want to write (IN)
  * @param len the length of the bytes we want to write
  * @return 0 on success; <0 on errror
  */
-
-int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, void *buf, int len)
+int filev6_append(struct unix_filesystem *u, struct filev6 *fv6, const void *buf, int len)
 {
-	M_REQUIRE_NON_NULL(u);
-	M_REQUIRE_NON_NULL(fv6);
-	M_REQUIRE_NON_NULL(buf);
-	
-	int err=0;
-	/* actual size of the file */
-	int inode_size = inode_getsize(&fv6->i_node);
-	if(inode_size>MAX_SIZE_FILE) return ERR_FILE_TOO_LARGE;
-	int nb_bytes = 0;
-	int taille_rest1 = len-(fv6->offset);
-	int index =0;
-	
-	/* The size is a multiple of sector size */
-	if(inode_size%SECTOR_SIZE ==0){	
-		/* We find the next sector */
-		int num_sector = bm_find_next(u->fbm);
-		if(num_sector<0) return num_sector;
-		if(taille_rest1<=SECTOR_SIZE){
-			nb_bytes = taille_rest1;
-		}else{
-			nb_bytes = SECTOR_SIZE;
-		}
-		/* We wrote all the data from buf */
-		if(nb_bytes ==0) return 0;
-		
-		/* Else we write the new sector */
-		if((err=sector_write(u->f, num_sector, buf))<0) return err;
-		bm_set(u->fbm,num_sector);
-		
-		/* We update the foffset */
-		fv6->offset += nb_bytes;
-		int counter = inode_size + nb_bytes;
-		index = floor(counter/SECTOR_SIZE);
-		/* We update the adresses of the inode */
-		fv6->i_node.i_addr[index]= num_sector;
-		/* We update the size */ 
-		int total_size= inode_size+nb_bytes;
-		inode_setsize(&(fv6->i_node), total_size);		
-	}else{
-		/* How many bytes does the last sector od data contain */
-		int rempli = inode_size%SECTOR_SIZE;
-		int taille_rest2 = SECTOR_SIZE-rempli;
-		if(taille_rest1 <= taille_rest2){
-			nb_bytes = taille_rest1;
-		}else{
-			nb_bytes = taille_rest2;
-		}
-		/* We wrote all the data */
-		if(nb_bytes == 0) return 0;
-		/* Else we get the last sector and we read it */
-		index = floor(inode_size/SECTOR_SIZE);
-		uint8_t secteur[SECTOR_SIZE];
-		if((err=sector_read(u->f, fv6->i_node.i_addr[index],secteur))<0) return err;
-		/* Then we update it with the information from buf */
-		memcpy(secteur+rempli,buf,nb_bytes);
-		/* We write the updated sector */
-		if((err=sector_write(u->f, fv6->i_node.i_addr[index],secteur))<0) return err; 
-		/* We update the offset and the total size */
-		fv6->offset += nb_bytes;
-		int total_size= inode_size+nb_bytes;
-		inode_setsize(&(fv6->i_node), total_size);
-	}
-	putchar('\n');
-	printf("write sector is : %d\n",nb_bytes);
-	
-	return nb_bytes;
-	
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(fv6);
+    M_REQUIRE_NON_NULL(buf);
+    if(len<0) return ERR_BAD_PARAMETER;
+
+    int err=0;
+    int32_t size = inode_getsize(&fv6->i_node);
+    if((size+len) > MAX_SIZE_FILE) return ERR_FILE_TOO_LARGE;
+    if(len==0) return 0;
+
+    struct filev6_map map;
+    if((err=filev6_map_load(u,&fv6->i_node,&map))<0) return err;
+
+    const uint8_t *data = buf;
+    int old_nb = NB_SECTORS(size);
+    int new_nb = NB_SECTORS(size+len);
+    int rest = len;
+    /* the content of a directory is metadata: it goes through the journal */
+    int meta = ((fv6->i_node.i_mode & IFMT)==IFDIR);
+
+    /* We first complete the last sector of the file if it is partially filled */
+    int used = size%SECTOR_SIZE;
+    if(used!=0) {
+        uint8_t secteur[SECTOR_SIZE];
+        int nb_bytes = (rest < SECTOR_SIZE-used) ? rest : SECTOR_SIZE-used;
+        if((err=SECTOR_TAGGED(SECTOR_TAG_FILE, journal_read(u,map.sectors[old_nb-1],1,secteur)))<0) return err;
+        memcpy(secteur+used,data,nb_bytes);
+        if(meta) err=journal_write(u,map.sectors[old_nb-1],1,secteur);
+        else {
+            filev6_written(u,&map.sectors[old_nb-1],1);
+            err=SECTOR_TAGGED(SECTOR_TAG_FILE, sector_write(u->f,map.sectors[old_nb-1],secteur));
+        }
+        if(err<0) return err;
+        data+=nb_bytes;
+        rest-=nb_bytes;
+    }
+
+    /* We allocate all the new sectors at once, then write them by extents */
+    if((err=filev6_alloc(u,&map.sectors[old_nb],new_nb-old_nb,filev6_goal(u,fv6->i_number,map.sectors,old_nb)))<0) return err;
+    err=filev6_write_extents(u,&map.sectors[old_nb],new_nb-old_nb,data,rest,meta);
+
+    /* We update the block map and the size */
+    struct inode ino = fv6->i_node;
+    inode_setsize(&ino,size+len);
+    inode_nextversion(&ino);
+    if(err>=0) err=filev6_map_store(u,&ino,&map,old_nb);
+    if(err<0) {
+        filev6_release(u,&map.sectors[old_nb],new_nb-old_nb);
+        return err;
+    }
+    fv6->i_node=ino;
+    fv6->offset=size+len;
+
+    return 0;
 }
 
 /**
  * @brief write the len bytes of the given buffer on disk to the given filev6
+ *        (appended at the end of the file; the inode is written once)
  * @param u the filesystem (IN)
  * @param fv6 the filev6 (IN)
  * @param buf the data we want to write (IN)
@@ -196,37 +555,264 @@ int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, void *buf,
  */
 int filev6_writebytes(struct unix_filesystem *u, struct filev6 *fv6, void *buf, int len)
 {
-	M_REQUIRE_NON_NULL(u);
-	M_REQUIRE_NON_NULL(fv6);
-	M_REQUIRE_NON_NULL(buf);
-	
-	int size = inode_getsize(&(fv6->i_node));
-	
-	if((size+len) > MAX_SMALL_FILE) return ERR_FILE_TOO_LARGE; 
-	int written =0;
-	int err =0;
-	int taille = len;
-	
-	/* While we didn't write all the data */
-	while((written= filev6_writesector(u,fv6,buf,len))>0){
-		size_t i=0;
-		/* We decrement the size of buf by how much we wrote */
-		taille-=written;
-		if(taille>0){
-			/* We increment buf untill we get to the new data */
-			while(i<written){
-				++buf;
-				++i;
-			}
-		}
-	}
-	/* If we got an error */
-	if(written<0) return written;
-	/* We write the new inode */
-	if((err=inode_write(u,fv6->i_number,&(fv6->i_node)))<0) return err;
-	
+    int err=0;
+    if((err=journal_begin(u))<0) return err;
+    struct filev6 before = *fv6;
+    err=filev6_append(u,fv6,buf,len);
+    if((err==0) && (len!=0) && (err=inode_write(u,fv6->i_number,&fv6->i_node))<0) {
+        filev6_release_added(u,&before.i_node,&fv6->i_node);
+        *fv6=before;
+    }
+    journal_end(u);
+    return err;
+}
+
+/**
+ * @brief like filev6_append, but from a host file into an empty filev6, by
+ *        chunks of IMPORT_CHUNK_SECTORS sectors allocated up front; the
+ *        caller writes the inode to disk
+ * @param u the filesystem (IN)
+ * @param fv6 the filev6, which must be empty (IN-OUT)
+ * @param src the host file, read from its current position (IN)
+ * @param size the number of bytes to copy
+ * @return 0 on success; <0 on errror
+ */
+int filev6_append_file(struct unix_filesystem *u, struct filev6 *fv6, FILE *src, int32_t size)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(fv6);
+    M_REQUIRE_NON_NULL(src);
+    if((size<0)||(inode_getsize(&fv6->i_node)!=0)) return ERR_BAD_PARAMETER;
+    if(size>MAX_SIZE_FILE) return ERR_FILE_TOO_LARGE;
+
+    int err=0;
+    struct filev6_map map;
+    memset(&map,0,sizeof(map));
+    int nb = NB_SECTORS(size);
+    uint8_t *chunk = malloc(IMPORT_CHUNK_SECTORS*SECTOR_SIZE);
+    if(chunk==NULL) return ERR_NOMEM;
+    if((err=filev6_alloc(u,map.sectors,nb,filev6_goal(u,fv6->i_number,map.sectors,0)))<0) {
+        free(chunk);
+        return err;
+    }
+
+    for(int k=0; (k<nb)&&(err>=0); k+=IMPORT_CHUNK_SECTORS) {
+        int nb_sectors = (nb-k<IMPORT_CHUNK_SECTORS) ? nb-k : IMPORT_CHUNK_SECTORS;
+        int len = (size-k*SECTOR_SIZE<nb_sectors*SECTOR_SIZE) ? size-k*SECTOR_SIZE : nb_sectors*SECTOR_SIZE;
+        if(fread(chunk,1,len,src)!=(size_t)len) {
+            err=ERR_IO;
+        } else {
+            err=filev6_write_extents(u,&map.sectors[k],nb_sectors,chunk,len,0);
+        }
+    }
+    free(chunk);
+
+    struct inode ino = fv6->i_node;
+    inode_setsize(&ino,size);
+    inode_nextversion(&ino);
+    if(err>=0) err=filev6_map_store(u,&ino,&map,0);
+    if(err<0) {
+        filev6_release(u,map.sectors,nb);
+        return err;
+    }
+    fv6->i_node=ino;
+    fv6->offset=size;
     return 0;
 }
 
+/**
+ * @brief filev6_append_file, then the inode is written, in one transaction;
+ *        if it cannot be, the sectors the copy added are released
+ *        (the parameters are those of filev6_append_file)
+ * @return 0 on success; <0 on errror
+ */
+int filev6_import(struct unix_filesystem *u, struct filev6 *fv6, FILE *src, int32_t size)
+{
+    int err=0;
+    if((err=journal_begin(u))<0) return err;
+    struct filev6 before = *fv6;
+    err=filev6_append_file(u,fv6,src,size);
+    if((err==0) && (err=inode_write(u,fv6->i_number,&fv6->i_node))<0) {
+        filev6_release_added(u,&before.i_node,&fv6->i_node);
+        *fv6=before;
+    }
+    journal_end(u);
+    return err;
+}
+
+/**
+ * @brief make sure the write-back cache holds the whole file and room for
+ *        need bytes; the bytes past the end of the file are kept to zero
+ * @return 0 on success; <0 on errror
+ */
+static int filev6_handle_load(struct filev6_handle *h, int32_t need)
+{
+    int err=0;
+    const int step = READAHEAD_SECTORS*SECTOR_SIZE;
+    int32_t wanted = (need>h->size) ? need : h->size;
+    int capacity = (wanted+step-1)/step*step;
+    if(capacity>MAX_SIZE_FILE) capacity=MAX_SIZE_FILE;
+    if(capacity==0) capacity=step;
+
+    if(h->cache==NULL) {
+        if((h->cache=calloc(capacity,1))==NULL) return ERR_NOMEM;
+        h->cache_capacity=capacity;
+        if((err=filev6_read_extents(h->fv6.u,h->sectors,h->nb_sectors,h->cache))<0) {
+            free(h->cache);
+            h->cache=NULL;
+            return err;
+        }
+        memset(h->cache+h->size,0,NB_SECTORS(h->size)*SECTOR_SIZE-h->size);
+    } else if(capacity>h->cache_capacity) {
+        uint8_t *bigger=realloc(h->cache,capacity);
+        if(bigger==NULL) return ERR_NOMEM;
+        memset(bigger+h->cache_capacity,0,capacity-h->cache_capacity);
+        h->cache=bigger;
+        h->cache_capacity=capacity;
+    }
+    return 0;
+}
+
+/**
+ * @brief mark as dirty the sectors of the file from the one holding the byte
+ *        first to the one holding the byte last
+ */
+static void filev6_handle_touch(struct filev6_handle *h, int32_t first, int32_t last)
+{
+    for(int k=first/SECTOR_SIZE; k<=last/SECTOR_SIZE; ++k) {
+        h->dirty_sectors[k]=1;
+    }
+    h->dirty=1;
+}
+
+/**
+ * @brief write size bytes to an open file at the given offset; the data
+ *        stays in the write-back cache of the handle until filev6_handle_flush
+ * @param h the handle (IN-OUT)
+ * @param buf the data to write (IN)
+ * @param size the number of bytes to write
+ * @param offset where to write in the file (a hole before it reads as zeros)
+ * @return the number of bytes written; <0 on errror
+ */
+int filev6_handle_write(struct filev6_handle *h, const void *buf, size_t size, int32_t offset)
+{
+    M_REQUIRE_NON_NULL(h);
+    M_REQUIRE_NON_NULL(buf);
+    if(offset<0) return ERR_OFFSET_OUT_OF_RANGE;
+    if((size_t)offset+size>MAX_SIZE_FILE) return ERR_FILE_TOO_LARGE;
+    if(size==0) return 0;
+
+    int err=0;
+    pthread_mutex_lock(&h->lock);
+    int32_t end = offset+(int32_t)size;
+    if((err=filev6_handle_load(h,end))==0) {
+        memcpy(h->cache+offset,buf,size);
+        filev6_handle_touch(h,offset,end-1);
+        /* the hole and the former last sector are written too */
+        if(offset>h->size) filev6_handle_touch(h,h->size,offset);
+        if(end>h->size) h->size=end;
+    }
+    pthread_mutex_unlock(&h->lock);
+    return (err<0) ? err : (int)size;
+}
+
+/**
+ * @brief change the size of an open file, in the write-back cache
+ * @param h the handle (IN-OUT)
+ * @param size the new size (the file is cut or completed with zeros)
+ * @return 0 on success; <0 on errror
+ */
+int filev6_handle_truncate(struct filev6_handle *h, int32_t size)
+{
+    M_REQUIRE_NON_NULL(h);
+    if((size<0)||(size>MAX_SIZE_FILE)) return ERR_FILE_TOO_LARGE;
+
+    int err=0;
+    pthread_mutex_lock(&h->lock);
+    if((size!=h->size) && (err=filev6_handle_load(h,size))==0) {
+        if(size<h->size) {
+            memset(h->cache+size,0,h->size-size);
+            h->dirty=1;
+        } else {
+            filev6_handle_touch(h,h->size,size-1);
+        }
+        h->size=size;
+    }
+    pthread_mutex_unlock(&h->lock);
+    return err;
+}
+
+/**
+ * @brief write the unflushed changes of an open file to disk: sectors are
+ *        allocated or released all at once, the dirty sectors are written
+ *        one I/O per extent of contiguous sectors, then the block map and
+ *        the inode. Must be called under the exclusive lock of the filesystem.
+ * @param u the filesystem (IN)
+ * @param h the handle (IN-OUT)
+ * @return 0 on success; <0 on errror
+ */
+int filev6_handle_flush(struct unix_filesystem *u, struct filev6_handle *h)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(h);
+    int err=0;
+    pthread_mutex_lock(&h->lock);
+    if(!h->dirty) {
+        pthread_mutex_unlock(&h->lock);
+        return 0;
+    }
+    /* the block map and the inode of the file go in the same commit */
+    if((err=journal_begin(u))<0) {
+        pthread_mutex_unlock(&h->lock);
+        return err;
+    }
+
+    struct filev6_map map;
+    int old_nb = h->nb_sectors;
+    int new_nb = NB_SECTORS(h->size);
+    if((err=filev6_map_load(u,&h->fv6.i_node,&map))==0 && new_nb>old_nb) {
+        err=filev6_alloc(u,&map.sectors[old_nb],new_nb-old_nb,filev6_goal(u,h->fv6.i_number,map.sectors,old_nb));
+    }
 
+    for(int k=0; (err==0) && (k<new_nb); ) {
+        if(!h->dirty_sectors[k]) {
+            ++k;
+            continue;
+        }
+        int last=k+1;
+        while((last<new_nb) && h->dirty_sectors[last] && (map.sectors[last]==map.sectors[last-1]+1)) ++last;
+        filev6_written(u,&map.sectors[k],last-k);
+        err=SECTOR_TAGGED(SECTOR_TAG_FILE, sectors_write(u->f,map.sectors[k],last-k,h->cache+k*SECTOR_SIZE));
+        k=last;
+    }
 
+    struct inode ino = h->fv6.i_node;
+    inode_setsize(&ino,h->size);
+    inode_nextversion(&ino);
+    /* the indirect sectors which are no more needed go with the data sectors */
+    int nb_indirect = (h->size>MAX_SMALL_FILE) ? NB_INDIRECT(new_nb) : 0;
+    int old_indirect = map.nb_indirect;
+    if((err==0) && (nb_indirect<old_indirect)) map.nb_indirect=nb_indirect;
+    if(err==0) err=filev6_map_store(u,&ino,&map,(old_nb<new_nb) ? old_nb : new_nb);
+    if(err==0) err=inode_write(u,h->fv6.i_number,&ino);
+    if(err<0) {
+        if(new_nb>old_nb) filev6_release(u,&map.sectors[old_nb],new_nb-old_nb);
+        /* and the indirect sectors which filev6_map_store added */
+        if(map.nb_indirect>old_indirect) filev6_release(u,&map.indirect[old_indirect],map.nb_indirect-old_indirect);
+        journal_end(u);
+        pthread_mutex_unlock(&h->lock);
+        return err;
+    }
+    if(new_nb<old_nb) filev6_release(u,&map.sectors[new_nb],old_nb-new_nb);
+    if(nb_indirect<old_indirect) filev6_release(u,&map.indirect[nb_indirect],old_indirect-nb_indirect);
+
+    h->fv6.i_node=ino;
+    memcpy(h->sectors,map.sectors,new_nb*sizeof(uint16_t));
+    h->nb_sectors=new_nb;
+    memset(h->dirty_sectors,0,sizeof(h->dirty_sectors));
+    h->dirty=0;
+    h->ra_nb=0;
+    journal_end(u);
+    pthread_mutex_unlock(&h->lock);
+    return 0;
+}
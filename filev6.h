@@ -8,6 +8,7 @@
  * @date summer 2016
  */
 
+#include <pthread.h>
 #include "unixv6fs.h"
 #include "mount.h"
 
@@ -15,6 +16,16 @@
 extern "C" {
 #endif
 
+/* largest file: 7 indirect sectors of ADDRESSES_PER_SECTOR sectors each */
+#define MAX_FILE_SECTORS (7*ADDRESSES_PER_SECTOR)
+#define MAX_SIZE_FILE (MAX_FILE_SECTORS*SECTOR_SIZE)
+
+/* number of sectors copied per I/O by filev6_import */
+#define IMPORT_CHUNK_SECTORS 128
+
+/* size of the readahead window of an open file handle, in sectors */
+#define READAHEAD_SECTORS 256
+
 struct filev6 {
     const struct unix_filesystem *u;     // the filesystem
     uint16_t i_number;                   // the inode number (on disk)
@@ -22,6 +33,28 @@ struct filev6 {
     int32_t offset;                      // the current cursor within the file (in bytes)
 };
 
+/*
+ * A file kept open across many reads and writes (e.g. by the FUSE daemon):
+ * the inode and the block map are loaded once, and sequential reads are
+ * served from a readahead window filled extent by extent. Writes go to a
+ * write-back copy of the whole file, written to disk by filev6_handle_flush.
+ */
+struct filev6_handle {
+    struct filev6 fv6;                   // the file
+    int nb_sectors;                      // number of sectors of the file
+    uint16_t sectors[MAX_FILE_SECTORS];  // the block map of the file
+    uint8_t *ra;                         // readahead window (READAHEAD_SECTORS sectors)
+    int ra_first;                        // first sector of the file held in ra
+    int ra_nb;                           // number of sectors held in ra
+    int32_t next;                        // offset following the last read
+    int32_t size;                        // size of the file, unflushed writes included
+    uint8_t *cache;                      // write-back copy of the file (NULL until written)
+    int cache_capacity;                  // size of cache in bytes
+    int dirty;                           // whether the cache holds unflushed changes
+    uint8_t dirty_sectors[MAX_FILE_SECTORS]; // the sectors of the file to write back
+    pthread_mutex_t lock;                // serializes the accesses to the window and the cache
+};
+
 /**
  * @brief open up a file corresponding to a given inode; set offset to zero
  * @param u the filesystem (IN)
@@ -31,6 +64,15 @@ struct filev6 {
  */
 int filev6_open(const struct unix_filesystem *u, uint16_t inr, struct filev6 *fv6);
 
+/**
+ * @brief get the sector of each SECTOR_SIZE part of a file (its block map)
+ * @param u the filesystem (IN)
+ * @param inode the inode of the file (IN)
+ * @param sectors room for MAX_FILE_SECTORS sector numbers (OUT)
+ * @return the number of sectors of the file; <0 on errror
+ */
+int filev6_blockmap(const struct unix_filesystem *u, const struct inode *inode, uint16_t *sectors);
+
 /**
  * @brief change the current offset of the given file to the one specified
  * @param fv6 the filev6 (IN-OUT; offset will be changed)
@@ -47,6 +89,61 @@ int filev6_lseek(struct filev6 *fv6, int32_t offset);
  */
 int filev6_readblock(struct filev6 *fv6, void *buf);
 
+/**
+ * @brief open a file for repeated reads: load its inode and its block map
+ * @param u the filesystem (IN)
+ * @param inr the inode number (IN)
+ * @param h the new handle, to be released by filev6_handle_close (OUT)
+ * @return 0 on success; <0 on errror
+ */
+int filev6_handle_open(const struct unix_filesystem *u, uint16_t inr, struct filev6_handle **h);
+
+/**
+ * @brief read size bytes of an open file from the given offset; a read
+ *        following the previous one fills the whole readahead window
+ * @param h the handle (IN-OUT; the readahead window will be changed)
+ * @param buf room for size bytes (OUT)
+ * @param size the number of bytes to read
+ * @param offset where to start reading in the file
+ * @return the number of bytes read (0 at end of file); <0 on errror
+ */
+int filev6_handle_read(struct filev6_handle *h, void *buf, size_t size, int32_t offset);
+
+/**
+ * @brief write size bytes to an open file at the given offset; the data
+ *        stays in the write-back cache of the handle until filev6_handle_flush
+ * @param h the handle (IN-OUT)
+ * @param buf the data to write (IN)
+ * @param size the number of bytes to write
+ * @param offset where to write in the file (a hole before it reads as zeros)
+ * @return the number of bytes written; <0 on errror
+ */
+int filev6_handle_write(struct filev6_handle *h, const void *buf, size_t size, int32_t offset);
+
+/**
+ * @brief change the size of an open file, in the write-back cache
+ * @param h the handle (IN-OUT)
+ * @param size the new size (the file is cut or completed with zeros)
+ * @return 0 on success; <0 on errror
+ */
+int filev6_handle_truncate(struct filev6_handle *h, int32_t size);
+
+/**
+ * @brief write the unflushed changes of an open file to disk, by extents,
+ *        then its block map and its inode. Must be called under the
+ *        exclusive lock of the filesystem.
+ * @param u the filesystem (IN)
+ * @param h the handle (IN-OUT)
+ * @return 0 on success; <0 on errror
+ */
+int filev6_handle_flush(struct unix_filesystem *u, struct filev6_handle *h);
+
+/**
+ * @brief release a handle opened by filev6_handle_open; unflushed writes are lost
+ * @param h the handle
+ */
+void filev6_handle_close(struct filev6_handle *h);
+
 /**
  * @brief create a new filev6
  * @param u the filesystem (IN)
@@ -56,6 +153,28 @@ int filev6_readblock(struct filev6 *fv6, void *buf);
  */
 int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6);
 
+/**
+ * @brief append the len bytes of the given buffer to the given filev6;
+ *        only fv6->i_node is updated, the caller writes the inode to disk
+ * @param u the filesystem (IN)
+ * @param fv6 the filev6 (IN-OUT)
+ * @param buf the data we want to write (IN)
+ * @param len the length of the bytes we want to write
+ * @return 0 on success; <0 on errror
+ */
+int filev6_append(struct unix_filesystem *u, struct filev6 *fv6, const void *buf, int len);
+
+/**
+ * @brief like filev6_append, but from a host file into an empty filev6, in
+ *        constant memory; the caller writes the inode to disk
+ * @param u the filesystem (IN)
+ * @param fv6 the filev6, which must be empty (IN-OUT)
+ * @param src the host file, read from its current position (IN)
+ * @param size the number of bytes to copy
+ * @return 0 on success; <0 on errror
+ */
+int filev6_append_file(struct unix_filesystem *u, struct filev6 *fv6, FILE *src, int32_t size);
+
 /**
  * @brief write the len bytes of the given buffer on disk to the given filev6
  * @param u the filesystem (IN)
@@ -66,6 +185,13 @@ int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6);
  */
 int filev6_writebytes(struct unix_filesystem *u, struct filev6 *fv6, void *buf, int len);
 
+/**
+ * @brief filev6_append_file, then the inode is written, in one transaction
+ *        (the parameters are those of filev6_append_file)
+ * @return 0 on success; <0 on errror
+ */
+int filev6_import(struct unix_filesystem *u, struct filev6 *fv6, FILE *src, int32_t size);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,292 @@
+/*
+  FUSE low-level frontend of the UNIX v6 filesystem.
+
+  The requests are keyed by inode number instead of path: the v6 inode
+  numbers are the FUSE inode numbers (the root is 1 in both), so a name is
+  looked up once, when the kernel first meets it, and never again.
+  fs.c, on the high-level API, remains the fallback.
+
+  ./fs-ll <diskname> <mountpoint> [FUSE options]
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include "unixv6fs.h"
+#include "mount.h"
+#include "sector.h"
+#include "error.h"
+#include "direntv6.h"
+#include "inode.h"
+#include "filev6.h"
+
+/* how long the kernel may keep the attributes and the names it was given */
+#define FS_LL_TIMEOUT 1.0
+
+struct unix_filesystem fs;
+
+/**
+ * @brief the errno to reply for an internal error code
+ */
+static int fs_ll_errno(int err)
+{
+    return (err > ERR_FIRST && err < ERR_LAST) ? ERR_ERRNO[err - ERR_FIRST] : EIO;
+}
+
+/**
+ * @brief fills the struct stat of an inode
+ * @param inr the inode number
+ * @param ino the inode (IN)
+ * @param stbuf the attributes (OUT)
+ */
+static void fs_ll_stat(uint16_t inr, const struct inode *ino, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = inr;
+    if((ino->i_mode & IFMT) == IFDIR) {
+        stbuf->st_mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH | S_IFDIR;
+    } else {
+        stbuf->st_mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH | S_IFREG;
+    }
+    stbuf->st_nlink = ino->i_nlink;
+    stbuf->st_uid = ino->i_uid;
+    stbuf->st_gid = ino->i_gid;
+    stbuf->st_size = inode_getsize(ino);
+    stbuf->st_blksize = SECTOR_SIZE;
+    stbuf->st_blocks = inode_getsectorsize(ino);
+}
+
+/**
+ * @brief looks up one name in a directory
+ * @param req the request
+ * @param parent the inode number of the directory
+ * @param name the name to look up
+ */
+static void fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    struct inode ino;
+    int err = 0;
+    memset(&e, 0, sizeof(e));
+    mountv6_lock_shared(&fs);
+    int inr = direntv6_dirlookup(&fs, (uint16_t)parent, name);
+    if(inr < 0) {
+        err = inr;
+    } else {
+        err = inode_read(&fs, (uint16_t)inr, &ino);
+    }
+    mountv6_unlock(&fs);
+    if(err < 0) {
+        fuse_reply_err(req, fs_ll_errno(err));
+        return;
+    }
+    e.ino = inr;
+    e.attr_timeout = FS_LL_TIMEOUT;
+    e.entry_timeout = FS_LL_TIMEOUT;
+    fs_ll_stat((uint16_t)inr, &ino, &e.attr);
+    fuse_reply_entry(req, &e);
+}
+
+/**
+ * @brief gives the attributes of an inode
+ * @param req the request
+ * @param ino the inode number
+ * @param fi to be ignored
+ */
+static void fs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) fi;
+    struct inode inode;
+    mountv6_lock_shared(&fs);
+    int err = inode_read(&fs, (uint16_t)ino, &inode);
+    mountv6_unlock(&fs);
+    if(err < 0) {
+        fuse_reply_err(req, fs_ll_errno(err));
+        return;
+    }
+    struct stat stbuf;
+    fs_ll_stat((uint16_t)ino, &inode, &stbuf);
+    fuse_reply_attr(req, &stbuf, FS_LL_TIMEOUT);
+}
+
+/**
+ * @brief lists a directory from the entry number off, as much as fits in size bytes
+ * @param req the request
+ * @param ino the inode number of the directory
+ * @param size the size of the reply buffer
+ * @param off the number of entries already given
+ * @param fi to be ignored
+ */
+static void fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                          struct fuse_file_info *fi)
+{
+    (void) fi;
+    char *buf = malloc(size);
+    if(buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    size_t used = 0;
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    struct directory_reader d;
+    mountv6_lock_shared(&fs);
+    int err = direntv6_opendir(&fs, (uint16_t)ino, &d);
+    /* entries 0 and 1 are "." and "..", those of the directory follow:
+     * the reader goes straight to the first one not given yet */
+    if(err >= 0 && off > 2) err = direntv6_seekdir(&d, (int32_t)(off - 2));
+    char name[DIRENT_MAXLEN + 1];
+    uint16_t child_inr = (uint16_t)ino;
+    for(off_t index = off > 2 ? off : 0; err >= 0; ++index) {
+        if(index == 0) {
+            strcpy(name, ".");
+        } else if(index == 1) {
+            strcpy(name, "..");
+        } else if((err = direntv6_readdir(&d, name, &child_inr)) <= 0) {
+            break;
+        }
+        /* free slots keep their number so that the offsets stay stable */
+        if((index < off) || (index > 1 && child_inr == 0)) continue;
+        stbuf.st_ino = child_inr;
+        size_t len = fuse_add_direntry(req, buf + used, size - used, name, &stbuf, index + 1);
+        if(len > size - used) break;
+        used += len;
+    }
+    mountv6_unlock(&fs);
+    if(err < 0) {
+        fuse_reply_err(req, fs_ll_errno(err));
+    } else {
+        fuse_reply_buf(req, buf, used);
+    }
+    free(buf);
+}
+
+/**
+ * @brief opens a file: its block map and readahead window are kept in fi->fh
+ * @param req the request
+ * @param ino the inode number of the file
+ * @param fi the handle of the open file (OUT)
+ */
+static void fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct filev6_handle *h = NULL;
+    mountv6_lock_shared(&fs);
+    int err = filev6_handle_open(&fs, (uint16_t)ino, &h);
+    mountv6_unlock(&fs);
+    if(err < 0) {
+        fuse_reply_err(req, fs_ll_errno(err));
+        return;
+    }
+    fi->fh = (uint64_t)(uintptr_t)h;
+    fuse_reply_open(req, fi);
+}
+
+/**
+ * @brief reads size bytes of an open file from off
+ * @param req the request
+ * @param ino to be ignored, the file is the one of fi
+ * @param size the number of bytes to read
+ * @param off position from where we need to read the file
+ * @param fi the handle of the open file
+ */
+static void fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       struct fuse_file_info *fi)
+{
+    (void) ino;
+    struct filev6_handle *h = (struct filev6_handle *)(uintptr_t)fi->fh;
+    char *buf = malloc(size ? size : 1);
+    if(buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    mountv6_lock_shared(&fs);
+    int result = filev6_handle_read(h, buf, size, off);
+    mountv6_unlock(&fs);
+    if(result < 0) {
+        fuse_reply_err(req, fs_ll_errno(result));
+    } else {
+        fuse_reply_buf(req, buf, result);
+    }
+    free(buf);
+}
+
+/**
+ * @brief releases the handle of a file opened by fs_ll_open
+ * @param req the request
+ * @param ino to be ignored
+ * @param fi the handle of the open file
+ */
+static void fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) ino;
+    filev6_handle_close((struct filev6_handle *)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops available_ops = {
+    .lookup = fs_ll_lookup,
+    .getattr = fs_ll_getattr,
+    .readdir = fs_ll_readdir,
+    .open = fs_ll_open,
+    .read = fs_ll_read,
+    .release = fs_ll_release,
+};
+
+/**
+* @brief mounts the filesystem given as first non-option argument
+* @param data to be ignored
+* @param filename name of the disk
+* @param key
+* @param outargs to be ignored
+* @return 0 to drop the argument; 1 to keep it for FUSE
+*/
+static int arg_parse(void *data, const char *filename, int key, struct fuse_args *outargs)
+{
+    (void) data;
+    (void) outargs;
+    if (key == FUSE_OPT_KEY_NONOPT && fs.f == NULL && filename != NULL) {
+        int err = mountv6(filename, &fs);
+        if(err != 0) {
+            puts(ERR_MESSAGES[err - ERR_FIRST]);
+            exit(1);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char *mountpoint = NULL;
+    int multithreaded = 0;
+    int foreground = 0;
+    int ret = 1;
+    if (fuse_opt_parse(&args, NULL, NULL, arg_parse) == 0
+        && fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1) {
+        struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+        if (ch != NULL) {
+            struct fuse_session *se = fuse_lowlevel_new(&args, &available_ops, sizeof(available_ops), NULL);
+            if (se != NULL) {
+                if (fuse_set_signal_handlers(se) != -1) {
+                    fuse_session_add_chan(se, ch);
+                    fuse_daemonize(foreground);
+                    ret = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                    fuse_remove_signal_handlers(se);
+                    fuse_session_remove_chan(ch);
+                }
+                fuse_session_destroy(se);
+            }
+            fuse_unmount(mountpoint, ch);
+        }
+        free(mountpoint);
+    }
+    fuse_opt_free_args(&args);
+    if (fs.f != NULL) (void)umountv6(&fs);
+    return ret ? 1 : 0;
+}
@@ -16,6 +16,11 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <signal.h>
 #include "unixv6fs.h"
 #include "mount.h"
 #include "sector.h"
@@ -23,9 +28,290 @@
 #include "direntv6.h"
 #include "inode.h"
 #include "filev6.h"
+#include "journal.h"
+#include "latency.h"
+
+/* cache settings given to libfuse before those of the command line, which
+ * override them; with -o ro the image cannot change underneath, so the
+ * kernel may keep names, attributes and pages as long as it wants. Read-write,
+ * every write goes through this daemon, so auto_cache keeps the pages of a
+ * file between two opens as long as its size is the same */
+#define FS_RW_OPTIONS "-oentry_timeout=1,attr_timeout=1,negative_timeout=0,auto_cache,max_read=131072,max_readahead=131072"
+#define FS_RO_OPTIONS "-oentry_timeout=86400,attr_timeout=86400,negative_timeout=86400,kernel_cache,max_read=1048576,max_readahead=1048576"
 
 struct unix_filesystem fs;
 
+/*
+ * The options of the daemon itself, the others are left to libfuse.
+ */
+struct fs_config {
+    int readonly;       /* -o ro, also given to the kernel */
+    int stats;          /* -o stats: print the latencies at unmount (also on SIGUSR1) */
+    int stats_json;     /* -o stats_json: in JSON instead of text */
+    char *stats_file;   /* -o stats_file=<path>: rewritten at each print, instead of stderr */
+};
+
+static struct fs_config config;
+
+enum { FS_KEY_RO };
+
+#define FS_OPT(t, p, v) { t, offsetof(struct fs_config, p), v }
+
+static const struct fuse_opt fs_opts[] = {
+    FUSE_OPT_KEY("ro", FS_KEY_RO),
+    FS_OPT("stats", stats, 1),
+    FS_OPT("stats_json", stats_json, 1),
+    FS_OPT("stats_file=%s", stats_file, 0),
+    FUSE_OPT_END
+};
+
+/*
+ * Latency of each callback: every thread records into its own histograms,
+ * which are summed when they are printed, and added to those of the ended
+ * threads when it ends.
+ */
+enum fs_op {
+    FS_OP_GETATTR, FS_OP_STATFS, FS_OP_READDIR, FS_OP_MKDIR, FS_OP_CREATE, FS_OP_OPEN,
+    FS_OP_READ, FS_OP_WRITE, FS_OP_TRUNCATE, FS_OP_FLUSH, FS_OP_FSYNC, FS_OP_RELEASE,
+    FS_OP_LAST
+};
+
+static const char * const FS_OP_NAMES[FS_OP_LAST] = {
+    "getattr", "statfs", "readdir", "mkdir", "create", "open",
+    "read", "write", "truncate", "flush", "fsync", "release"
+};
+
+struct fs_thread_stats {
+    struct latency_hist ops[FS_OP_LAST];
+    struct fs_thread_stats *next;
+};
+
+static struct fs_thread_stats *thread_stats = NULL;    /* of the running threads */
+static struct latency_hist retired_stats[FS_OP_LAST];  /* of the ended threads */
+static pthread_mutex_t thread_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_stats_key;
+static pthread_once_t thread_stats_once = PTHREAD_ONCE_INIT;
+static __thread struct fs_thread_stats *my_stats = NULL;
+
+/*
+ * The files open in the daemon: all the opens of one inode share its
+ * handle, so that a read sees the unflushed writes of another open.
+ */
+struct fs_open_file {
+    struct filev6_handle *h;
+    int refs;
+    struct fs_open_file *next;
+};
+
+static struct fs_open_file *open_files = NULL;
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief destructor of thread_stats_key, run when a thread ends: its
+ * histograms are added to those of the ended threads, then freed
+ */
+static void fs_stats_retire(void *arg)
+{
+    struct fs_thread_stats *t = arg;
+    pthread_mutex_lock(&thread_stats_lock);
+    for(struct fs_thread_stats **p = &thread_stats; *p != NULL; p = &(*p)->next) {
+        if(*p == t) {
+            *p = t->next;
+            break;
+        }
+    }
+    for(int op = 0; op < FS_OP_LAST; ++op) {
+        latency_merge(&retired_stats[op], &t->ops[op]);
+    }
+    pthread_mutex_unlock(&thread_stats_lock);
+    my_stats = NULL;
+    free(t);
+}
+
+static void fs_stats_key_create(void)
+{
+    pthread_key_create(&thread_stats_key, fs_stats_retire);
+}
+
+/**
+ * @brief records the duration of an operation started at start, in the
+ * histograms of the calling thread (created at its first operation)
+ */
+static void fs_stats_record(enum fs_op op, uint64_t start)
+{
+    uint64_t ns = latency_now() - start;
+    if(my_stats == NULL) {
+        struct fs_thread_stats *t = calloc(1, sizeof(struct fs_thread_stats));
+        if(t == NULL) return;
+        pthread_once(&thread_stats_once, fs_stats_key_create);
+        pthread_mutex_lock(&thread_stats_lock);
+        t->next = thread_stats;
+        thread_stats = t;
+        pthread_mutex_unlock(&thread_stats_lock);
+        pthread_setspecific(thread_stats_key, t);
+        my_stats = t;
+    }
+    latency_record(&my_stats->ops[op], ns);
+}
+
+/**
+ * @brief prints the latencies of all the threads, per operation, in the
+ * format and to the file given by the options
+ */
+static void fs_stats_print(void)
+{
+    struct latency_hist *total = calloc(FS_OP_LAST, sizeof(struct latency_hist));
+    if(total == NULL) return;
+    pthread_mutex_lock(&thread_stats_lock);
+    memcpy(total, retired_stats, sizeof(retired_stats));
+    for(struct fs_thread_stats *t = thread_stats; t != NULL; t = t->next) {
+        for(int op = 0; op < FS_OP_LAST; ++op) {
+            latency_merge(&total[op], &t->ops[op]);
+        }
+    }
+    pthread_mutex_unlock(&thread_stats_lock);
+    FILE *out = (config.stats_file != NULL) ? fopen(config.stats_file, "w") : stderr;
+    if(out != NULL) {
+        if(config.stats_json) {
+            fputs("{", out);
+            for(int op = 0; op < FS_OP_LAST; ++op) {
+                fputs(op ? ",\n " : "", out);
+                latency_print_json(out, FS_OP_NAMES[op], &total[op]);
+            }
+            struct sector_stats st;
+            sector_stats_get(&st);
+            fprintf(out, ",\n \"sectors\": {\"reads\": %llu, \"writes\": %llu, \"bytes_read\": %llu, "
+                    "\"bytes_written\": %llu, \"seek_distance\": %llu",
+                    (unsigned long long) st.reads, (unsigned long long) st.writes,
+                    (unsigned long long) st.bytes_read, (unsigned long long) st.bytes_written,
+                    (unsigned long long) st.seek_distance);
+            for(int t = 0; t < SECTOR_TAG_LAST; ++t) {
+                fprintf(out, ", \"%s\": %llu", SECTOR_TAG_NAMES[t], (unsigned long long) st.by_tag[t]);
+            }
+            fputs("}}\n", out);
+        } else {
+            fprintf(out, "%-10s %10s %10s %10s %10s %10s %10s %10s (us)\n",
+                    "op", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+            for(int op = 0; op < FS_OP_LAST; ++op) {
+                latency_print(out, FS_OP_NAMES[op], &total[op]);
+            }
+            sector_stats_print(out);
+        }
+        if(out != stderr) fclose(out);
+        else fflush(out);
+    }
+    free(total);
+}
+
+/**
+ * @brief thread which prints the latencies each time the daemon gets SIGUSR1
+ * (blocked in every other thread, see main)
+ */
+static void *fs_stats_thread(void *arg)
+{
+    (void) arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    int sig = 0;
+    while(sigwait(&set, &sig) == 0) {
+        fs_stats_print();
+    }
+    return NULL;
+}
+
+/**
+ * @brief the value to return to FUSE for an internal error code
+ */
+static int fs_errno(int err)
+{
+    return (err > ERR_FIRST && err < ERR_LAST) ? -ERR_ERRNO[err - ERR_FIRST] : -EIO;
+}
+
+/**
+ * @brief the size of an inode if it is open, unflushed writes included;
+ * the caller holds the lock of the filesystem, so that the handle cannot
+ * be closed meanwhile
+ * @param inr the inode number
+ * @param size the size (OUT, unchanged if the inode is not open)
+ * @return 1 if the inode is open; 0 otherwise
+ */
+static int fs_handle_size(uint16_t inr, int32_t *size)
+{
+    int found = 0;
+    pthread_mutex_lock(&open_files_lock);
+    for(struct fs_open_file *o = open_files; (o != NULL) && !found; o = o->next) {
+        if(o->h->fv6.i_number == inr) {
+            pthread_mutex_lock(&o->h->lock);
+            *size = o->h->size;
+            pthread_mutex_unlock(&o->h->lock);
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return found;
+}
+
+/**
+ * @brief takes a reference on the handle of an inode, opening it if needed;
+ * the caller holds the lock of the filesystem
+ * @param inr the inode number
+ * @param h the handle (OUT)
+ * @return 0 on success; <0 on an error
+ */
+static int fs_handle_get(uint16_t inr, struct filev6_handle **h)
+{
+    int err = 0;
+    pthread_mutex_lock(&open_files_lock);
+    struct fs_open_file *o = open_files;
+    while((o != NULL) && (o->h->fv6.i_number != inr)) o = o->next;
+    if(o == NULL) {
+        o = calloc(1, sizeof(struct fs_open_file));
+        if(o == NULL) {
+            err = ERR_NOMEM;
+        } else if((err = filev6_handle_open(&fs, inr, &o->h)) < 0) {
+            free(o);
+        } else {
+            o->next = open_files;
+            open_files = o;
+        }
+    }
+    if(err == 0) {
+        ++o->refs;
+        *h = o->h;
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return err;
+}
+
+/**
+ * @brief drops a reference on a handle; the last one writes the file back
+ * and closes it. The caller holds the exclusive lock of the filesystem.
+ * @param h the handle
+ * @return 0 on success; <0 on an error
+ */
+static int fs_handle_put_locked(struct filev6_handle *h)
+{
+    struct fs_open_file *last = NULL;
+    pthread_mutex_lock(&open_files_lock);
+    for(struct fs_open_file **o = &open_files; *o != NULL; o = &(*o)->next) {
+        if((*o)->h != h) continue;
+        if(--(*o)->refs == 0) {
+            last = *o;
+            *o = last->next;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    int err = 0;
+    if(last != NULL) {
+        err = filev6_handle_flush(&fs, h);
+        filev6_handle_close(h);
+        free(last);
+    }
+    return err;
+}
+
 /**
  * @brief copies into buffer buf, the content of a file and prints it
  * @param path contains the name of the directory or file to read
@@ -39,10 +325,19 @@ static int fs_getattr(const char *path, struct stat *stbuf)
     memset(stbuf, 0, sizeof(struct stat));
     /*We get the inode number of the file or directory*/
     int inode_nbr=0;
-    if((inode_nbr = direntv6_dirlookup(&fs, ROOT_INUMBER, path))<0) return inode_nbr;
     struct inode ino;
-    if((erreur = inode_read(&fs, (uint16_t)inode_nbr, &ino))!=0) {
-        return erreur;
+    int32_t size = 0;
+    mountv6_lock_shared(&fs);
+    if((inode_nbr = direntv6_dirlookup(&fs, ROOT_INUMBER, path))<0) {
+        erreur = inode_nbr;
+    } else if((erreur = inode_read(&fs, (uint16_t)inode_nbr, &ino)) == 0) {
+        /* the size of an open file includes its unflushed writes */
+        size = inode_getsize(&ino);
+        (void)fs_handle_size((uint16_t)inode_nbr, &size);
+    }
+    mountv6_unlock(&fs);
+    if(erreur!=0) {
+        return fs_errno(erreur);
     }
 
     /*Initialisation of the struct stat stbuf*/
@@ -57,7 +352,7 @@ static int fs_getattr(const char *path, struct stat *stbuf)
     stbuf->st_uid = ino.i_uid;
     stbuf->st_gid = ino.i_gid;
     stbuf->st_rdev = 0;
-    stbuf->st_size = ((uint32_t)ino.i_size1)<<8 | (uint32_t)ino.i_size0;
+    stbuf->st_size = size;
     stbuf->st_blksize = SECTOR_SIZE;
     stbuf->st_blocks = inode_getsectorsize(&ino);
     stbuf->st_atim.tv_sec = 0;
@@ -70,6 +365,31 @@ static int fs_getattr(const char *path, struct stat *stbuf)
     return 0;
 }
 
+/**
+ * @brief gives the usage of the filesystem, as counted by its bitmaps
+ * @param path to be ignored
+ * @param stbuf the statistics (OUT)
+ * @return 0
+ */
+
+static int fs_statfs(const char *path, struct statvfs *stbuf)
+{
+    (void) path;
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = SECTOR_SIZE;
+    stbuf->f_frsize = SECTOR_SIZE;
+    stbuf->f_namemax = DIRENT_MAXLEN;
+    mountv6_lock_shared(&fs);
+    stbuf->f_blocks = fs.fbm->max - fs.fbm->min + 1;
+    stbuf->f_bfree = bm_count_free(fs.fbm);
+    stbuf->f_bavail = stbuf->f_bfree;
+    stbuf->f_files = fs.ibm->max - fs.ibm->min + 1;
+    stbuf->f_ffree = bm_count_free(fs.ibm);
+    stbuf->f_favail = stbuf->f_ffree;
+    mountv6_unlock(&fs);
+    return 0;
+}
+
 /**
  * @brief copies into buffer buf, the names of every element
  * contained inside the directory corresponding to path
@@ -91,64 +411,399 @@ static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     M_REQUIRE_NON_NULL(path);
     M_REQUIRE_NON_NULL(buf);
     int inr =0;
-    if((inr = direntv6_dirlookup(&fs, ROOT_INUMBER, path))<0)return inr;
+    int err=0;
+    mountv6_lock_shared(&fs);
+    if((inr = direntv6_dirlookup(&fs, ROOT_INUMBER, path))<0) {
+        mountv6_unlock(&fs);
+        return fs_errno(inr);
+    }
 
     struct directory_reader d;
-    int err=0;
-    if ((err=direntv6_opendir(&fs,inr,&d))<0) return err;
-    char name[DIRENT_MAXLEN+1];
-    name[DIRENT_MAXLEN] = '\0';
-    uint16_t child_inr;
-    while((err=direntv6_readdir(&d, name, &child_inr))==1) {
-        filler(buf,name,NULL,0);
+    if ((err=direntv6_opendir(&fs,inr,&d))==0) {
+        char name[DIRENT_MAXLEN+1];
+        name[DIRENT_MAXLEN] = '\0';
+        uint16_t child_inr;
+        while((err=direntv6_readdir(&d, name, &child_inr))==1) {
+            filler(buf,name,NULL,0);
+        }
     }
-    return err;
+    mountv6_unlock(&fs);
+    return (err<0) ? fs_errno(err) : 0;
 }
 
 /**
- * @brief copies into buffer buf, the content of a file and prints it
- * @param path contains the path of the file to read
+ * @brief opens a file: resolves its path once and keeps the file, its block
+ * map, its readahead window and its write-back cache in fi->fh until it is released
+ * @param path contains the path of the file to open
+ * @param fi the handle of the open file (OUT)
+ * @return 0 on success; <0 on an error
+ */
+
+static int fs_open(const char *path, struct fuse_file_info *fi)
+{
+    struct filev6_handle *h = NULL;
+    int err = 0;
+    mountv6_lock_shared(&fs);
+    int inode_nbr = direntv6_dirlookup(&fs, ROOT_INUMBER, path);
+    if(inode_nbr<0) {
+        err = inode_nbr;
+    } else {
+        err = fs_handle_get((uint16_t)inode_nbr, &h);
+    }
+    mountv6_unlock(&fs);
+    if(err<0) return fs_errno(err);
+    fi->fh = (uint64_t)(uintptr_t)h;
+    return 0;
+}
+
+/**
+ * @brief creates and opens a new empty file
+ * @param path contains the path of the new file
+ * @param mode to be ignored, v6 files have no permissions
+ * @param fi the handle of the open file (OUT)
+ * @return 0 on success; <0 on an error
+ */
+
+static int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    (void) mode;
+    struct filev6_handle *h = NULL;
+    mountv6_lock_exclusive(&fs);
+    int err = direntv6_create(&fs, path, IALLOC);
+    if(err>=0) err = fs_handle_get((uint16_t)err, &h);
+    mountv6_unlock(&fs);
+    if(err<0) return fs_errno(err);
+    fi->fh = (uint64_t)(uintptr_t)h;
+    return 0;
+}
+
+/**
+ * @brief creates a new empty directory
+ * @param path contains the path of the new directory
+ * @param mode to be ignored, v6 files have no permissions
+ * @return 0 on success; <0 on an error
+ */
+
+static int fs_mkdir(const char *path, mode_t mode)
+{
+    (void) mode;
+    mountv6_lock_exclusive(&fs);
+    int err = direntv6_create(&fs, path, IFDIR | IALLOC);
+    mountv6_unlock(&fs);
+    return (err<0) ? fs_errno(err) : 0;
+}
+
+/**
+ * @brief releases the handle of a file opened by fs_open or fs_create;
+ * the last release of a file writes it back
+ * @param path to be ignored
+ * @param fi the handle of the open file
+ * @return 0 on success; <0 on an error
+ */
+
+static int fs_release(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
+    mountv6_lock_exclusive(&fs);
+    int err = fs_handle_put_locked((struct filev6_handle *)(uintptr_t)fi->fh);
+    mountv6_unlock(&fs);
+    fi->fh = 0;
+    return (err<0) ? fs_errno(err) : 0;
+}
+
+/**
+ * @brief copies into buffer buf, the content of a file
+ * @param path to be ignored, the file is the one of fi
  * @param buf contains the content of the file(OUT)
- * @param size contains the bytes read in the previous call to the function
+ * @param size the number of bytes to read
  * @param offset position from where we need to read the file
- * @param fi to be ignored
- * @return the number of bytes read on success; 0 on an error
+ * @param fi the handle of the open file
+ * @return the number of bytes read on success; <0 on an error
  */
 
 static int fs_read(const char *path, char *buf, size_t size, off_t offset,
                    struct fuse_file_info *fi)
 {
-    (void) fi;
-    struct filev6 fv6;
-    int inode_nbr = direntv6_dirlookup(&fs, ROOT_INUMBER, path);
-    /* An error has occured so we cannot read any byte */
-    if(inode_nbr<ROOT_INUMBER) return 0;
-    int erreur = filev6_open(&fs,(uint16_t)inode_nbr,&fv6);
-    if(erreur < 0) return 0;
-    else {
-        /* Number of bytes read in total */
-        int result=0;
-        /* Number of bytes read in one call to readblock */
-        int read =0;
-        char secteur[SECTOR_SIZE];
-        if((erreur = filev6_lseek(&fv6,offset))<0) {
-            return 0;
+    (void) path;
+    struct filev6_handle *h = (struct filev6_handle *)(uintptr_t)fi->fh;
+    mountv6_lock_shared(&fs);
+    int result = filev6_handle_read(h, buf, size, offset);
+    mountv6_unlock(&fs);
+    return (result<0) ? fs_errno(result) : result;
+}
+
+/**
+ * @brief reads size bytes of a file into a memory buffer of a bufvec
+ * @return 0 on success; <0 on an error
+ */
+static int fs_read_mem(struct filev6_handle *h, struct fuse_buf *b, size_t size, off_t offset)
+{
+    b->mem = malloc(size);
+    if(b->mem == NULL) return ERR_NOMEM;
+    int result = filev6_handle_read(h, b->mem, size, offset);
+    if(result < 0) return result;
+    b->size = result;
+    b->flags = 0;
+    return 0;
+}
+
+/**
+ * @brief gives the content of a file as buffers pointing into the disk image
+ * (one per extent of contiguous sectors), so that libfuse can splice them to
+ * the kernel without copying; the partial sectors at both ends go through
+ * memory. libfuse reads the disk buffers after the locks are released, and
+ * a flush, a truncate or a new file could meanwhile free or reuse these
+ * sectors: this is only done when the image is mounted read-only (-o ro),
+ * otherwise the whole read goes through memory
+ * @param path to be ignored, the file is the one of fi
+ * @param bufp the buffers, freed by libfuse (OUT)
+ * @param size the number of bytes to read
+ * @param offset position from where we need to read the file
+ * @param fi the handle of the open file
+ * @return 0 on success; <0 on an error
+ */
+
+static int fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                       struct fuse_file_info *fi)
+{
+    (void) path;
+    struct filev6_handle *h = (struct filev6_handle *)(uintptr_t)fi->fh;
+    int err = 0;
+    mountv6_lock_shared(&fs);
+    pthread_mutex_lock(&h->lock);
+    if(offset >= h->size) {
+        size = 0;
+    } else if(size > (size_t)(h->size - offset)) {
+        size = h->size - offset;
+    }
+    int zero_copy = config.readonly && (h->cache == NULL) && (size > 0);
+    /* at most a head, one buffer per sector and a tail */
+    int max = zero_copy ? size / SECTOR_SIZE + 3 : 1;
+    struct fuse_bufvec *v = calloc(1, sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+    if(v == NULL) {
+        pthread_mutex_unlock(&h->lock);
+        mountv6_unlock(&fs);
+        return -ENOMEM;
+    }
+    *bufp = v;
+    /* the memory buffers are only described here (offset and length in the
+     * file), and read once h->lock is released, by filev6_handle_read */
+    off_t end = offset + size;
+    if(!zero_copy) {
+        v->buf[v->count].pos = offset;
+        v->buf[v->count++].size = size;
+    } else {
+        off_t pos = offset;
+        if(pos % SECTOR_SIZE != 0) {
+            off_t head_end = (pos / SECTOR_SIZE + 1) * SECTOR_SIZE;
+            if(head_end > end) head_end = end;
+            v->buf[v->count].pos = pos;
+            v->buf[v->count++].size = head_end - pos;
+            pos = head_end;
         }
-        read = filev6_readblock(&fv6,secteur);
-        while((result < size) && (read!=0)) {
-            if(read<0) return 0;
-            memcpy(buf+result,secteur,read);
-            result+=read;
-            read = filev6_readblock(&fv6,secteur);
+        /* whole sectors, by extents of contiguous sectors on disk */
+        while(end - pos >= SECTOR_SIZE) {
+            int first = pos / SECTOR_SIZE;
+            int last = first + 1;
+            while((last < end / SECTOR_SIZE) && (h->sectors[last] == h->sectors[last - 1] + 1)) ++last;
+            struct fuse_buf *b = &v->buf[v->count++];
+            b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            b->fd = fileno(fs.f);
+            b->pos = (off_t)h->sectors[first] * SECTOR_SIZE;
+            b->size = (size_t)(last - first) * SECTOR_SIZE;
+            pos = (off_t)last * SECTOR_SIZE;
         }
-        return result;
+        if(pos < end) {
+            v->buf[v->count].pos = pos;
+            v->buf[v->count++].size = end - pos;
+        }
+    }
+    pthread_mutex_unlock(&h->lock);
+    for(size_t i = 0; (err == 0) && (i < v->count); ++i) {
+        struct fuse_buf *b = &v->buf[i];
+        if(b->flags == 0) {
+            err = fs_read_mem(h, b, b->size, b->pos);
+            b->pos = 0;
+        }
+    }
+    mountv6_unlock(&fs);
+    return (err < 0) ? fs_errno(err) : 0;
+}
+
+/**
+ * @brief asks the kernel to splice the data of read_buf instead of copying it
+ * and starts the thread printing the latencies on SIGUSR1
+ * @param conn the capabilities of the connection (IN-OUT)
+ * @return no private data
+ */
+
+static void *fs_init(struct fuse_conn_info *conn)
+{
+    if(conn->capable & FUSE_CAP_SPLICE_READ) conn->want |= FUSE_CAP_SPLICE_READ;
+    /* started here, once libfuse has daemonized */
+    pthread_t t;
+    if(pthread_create(&t, NULL, fs_stats_thread, NULL) == 0) pthread_detach(t);
+    return NULL;
+}
+
+/**
+ * @brief writes size bytes of buf to a file, in its write-back cache
+ * @param path to be ignored, the file is the one of fi
+ * @param buf the data to write (IN)
+ * @param size the number of bytes to write
+ * @param offset position from where we need to write the file
+ * @param fi the handle of the open file
+ * @return the number of bytes written on success; <0 on an error
+ */
+
+static int fs_write(const char *path, const char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi)
+{
+    (void) path;
+    struct filev6_handle *h = (struct filev6_handle *)(uintptr_t)fi->fh;
+    if(offset>MAX_SIZE_FILE) return -EFBIG;
+    mountv6_lock_shared(&fs);
+    int result = filev6_handle_write(h, buf, size, offset);
+    mountv6_unlock(&fs);
+    return (result<0) ? fs_errno(result) : result;
+}
+
+/**
+ * @brief changes the size of a file given by its path, and writes it back
+ * @param path contains the path of the file
+ * @param size the new size
+ * @return 0 on success; <0 on an error
+ */
+
+static int fs_truncate(const char *path, off_t size)
+{
+    if(size>MAX_SIZE_FILE) return -EFBIG;
+    struct filev6_handle *h = NULL;
+    mountv6_lock_exclusive(&fs);
+    int err = direntv6_dirlookup(&fs, ROOT_INUMBER, path);
+    if(err>=0 && (err = fs_handle_get((uint16_t)err, &h))==0) {
+        err = filev6_handle_truncate(h, size);
+        if(err==0) err = filev6_handle_flush(&fs, h);
+        int put = fs_handle_put_locked(h);
+        if(err==0) err = put;
+    }
+    mountv6_unlock(&fs);
+    return (err<0) ? fs_errno(err) : 0;
+}
+
+/**
+ * @brief changes the size of an open file, in its write-back cache
+ * @param path to be ignored, the file is the one of fi
+ * @param size the new size
+ * @param fi the handle of the open file
+ * @return 0 on success; <0 on an error
+ */
+
+static int fs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    (void) path;
+    if(size>MAX_SIZE_FILE) return -EFBIG;
+    mountv6_lock_shared(&fs);
+    int err = filev6_handle_truncate((struct filev6_handle *)(uintptr_t)fi->fh, size);
+    mountv6_unlock(&fs);
+    return (err<0) ? fs_errno(err) : 0;
+}
+
+/**
+ * @brief writes back the unflushed writes of a file, extent by extent
+ * @param path to be ignored, the file is the one of fi
+ * @param fi the handle of the open file
+ * @return 0 on success; <0 on an error
+ */
+
+static int fs_flush(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
+    mountv6_lock_exclusive(&fs);
+    int err = filev6_handle_flush(&fs, (struct filev6_handle *)(uintptr_t)fi->fh);
+    mountv6_unlock(&fs);
+    return (err<0) ? fs_errno(err) : 0;
+}
+
+/**
+ * @brief writes back a file, then commits the journal (the disk image is then durable)
+ * @param path to be ignored, the file is the one of fi
+ * @param datasync to be ignored, the inode is always written with the data
+ * @param fi the handle of the open file
+ * @return 0 on success; <0 on an error
+ */
+
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    (void) datasync;
+    int err = fs_flush(path, fi);
+    if(err==0) {
+        mountv6_lock_exclusive(&fs);
+        if(journal_commit(&fs)<0) err = -EIO;
+        mountv6_unlock(&fs);
     }
+    return err;
 }
 
+/**
+ * @brief prints the latencies at unmount if asked with -o stats
+ * @param private_data to be ignored
+ */
+
+static void fs_destroy(void *private_data)
+{
+    (void) private_data;
+    if(config.stats) fs_stats_print();
+}
+
+/*
+ * The callbacks given to libfuse: each one measures its duration.
+ */
+#define FS_TIMED(op, name, params, args) \
+static int name##_timed params \
+{ \
+    uint64_t start = latency_now(); \
+    int ret = name args; \
+    fs_stats_record(op, start); \
+    return ret; \
+}
+
+FS_TIMED(FS_OP_GETATTR, fs_getattr, (const char *path, struct stat *stbuf), (path, stbuf))
+FS_TIMED(FS_OP_STATFS, fs_statfs, (const char *path, struct statvfs *stbuf), (path, stbuf))
+FS_TIMED(FS_OP_READDIR, fs_readdir, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+         struct fuse_file_info *fi), (path, buf, filler, offset, fi))
+FS_TIMED(FS_OP_MKDIR, fs_mkdir, (const char *path, mode_t mode), (path, mode))
+FS_TIMED(FS_OP_CREATE, fs_create, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+FS_TIMED(FS_OP_OPEN, fs_open, (const char *path, struct fuse_file_info *fi), (path, fi))
+FS_TIMED(FS_OP_READ, fs_read, (const char *path, char *buf, size_t size, off_t offset,
+         struct fuse_file_info *fi), (path, buf, size, offset, fi))
+FS_TIMED(FS_OP_READ, fs_read_buf, (const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+         struct fuse_file_info *fi), (path, bufp, size, offset, fi))
+FS_TIMED(FS_OP_WRITE, fs_write, (const char *path, const char *buf, size_t size, off_t offset,
+         struct fuse_file_info *fi), (path, buf, size, offset, fi))
+FS_TIMED(FS_OP_TRUNCATE, fs_truncate, (const char *path, off_t size), (path, size))
+FS_TIMED(FS_OP_TRUNCATE, fs_ftruncate, (const char *path, off_t size, struct fuse_file_info *fi), (path, size, fi))
+FS_TIMED(FS_OP_FLUSH, fs_flush, (const char *path, struct fuse_file_info *fi), (path, fi))
+FS_TIMED(FS_OP_FSYNC, fs_fsync, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+FS_TIMED(FS_OP_RELEASE, fs_release, (const char *path, struct fuse_file_info *fi), (path, fi))
+
 static struct fuse_operations available_ops = {
-    .getattr = fs_getattr,
-    .readdir = fs_readdir,
-    .read = fs_read,
+    .init = fs_init,
+    .destroy = fs_destroy,
+    .getattr = fs_getattr_timed,
+    .statfs = fs_statfs_timed,
+    .readdir = fs_readdir_timed,
+    .mkdir = fs_mkdir_timed,
+    .create = fs_create_timed,
+    .open = fs_open_timed,
+    .read = fs_read_timed,
+    .read_buf = fs_read_buf_timed,
+    .write = fs_write_timed,
+    .truncate = fs_truncate_timed,
+    .ftruncate = fs_ftruncate_timed,
+    .flush = fs_flush_timed,
+    .fsync = fs_fsync_timed,
+    .release = fs_release_timed,
 };
 
 /* From https://github.com/libfuse/libfuse/wiki/Option-Parsing.
@@ -156,17 +811,20 @@ static struct fuse_operations available_ops = {
  */
 
 /**
-* @brief mounts the filesystem
-* @param data to be ignored
+* @brief mounts the filesystem and notes -o ro
+* @param data the options of the daemon (OUT)
 * @param filename name of the disk
-* @param key
+* @param key FS_KEY_RO or the kind of argument given by libfuse
 * @param outargs to be ignored
 * @return 0 on success; <0 on an error
 */
 static int arg_parse(void *data, const char *filename, int key, struct fuse_args *outargs)
 {
-    (void) data;
     (void) outargs;
+    if (key == FS_KEY_RO) {
+        ((struct fs_config *) data)->readonly = 1;
+        return 1;
+    }
     if (key == FUSE_OPT_KEY_NONOPT && fs.f == NULL && filename != NULL) {
         int err =0;
         err=mountv6(filename,&fs);
@@ -183,7 +841,15 @@ static int arg_parse(void *data, const char *filename, int key, struct fuse_args
 int main(int argc, char *argv[])
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    int ret = fuse_opt_parse(&args, NULL, NULL, arg_parse);
+    /* SIGUSR1 is only taken by sigwait in fs_stats_thread */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    int ret = fuse_opt_parse(&args, &config, fs_opts, arg_parse);
+    if (ret == 0) {
+        ret = fuse_opt_insert_arg(&args, 1, config.readonly ? FS_RO_OPTIONS : FS_RW_OPTIONS);
+    }
     if (ret == 0) {
         ret = fuse_main(args.argc, args.argv, &available_ops, NULL);
         (void)umountv6(&fs);
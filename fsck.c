@@ -0,0 +1,735 @@
+/**
+ * @file fsck.c
+ * @brief checking (and repairing) the consistency of the UNIX v6 filesystem
+ *
+ * A pass reads the inode table once, then FSCK_THREADS threads take the
+ * inodes by chunks: they check the size and the block pointers of each
+ * file, claim its sectors in shared counters and read the entries of the
+ * directories. A second parallel phase looks for the sectors claimed more
+ * than once, and the merge phase adds up the entries of each inode (link
+ * counts, orphans) and compares the persisted bitmaps with the computed ones.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "fsck.h"
+#include "unixv6fs.h"
+#include "error.h"
+#include "sector.h"
+#include "inode.h"
+#include "filev6.h"
+#include "journal.h"
+
+#define MAX_SMALL_FILE (ADDR_SMALL_LENGTH*SECTOR_SIZE)
+#define NB_SECTORS(size) (((size)+SECTOR_SIZE-1)/SECTOR_SIZE)
+#define NB_INDIRECT(nb) (((nb)+ADDRESSES_PER_SECTOR-1)/ADDRESSES_PER_SECTOR)
+
+#define NO_OWNER UINT32_MAX
+#define KEEP_ALL INT32_MAX   /* no sector of the file is to be dropped */
+#define KEEP_NONE (-1)       /* the inode is to be cleared */
+
+/* the maximum number of sectors of a volume (16-bit sector numbers) */
+#define FSCK_MAX_SECTORS 65536
+
+const char * const FSCK_KIND_NAMES[FSCK_LAST] = {
+    "size above the largest file",
+    "ILARG does not match the size",
+    "sector out of the data area",
+    "sector used twice",
+    "entry to an unallocated inode",
+    "link count differs from the entries",
+    "no entry points to it",
+    "sectors marked differently in the persisted bitmap",
+    "inodes marked differently in the persisted bitmap"
+};
+
+/* what the number given with each kind of problem is */
+static const char * const FSCK_WHERE_NAMES[FSCK_LAST] = {
+    "size", "size", "sector", "sector", "entry", "entries", "entries", "count", "count"
+};
+
+struct fsck_problem {
+    uint32_t inr;
+    uint32_t kind;
+    uint32_t where;     /* size, sector, entry or count, see FSCK_WHERE_NAMES */
+};
+
+/* the sectors of a file, kept by the thread which checked it for the second phase */
+struct fsck_map {
+    uint16_t inr;
+    int nb_indirect;    /* its indirect sectors come first in claimed */
+    int nb;             /* then its data sectors */
+    size_t first;       /* position of the map in claimed */
+};
+
+struct fsck_state;
+
+/* what a thread finds, merged at the end of the pass */
+struct fsck_worker {
+    struct fsck_state *st;
+    pthread_t thread;
+    int err;
+    struct fsck_problem *problems;
+    size_t nb_problems;
+    size_t cap_problems;
+    struct fsck_map *maps;
+    size_t nb_maps;
+    size_t cap_maps;
+    uint16_t *claimed;          /* the sectors of the maps, one after the other */
+    size_t nb_claimed;
+    size_t cap_claimed;
+    uint32_t *refs;             /* number of entries to each inode */
+    uint8_t *seen;              /* one flag per sector, for the sectors of one file */
+    uint16_t *sectors;          /* block map of the file being checked */
+    uint8_t *data;              /* content of the directory being checked */
+    unsigned int inodes;
+    unsigned int dirs;
+    uint64_t entries;
+};
+
+struct fsck_state {
+    struct unix_filesystem *u;
+    uint32_t nb_inodes;
+    struct inode *inodes;       /* the inode table, read once per pass */
+    uint32_t *owner;            /* per sector, the smallest inode using it */
+    uint32_t *claims;           /* per sector, the number of uses */
+    int32_t *keep;              /* per inode, the sectors before the first bad one */
+    uint32_t next;              /* first inode of the next chunk */
+    struct fsck_worker workers[FSCK_THREADS];
+    /* merged */
+    struct fsck_problem *problems;
+    size_t nb_problems;
+    uint32_t *refs;
+};
+
+/**
+ * @brief record a problem found by a thread
+ * @return 0 on success; <0 on error
+ */
+static int fsck_report(struct fsck_worker *w, uint32_t inr, enum fsck_kind kind, uint32_t where)
+{
+    if(w->nb_problems==w->cap_problems) {
+        size_t cap = w->cap_problems ? 2*w->cap_problems : 64;
+        struct fsck_problem *bigger = realloc(w->problems, cap*sizeof(struct fsck_problem));
+        if(bigger==NULL) return ERR_NOMEM;
+        w->problems=bigger;
+        w->cap_problems=cap;
+    }
+    w->problems[w->nb_problems].inr=inr;
+    w->problems[w->nb_problems].kind=kind;
+    w->problems[w->nb_problems].where=where;
+    ++w->nb_problems;
+    return 0;
+}
+
+/**
+ * @brief count a use of a sector by a file, and keep it in the map of the thread
+ * @return 0 on success; <0 on error
+ */
+static int fsck_claim(struct fsck_worker *w, uint16_t inr, uint16_t sector)
+{
+    if(w->nb_claimed==w->cap_claimed) {
+        size_t cap = w->cap_claimed ? 2*w->cap_claimed : 4096;
+        uint16_t *bigger = realloc(w->claimed, cap*sizeof(uint16_t));
+        if(bigger==NULL) return ERR_NOMEM;
+        w->claimed=bigger;
+        w->cap_claimed=cap;
+    }
+    w->claimed[w->nb_claimed++]=sector;
+    struct fsck_state *st = w->st;
+    __atomic_add_fetch(&st->claims[sector], 1, __ATOMIC_RELAXED);
+    // le plus petit numéro d'inode l'emporte, quel que soit l'ordre des threads
+    uint32_t cur = __atomic_load_n(&st->owner[sector], __ATOMIC_RELAXED);
+    while((inr<cur) && !__atomic_compare_exchange_n(&st->owner[sector], &cur, inr, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/**
+ * @brief whether a sector is in the data area
+ */
+static int fsck_in_data(const struct unix_filesystem *u, uint16_t sector)
+{
+    return (sector>=u->s.s_block_start) && (sector<u->s.s_fsize);
+}
+
+/**
+ * @brief check the entries of a directory whose nb first data sectors are valid
+ * @return 0 on success; <0 on error
+ */
+static int fsck_dir(struct fsck_worker *w, uint16_t inr, int32_t size, int nb)
+{
+    struct fsck_state *st = w->st;
+    const uint16_t *sectors = w->sectors;
+    int32_t bytes = (size<nb*SECTOR_SIZE) ? size : nb*SECTOR_SIZE;
+    int err=0;
+    ++w->dirs;
+    for(int k=0; (k<NB_SECTORS(bytes))&&(err==0); ) {
+        int last=k+1;
+        while((last<NB_SECTORS(bytes))&&(sectors[last]==sectors[last-1]+1)) ++last;
+        err=SECTOR_TAGGED(SECTOR_TAG_DIR, journal_read(st->u,sectors[k],last-k,w->data+k*SECTOR_SIZE));
+        k=last;
+    }
+    const struct direntv6 *entries = (const struct direntv6 *)w->data;
+    for(int e=0; (e<bytes/(int)sizeof(struct direntv6))&&(err==0); ++e) {
+        uint16_t child = entries[e].d_inumber;
+        // un numéro nul marque un emplacement libre
+        if(child==0) continue;
+        ++w->entries;
+        if((child>=st->nb_inodes) || !(st->inodes[child].i_mode & IALLOC)) {
+            err=fsck_report(w,inr,FSCK_BAD_ENTRY,e);
+        } else {
+            ++w->refs[child];
+        }
+    }
+    return err;
+}
+
+/**
+ * @brief first phase for an allocated inode: size, flag and block pointers,
+ *        claims of its sectors, entries if it is a directory
+ * @return 0 on success; <0 on error
+ */
+static int fsck_inode(struct fsck_worker *w, uint16_t inr)
+{
+    struct fsck_state *st = w->st;
+    const struct unix_filesystem *u = st->u;
+    const struct inode *ino = &st->inodes[inr];
+    uint16_t *sectors = w->sectors;
+    ++w->inodes;
+
+    int32_t size = inode_getsize(ino);
+    if(size>MAX_SIZE_FILE) {
+        st->keep[inr]=KEEP_NONE;
+        return fsck_report(w,inr,FSCK_BAD_INODE,size);
+    }
+    int err=0;
+    int large = (size>MAX_SMALL_FILE);
+    if(large!=((ino->i_mode & ILARG)!=0)) err=fsck_report(w,inr,FSCK_BAD_FLAG,size);
+
+    int nb = NB_SECTORS(size);
+    struct fsck_map map = { inr, 0, 0, w->nb_claimed };
+    int loaded = large ? 0 : nb;
+    if(!large) memcpy(sectors,ino->i_addr,nb*sizeof(uint16_t));
+    for(int i=0; large && (i<NB_INDIRECT(nb)) && (err==0); ++i) {
+        uint16_t s = ino->i_addr[i];
+        if(!fsck_in_data(u,s)) {
+            st->keep[inr]=i*ADDRESSES_PER_SECTOR;
+            err=fsck_report(w,inr,FSCK_BAD_POINTER,s);
+            break;
+        }
+        if((err=fsck_claim(w,inr,s))<0) break;
+        ++map.nb_indirect;
+        err=SECTOR_TAGGED(SECTOR_TAG_INODE, journal_read(u,s,1,&sectors[i*ADDRESSES_PER_SECTOR]));
+        loaded = (nb<(i+1)*ADDRESSES_PER_SECTOR) ? nb : (i+1)*ADDRESSES_PER_SECTOR;
+    }
+    for(int k=0; (k<loaded)&&(err==0); ++k) {
+        if(!fsck_in_data(u,sectors[k])) {
+            if(st->keep[inr]>k) st->keep[inr]=k;
+            err=fsck_report(w,inr,FSCK_BAD_POINTER,sectors[k]);
+            break;
+        }
+        if((err=fsck_claim(w,inr,sectors[k]))<0) break;
+        ++map.nb;
+    }
+    if(err<0) return err;
+
+    if(w->nb_maps==w->cap_maps) {
+        size_t cap = w->cap_maps ? 2*w->cap_maps : 256;
+        struct fsck_map *bigger = realloc(w->maps, cap*sizeof(struct fsck_map));
+        if(bigger==NULL) return ERR_NOMEM;
+        w->maps=bigger;
+        w->cap_maps=cap;
+    }
+    w->maps[w->nb_maps++]=map;
+
+    if((ino->i_mode & IFMT)==IFDIR) err=fsck_dir(w,inr,size,map.nb);
+    return err;
+}
+
+/**
+ * @brief first phase: the inodes, by chunks of FSCK_CHUNK_INODES
+ */
+static void *fsck_phase_inodes(void *arg)
+{
+    struct fsck_worker *w = arg;
+    struct fsck_state *st = w->st;
+    uint32_t first;
+    while((w->err==0) && ((first=__atomic_fetch_add(&st->next, FSCK_CHUNK_INODES, __ATOMIC_RELAXED))<st->nb_inodes)) {
+        uint32_t last = (first+FSCK_CHUNK_INODES<st->nb_inodes) ? first+FSCK_CHUNK_INODES : st->nb_inodes;
+        // l'inode 0 n'est jamais utilisée
+        for(uint32_t inr=(first>0) ? first : 1; (inr<last)&&(w->err==0); ++inr) {
+            if(st->inodes[inr].i_mode & IALLOC) w->err=fsck_inode(w,(uint16_t)inr);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief second phase: the sectors claimed more than once, in the maps of
+ *        the thread; the smallest inode keeps the sector, and the first use
+ *        of it within that file
+ */
+static void *fsck_phase_doubles(void *arg)
+{
+    struct fsck_worker *w = arg;
+    struct fsck_state *st = w->st;
+    for(size_t m=0; (m<w->nb_maps)&&(w->err==0); ++m) {
+        const struct fsck_map *map = &w->maps[m];
+        const uint16_t *claimed = &w->claimed[map->first];
+        int total = map->nb_indirect+map->nb;
+        for(int k=0; (k<total)&&(w->err==0); ++k) {
+            uint16_t s = claimed[k];
+            if(st->claims[s]<2) continue;
+            if((st->owner[s]!=map->inr) || w->seen[s]) {
+                // un secteur indirect perdu emporte les données qu'il désigne
+                int32_t keep = (k<map->nb_indirect) ? k*ADDRESSES_PER_SECTOR : k-map->nb_indirect;
+                if(st->keep[map->inr]>keep) st->keep[map->inr]=keep;
+                w->err=fsck_report(w,map->inr,FSCK_DOUBLE,s);
+            }
+            w->seen[s]=1;
+        }
+        for(int k=0; k<total; ++k) w->seen[claimed[k]]=0;
+    }
+    return NULL;
+}
+
+/**
+ * @brief run a phase in all the threads
+ * @return 0 on success; <0 on error
+ */
+static int fsck_run(struct fsck_state *st, void *(*phase)(void *))
+{
+    int started=0;
+    for(; started<FSCK_THREADS; ++started) {
+        if(pthread_create(&st->workers[started].thread,NULL,phase,&st->workers[started])!=0) break;
+    }
+    // à défaut de threads, le travail restant est fait ici
+    if(started==0) phase(&st->workers[0]);
+    int err=0;
+    for(int t=0; t<started; ++t) pthread_join(st->workers[t].thread,NULL);
+    for(int t=0; t<FSCK_THREADS; ++t) {
+        if(st->workers[t].err<0) err=st->workers[t].err;
+    }
+    return err;
+}
+
+static int fsck_problem_cmp(const void *a, const void *b)
+{
+    const struct fsck_problem *x = a;
+    const struct fsck_problem *y = b;
+    if(x->inr!=y->inr) return (x->inr>y->inr) - (x->inr<y->inr);
+    if(x->kind!=y->kind) return (x->kind>y->kind) - (x->kind<y->kind);
+    return (x->where>y->where) - (x->where<y->where);
+}
+
+/**
+ * @brief add a problem found by the merge phase
+ * @return 0 on success; <0 on error
+ */
+static int fsck_merge_report(struct fsck_state *st, size_t *cap, uint32_t inr, enum fsck_kind kind, uint32_t where)
+{
+    if(st->nb_problems==*cap) {
+        size_t bigger_cap = *cap ? 2 * *cap : 64;
+        struct fsck_problem *bigger = realloc(st->problems, bigger_cap*sizeof(struct fsck_problem));
+        if(bigger==NULL) return ERR_NOMEM;
+        st->problems=bigger;
+        *cap=bigger_cap;
+    }
+    st->problems[st->nb_problems].inr=inr;
+    st->problems[st->nb_problems].kind=kind;
+    st->problems[st->nb_problems].where=where;
+    ++st->nb_problems;
+    return 0;
+}
+
+/**
+ * @brief the number of bits which differ between a persisted bitmap and the computed one
+ */
+static uint32_t fsck_bitmap_diff(const uint8_t *disk, uint32_t nb_bits, const uint8_t *computed)
+{
+    uint32_t diff=0;
+    for(uint32_t i=0; i<nb_bits; ++i) {
+        if(((disk[i/8]>>(i%8))&1)!=computed[i]) ++diff;
+    }
+    return diff;
+}
+
+/**
+ * @brief merge phase: findings of the threads, link counts, orphans and bitmaps
+ * @return 0 on success; <0 on error
+ */
+static int fsck_merge(struct fsck_state *st, struct fsck_stats *stats)
+{
+    const struct unix_filesystem *u = st->u;
+    size_t cap=0;
+    int err=0;
+    st->nb_problems=0;
+    memset(st->refs,0,st->nb_inodes*sizeof(uint32_t));
+    stats->inodes=stats->dirs=0;
+    stats->entries=stats->sectors=0;
+    for(int t=0; (t<FSCK_THREADS)&&(err==0); ++t) {
+        struct fsck_worker *w = &st->workers[t];
+        stats->inodes+=w->inodes;
+        stats->dirs+=w->dirs;
+        stats->entries+=w->entries;
+        for(uint32_t inr=0; inr<st->nb_inodes; ++inr) st->refs[inr]+=w->refs[inr];
+        for(size_t p=0; (p<w->nb_problems)&&(err==0); ++p) {
+            err=fsck_merge_report(st,&cap,w->problems[p].inr,w->problems[p].kind,w->problems[p].where);
+        }
+    }
+
+    const struct inode *root = &st->inodes[ROOT_INUMBER];
+    if((err==0) && (!(root->i_mode & IALLOC) || ((root->i_mode & IFMT)!=IFDIR))) {
+        err=fsck_merge_report(st,&cap,ROOT_INUMBER,FSCK_BAD_INODE,inode_getsize(root));
+    }
+    for(uint32_t inr=ROOT_INUMBER; (inr<st->nb_inodes)&&(err==0); ++inr) {
+        const struct inode *ino = &st->inodes[inr];
+        if(!(ino->i_mode & IALLOC) || (st->keep[inr]==KEEP_NONE)) continue;
+        if((inr!=ROOT_INUMBER) && (st->refs[inr]==0)) {
+            err=fsck_merge_report(st,&cap,inr,FSCK_ORPHAN,0);
+        } else if((ino->i_nlink!=0) && (ino->i_nlink!=st->refs[inr])) {
+            // i_nlink n'est pas tenu à jour par ce projet : 0 est accepté
+            err=fsck_merge_report(st,&cap,inr,FSCK_NLINK,st->refs[inr]);
+        }
+    }
+
+    uint32_t nb_sectors = u->s.s_fsize;
+    uint8_t *computed = calloc(nb_sectors>st->nb_inodes ? nb_sectors : st->nb_inodes, 1);
+    if(computed==NULL) err=(err<0) ? err : ERR_NOMEM;
+    for(uint32_t s=0; (err==0)&&(s<nb_sectors); ++s) {
+        if(st->claims[s]>0) ++stats->sectors;
+        computed[s] = (s<u->s.s_block_start) || (st->claims[s]>0);
+    }
+    if((err==0) && (u->s.s_fbmsize>0) && (u->s.s_ibmsize>0)) {
+        uint8_t *disk = malloc(((size_t)u->s.s_fbmsize+u->s.s_ibmsize)*SECTOR_SIZE);
+        if(disk==NULL) err=ERR_NOMEM;
+        if(err==0) err=SECTOR_TAGGED(SECTOR_TAG_BITMAP, journal_read(u,u->s.s_fbm_start,u->s.s_fbmsize,disk));
+        if(err==0) err=SECTOR_TAGGED(SECTOR_TAG_BITMAP, journal_read(u,u->s.s_ibm_start,u->s.s_ibmsize,disk+u->s.s_fbmsize*SECTOR_SIZE));
+        uint32_t diff = (err==0) ? fsck_bitmap_diff(disk,nb_sectors,computed) : 0;
+        if(diff>0) err=fsck_merge_report(st,&cap,0,FSCK_FBM,diff);
+        for(uint32_t inr=0; (err==0)&&(inr<st->nb_inodes); ++inr) {
+            computed[inr] = (inr<=ROOT_INUMBER) || (st->inodes[inr].i_mode & IALLOC);
+        }
+        diff = (err==0) ? fsck_bitmap_diff(disk+u->s.s_fbmsize*SECTOR_SIZE,st->nb_inodes,computed) : 0;
+        if(diff>0) err=fsck_merge_report(st,&cap,0,FSCK_IBM,diff);
+        free(disk);
+    }
+    free(computed);
+    if(st->nb_problems>0) qsort(st->problems,st->nb_problems,sizeof(struct fsck_problem),fsck_problem_cmp);
+    return err;
+}
+
+/**
+ * @brief a whole check: the inode table, both parallel phases and the merge
+ * @return 0 on success; <0 on error
+ */
+static int fsck_pass(struct fsck_state *st, struct fsck_stats *stats)
+{
+    int err=inode_read_all(st->u,st->inodes);
+    if(err<0) return err;
+    for(uint32_t s=0; s<FSCK_MAX_SECTORS; ++s) st->owner[s]=NO_OWNER;
+    memset(st->claims,0,FSCK_MAX_SECTORS*sizeof(uint32_t));
+    for(uint32_t inr=0; inr<st->nb_inodes; ++inr) st->keep[inr]=KEEP_ALL;
+    st->next=0;
+    for(int t=0; t<FSCK_THREADS; ++t) {
+        struct fsck_worker *w = &st->workers[t];
+        w->err=0;
+        w->nb_problems=w->nb_maps=w->nb_claimed=0;
+        w->inodes=w->dirs=0;
+        w->entries=0;
+        memset(w->refs,0,st->nb_inodes*sizeof(uint32_t));
+    }
+    if((err=fsck_run(st,fsck_phase_inodes))<0) return err;
+    if((err=fsck_run(st,fsck_phase_doubles))<0) return err;
+    return fsck_merge(st,stats);
+}
+
+/**
+ * @brief shrink a file to new_size bytes (at most its size): the pointers
+ *        past the end are dropped and a large file may become small
+ * @return 0 on success; <0 on error
+ */
+static int fsck_resize(struct unix_filesystem *u, uint16_t inr, int32_t new_size)
+{
+    struct inode ino;
+    int err=inode_read(u,inr,&ino);
+    if(err<0) return err;
+    int32_t size = inode_getsize(&ino);
+    if(new_size>size) new_size=size;
+    int new_nb = NB_SECTORS(new_size);
+    if(new_size>MAX_SMALL_FILE) {
+        for(int j=NB_INDIRECT(new_nb); j<ADDR_SMALL_LENGTH; ++j) ino.i_addr[j]=0;
+        ino.i_mode |= ILARG;
+    } else {
+        if((size>MAX_SMALL_FILE) && (new_nb>0)) {
+            uint16_t addresses[ADDRESSES_PER_SECTOR];
+            if((err=SECTOR_TAGGED(SECTOR_TAG_INODE, journal_read(u,ino.i_addr[0],1,addresses)))<0) return err;
+            memcpy(ino.i_addr,addresses,new_nb*sizeof(uint16_t));
+        }
+        for(int j=new_nb; j<ADDR_SMALL_LENGTH; ++j) ino.i_addr[j]=0;
+        ino.i_mode &= ~ILARG;
+    }
+    if((err=inode_setsize(&ino,new_size))<0) return err;
+    return inode_write(u,inr,&ino);
+}
+
+/**
+ * @brief remove the nb entries of a directory listed in bad (sorted)
+ * @return 0 on success; <0 on error
+ */
+static int fsck_remove_entries(struct unix_filesystem *u, uint16_t inr, const struct fsck_problem *bad, size_t nb)
+{
+    struct inode ino;
+    uint16_t *sectors = malloc(MAX_FILE_SECTORS*sizeof(uint16_t));
+    uint8_t *data = malloc(MAX_SIZE_FILE);
+    int err = (sectors==NULL || data==NULL) ? ERR_NOMEM : inode_read(u,inr,&ino);
+    int nb_sectors = (err<0) ? err : filev6_blockmap(u,&ino,sectors);
+    if(nb_sectors<0) err=nb_sectors;
+    for(int k=0; (err==0)&&(k<nb_sectors); ++k) {
+        err=SECTOR_TAGGED(SECTOR_TAG_DIR, journal_read(u,sectors[k],1,data+k*SECTOR_SIZE));
+    }
+    if(err==0) {
+        struct direntv6 *entries = (struct direntv6 *)data;
+        int nb_entries = inode_getsize(&ino)/(int)sizeof(struct direntv6);
+        int kept=0;
+        size_t b=0;
+        for(int e=0; e<nb_entries; ++e) {
+            while((b<nb)&&(bad[b].where<(uint32_t)e)) ++b;
+            if((b<nb)&&(bad[b].where==(uint32_t)e)) continue;
+            entries[kept++]=entries[e];
+        }
+        int32_t new_size = kept*(int32_t)sizeof(struct direntv6);
+        for(int k=(int)(bad[0].where/DIRENTRIES_PER_SECTOR); (err==0)&&(k<NB_SECTORS(new_size)); ++k) {
+            err=SECTOR_TAGGED(SECTOR_TAG_DIR, journal_write(u,sectors[k],1,data+k*SECTOR_SIZE));
+        }
+        if(err==0) err=fsck_resize(u,inr,new_size);
+    }
+    free(sectors);
+    free(data);
+    return err;
+}
+
+/**
+ * @brief give an orphan an entry "#<inode>" in the root directory
+ * @return 0 on success; <0 on error
+ */
+static int fsck_attach(struct unix_filesystem *u, uint16_t inr)
+{
+    struct direntv6 entry;
+    char name[DIRENT_MAXLEN+1];
+    memset(&entry,0,sizeof(entry));
+    entry.d_inumber=inr;
+    snprintf(name,sizeof(name),"#%u",inr);
+    strncpy(entry.d_name,name,DIRENT_MAXLEN);
+    struct filev6 root;
+    int err=filev6_open(u,ROOT_INUMBER,&root);
+    if(err<0) return err;
+    return SECTOR_TAGGED(SECTOR_TAG_DIR, filev6_writebytes(u,&root,&entry,sizeof(entry)));
+}
+
+/**
+ * @brief repair the problems of the last pass, inode by inode
+ * @return 0 on success; <0 on error
+ */
+static int fsck_repair(struct fsck_state *st)
+{
+    struct unix_filesystem *u = st->u;
+    int err=0;
+    for(size_t p=0; (p<st->nb_problems)&&(err==0); ++p) {
+        const struct fsck_problem *pb = &st->problems[p];
+        uint16_t inr = (uint16_t)pb->inr;
+        struct inode ino;
+        switch(pb->kind) {
+        case FSCK_BAD_INODE:
+            if(inr==ROOT_INUMBER) break;
+            memset(&ino,0,sizeof(ino));
+            err=inode_write(u,inr,&ino);
+            // ses autres problèmes disparaissent avec elle
+            while((p+1<st->nb_problems)&&(st->problems[p+1].inr==pb->inr)) ++p;
+            break;
+        case FSCK_BAD_FLAG:
+        case FSCK_BAD_POINTER:
+        case FSCK_DOUBLE:
+            if(st->keep[inr]==KEEP_NONE) break;
+            // fsck_resize remet aussi ILARG d'accord avec la taille
+            err=fsck_resize(u,inr,(st->keep[inr]==KEEP_ALL) ? MAX_SIZE_FILE : st->keep[inr]*SECTOR_SIZE);
+            st->keep[inr]=KEEP_NONE;
+            break;
+        case FSCK_BAD_ENTRY: {
+            size_t last=p+1;
+            while((last<st->nb_problems)&&(st->problems[last].inr==pb->inr)&&(st->problems[last].kind==FSCK_BAD_ENTRY)) ++last;
+            err=fsck_remove_entries(u,inr,pb,last-p);
+            p=last-1;
+            break;
+        }
+        case FSCK_NLINK:
+            if((err=inode_read(u,inr,&ino))<0) break;
+            ino.i_nlink = (pb->where>UINT8_MAX) ? UINT8_MAX : (uint8_t)pb->where;
+            err=inode_write(u,inr,&ino);
+            break;
+        case FSCK_ORPHAN:
+            err=fsck_attach(u,inr);
+            break;
+        default:
+            // les bitmaps sont reconstruites après la dernière passe
+            break;
+        }
+    }
+    return err;
+}
+
+/**
+ * @brief rebuild the bitmaps in memory from the last pass, then on disk
+ * @return 0 on success; <0 on error
+ */
+static int fsck_rebuild_bitmaps(struct fsck_state *st)
+{
+    struct unix_filesystem *u = st->u;
+    for(uint64_t s=u->fbm->min; s<=u->fbm->max; ++s) {
+        if(st->claims[s]>0) bm_set(u->fbm,s);
+        // libéré au commit, qui le révoque s'il a été journalisé
+        else if(bm_get(u->fbm,s)==1) journal_free(u,s);
+    }
+    for(uint64_t inr=u->ibm->min; inr<=u->ibm->max; ++inr) {
+        if(st->inodes[inr].i_mode & IALLOC) bm_set(u->ibm,inr);
+        else bm_clear(u->ibm,inr);
+    }
+    bm_recount(u->fbm);
+    bm_recount(u->ibm);
+    return mountv6_store_bitmaps(u);
+}
+
+/**
+ * @brief free the state of the check
+ */
+static void fsck_free(struct fsck_state *st)
+{
+    if(st==NULL) return;
+    for(int t=0; t<FSCK_THREADS; ++t) {
+        struct fsck_worker *w = &st->workers[t];
+        free(w->problems);
+        free(w->maps);
+        free(w->claimed);
+        free(w->refs);
+        free(w->seen);
+        free(w->sectors);
+        free(w->data);
+    }
+    free(st->inodes);
+    free(st->owner);
+    free(st->claims);
+    free(st->keep);
+    free(st->problems);
+    free(st->refs);
+    free(st);
+}
+
+/**
+ * @brief allocate the state of the check
+ * @return the state; NULL on error
+ */
+static struct fsck_state *fsck_alloc(struct unix_filesystem *u)
+{
+    struct fsck_state *st = calloc(1,sizeof(struct fsck_state));
+    if(st==NULL) return NULL;
+    st->u=u;
+    st->nb_inodes=(uint32_t)u->s.s_isize*INODES_PER_SECTOR;
+    st->inodes=calloc(st->nb_inodes,sizeof(struct inode));
+    st->owner=malloc(FSCK_MAX_SECTORS*sizeof(uint32_t));
+    st->claims=malloc(FSCK_MAX_SECTORS*sizeof(uint32_t));
+    st->keep=malloc(st->nb_inodes*sizeof(int32_t));
+    st->refs=malloc(st->nb_inodes*sizeof(uint32_t));
+    int ok = (st->inodes!=NULL) && (st->owner!=NULL) && (st->claims!=NULL) && (st->keep!=NULL) && (st->refs!=NULL);
+    for(int t=0; ok && (t<FSCK_THREADS); ++t) {
+        struct fsck_worker *w = &st->workers[t];
+        w->st=st;
+        w->refs=malloc(st->nb_inodes*sizeof(uint32_t));
+        w->seen=calloc(FSCK_MAX_SECTORS,1);
+        w->sectors=malloc(MAX_FILE_SECTORS*sizeof(uint16_t));
+        w->data=malloc(MAX_SIZE_FILE);
+        ok = (w->refs!=NULL) && (w->seen!=NULL) && (w->sectors!=NULL) && (w->data!=NULL);
+    }
+    if(!ok) {
+        fsck_free(st);
+        return NULL;
+    }
+    return st;
+}
+
+/**
+ * @brief print the problems of a pass
+ */
+static void fsck_print(const struct fsck_state *st, FILE *out)
+{
+    for(size_t p=0; p<st->nb_problems; ++p) {
+        const struct fsck_problem *pb = &st->problems[p];
+        if((pb->kind==FSCK_FBM)||(pb->kind==FSCK_IBM)) {
+            fprintf(out,"bitmaps: %s (%s %u)\n",FSCK_KIND_NAMES[pb->kind],FSCK_WHERE_NAMES[pb->kind],pb->where);
+        } else {
+            fprintf(out,"inode %u: %s (%s %u)\n",pb->inr,FSCK_KIND_NAMES[pb->kind],FSCK_WHERE_NAMES[pb->kind],pb->where);
+        }
+    }
+}
+
+/**
+ * @brief check the filesystem, and repair it if asked to
+ * @param u the mounted filesystem, not used by anyone else meanwhile
+ * @param repair whether to repair the problems found
+ * @param out where to print the problems of the first pass (NULL: not printed)
+ * @param stats what has been found (OUT)
+ * @return 0 on success (even with problems); <0 on error
+ */
+int fsck_check(struct unix_filesystem *u, int repair, FILE *out, struct fsck_stats *stats)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(stats);
+    memset(stats,0,sizeof(*stats));
+    if((u->s.s_isize==0) || (u->s.s_inode_start+u->s.s_isize>u->s.s_block_start)
+       || (u->s.s_block_start>=u->s.s_fsize)) {
+        return ERR_BAD_PARAMETER;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct fsck_state *st = fsck_alloc(u);
+    if(st==NULL) return ERR_NOMEM;
+
+    mountv6_lock_exclusive(u);
+    // les secteurs libérés par la transaction en cours rejoignent d'abord la bitmap
+    int err=journal_commit(u);
+    while(err==0) {
+        struct fsck_stats pass;
+        memset(&pass,0,sizeof(pass));
+        if((err=fsck_pass(st,&pass))<0) break;
+        unsigned int counts[FSCK_LAST] = {0};
+        for(size_t p=0; p<st->nb_problems; ++p) ++counts[st->problems[p].kind];
+        if(++stats->passes==1) {
+            stats->inodes=pass.inodes;
+            stats->dirs=pass.dirs;
+            stats->entries=pass.entries;
+            stats->sectors=pass.sectors;
+            memcpy(stats->problems,counts,sizeof(counts));
+            if(out!=NULL) fsck_print(st,out);
+        }
+        stats->remaining=(unsigned int)st->nb_problems;
+        if(!repair || (st->nb_problems==0)) break;
+        unsigned int structural=stats->remaining-counts[FSCK_FBM]-counts[FSCK_IBM];
+        if((structural>0) && (stats->passes<FSCK_MAX_PASSES)) {
+            err=fsck_repair(st);
+            continue;
+        }
+        // il ne reste que les bitmaps (ou plus de passes) : elles sont reconstruites
+        if((err=fsck_rebuild_bitmaps(st))==0) stats->remaining=structural;
+        break;
+    }
+    if((err==0) && repair) err=journal_commit(u);
+    mountv6_unlock(u);
+
+    fsck_free(st);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return err;
+}
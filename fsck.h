@@ -0,0 +1,74 @@
+#pragma once
+
+/**
+ * @file fsck.h
+ * @brief checking (and repairing) the consistency of the UNIX v6 filesystem
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include "mount.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* number of threads checking the inodes */
+#define FSCK_THREADS 8
+
+/* number of inodes handed to a thread at a time */
+#define FSCK_CHUNK_INODES 256
+
+/* number of check passes in repair mode (a repair may reveal other problems) */
+#define FSCK_MAX_PASSES 4
+
+enum fsck_kind {
+    FSCK_BAD_INODE,     /* size above the largest file (or unusable root) */
+    FSCK_BAD_FLAG,      /* ILARG does not match the size */
+    FSCK_BAD_POINTER,   /* sector outside [s_block_start, s_fsize) */
+    FSCK_DOUBLE,        /* sector already used by another file, or twice by this one */
+    FSCK_BAD_ENTRY,     /* directory entry to an unallocated or out of range inode */
+    FSCK_NLINK,         /* link count different from the number of entries */
+    FSCK_ORPHAN,        /* allocated inode without any entry */
+    FSCK_FBM,           /* sectors whose bit differs in the persisted sector bitmap */
+    FSCK_IBM,           /* inodes whose bit differs in the persisted inode bitmap */
+    FSCK_LAST
+};
+
+/* description of each kind of problem, indexed by enum fsck_kind */
+extern const char * const FSCK_KIND_NAMES[FSCK_LAST];
+
+struct fsck_stats {
+    unsigned int inodes;               /* allocated inodes checked */
+    unsigned int dirs;                 /* directories among them */
+    uint64_t entries;                  /* directory entries checked */
+    uint64_t sectors;                  /* sectors used by the files (data and indirect) */
+    unsigned int problems[FSCK_LAST];  /* problems found by the first pass */
+    unsigned int remaining;            /* problems left at the end (all of them without repair) */
+    unsigned int passes;               /* number of check passes */
+    double seconds;                    /* duration of the whole check */
+};
+
+/**
+ * @brief check the filesystem: the inode table, the block pointers of each
+ *        file, sectors used twice, the directory entries, the link counts
+ *        (0, as left by this implementation, is accepted) and the persisted
+ *        bitmaps against the computed ones. The inodes are checked by
+ *        FSCK_THREADS threads, whose findings are merged at the end.
+ *
+ *        With repair, an inode whose size is too large is cleared, a file
+ *        is truncated before its first bad or shared sector, bad entries are
+ *        removed, link counts are set, orphans get an entry "#<inode>" in the
+ *        root directory, and the bitmaps (in memory and on disk) are rebuilt;
+ *        the check is then run again, up to FSCK_MAX_PASSES passes.
+ * @param u the mounted filesystem, not used by anyone else meanwhile
+ * @param repair whether to repair the problems found
+ * @param out where to print the problems of the first pass (NULL: not printed)
+ * @param stats what has been found (OUT)
+ * @return 0 on success (even with problems); <0 on error
+ */
+int fsck_check(struct unix_filesystem *u, int repair, FILE *out, struct fsck_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
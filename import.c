@@ -0,0 +1,298 @@
+/**
+ * @file import.c
+ * @brief copying a host directory tree into the UNIX v6 filesystem
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "import.h"
+#include "unixv6fs.h"
+#include "error.h"
+#include "sector.h"
+#include "inode.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "journal.h"
+
+#define NB_INDIRECT(nb) (((nb) + ADDRESSES_PER_SECTOR - 1) / ADDRESSES_PER_SECTOR)
+
+struct import_state {
+    struct unix_filesystem *u;
+    struct inode *inodes;        /* write-back copy of the whole inode table */
+    uint8_t *dirty;              /* one flag per sector of the inode table */
+    struct direntv6 *existing;   /* entries of the destination directory before the import */
+    int nb_existing;
+    struct import_stats *stats;
+    uint16_t *allocated;         /* inodes allocated by the import, given back on error */
+    int nb_allocated;
+    int cap_allocated;
+};
+
+/**
+ * @brief remember an inode allocated by the import
+ * @return 0 on success; <0 on error
+ */
+static int import_track(struct import_state *st, uint16_t inr)
+{
+    if (st->nb_allocated == st->cap_allocated) {
+        int cap = st->cap_allocated ? 2 * st->cap_allocated : 256;
+        uint16_t *bigger = realloc(st->allocated, cap * sizeof(uint16_t));
+        if (bigger == NULL) return ERR_NOMEM;
+        st->allocated = bigger;
+        st->cap_allocated = cap;
+    }
+    st->allocated[st->nb_allocated++] = inr;
+    return 0;
+}
+
+/**
+ * @brief give back the inodes allocated by a failed import, and the sectors
+ *        of those which were filled (their inode is only in st->inodes)
+ */
+static void import_release(struct import_state *st)
+{
+    uint16_t sectors[MAX_FILE_SECTORS];
+    for (int i = 0; i < st->nb_allocated; ++i) {
+        uint16_t inr = st->allocated[i];
+        struct inode *ino = &st->inodes[inr];
+        int nb = (ino->i_mode & IALLOC) ? filev6_blockmap(st->u, ino, sectors) : 0;
+        // les secteurs ont pu être journalisés (répertoires, indirects) : le commit les révoque
+        for (int k = 0; k < nb; ++k) journal_free(st->u, sectors[k]);
+        for (int k = 0; (ino->i_mode & ILARG) && (k < NB_INDIRECT(nb)); ++k) journal_free(st->u, ino->i_addr[k]);
+        memset(ino, 0, sizeof(*ino));
+        bm_clear(st->u->ibm, inr);
+    }
+    st->nb_allocated = 0;
+}
+
+/**
+ * @brief store an inode into the in-memory inode table
+ */
+static void import_set_inode(struct import_state *st, uint16_t inr, const struct inode *ino)
+{
+    st->inodes[inr] = *ino;
+    st->dirty[inr / INODES_PER_SECTOR] = 1;
+}
+
+/**
+ * @brief write the dirty sectors of the inode table, one I/O per run of dirty sectors
+ * @return 0 on success; <0 on error
+ */
+static int import_flush_table(struct import_state *st)
+{
+    int err = 0;
+    int nb = st->u->s.s_isize;
+    int first = 0;
+    while (first < nb) {
+        if (!st->dirty[first]) {
+            ++first;
+            continue;
+        }
+        int last = first + 1;
+        while ((last < nb) && st->dirty[last]) ++last;
+        if ((err = SECTOR_TAGGED(SECTOR_TAG_INODE, journal_write(st->u, st->u->s.s_inode_start + first, last - first,
+                                 &st->inodes[first * INODES_PER_SECTOR]))) < 0) return err;
+        first = last;
+    }
+    return 0;
+}
+
+/**
+ * @brief load the names of the destination directory, to refuse duplicates
+ * @return 0 on success; <0 on error
+ */
+static int import_load_existing(struct import_state *st, uint16_t dst_inr)
+{
+    struct directory_reader d;
+    int err = 0;
+    if ((err = direntv6_opendir(st->u, dst_inr, &d)) < 0) return err;
+    int nb = inode_getsize(&d.fv6.i_node) / sizeof(struct direntv6);
+    st->existing = calloc(nb + 1, sizeof(struct direntv6));
+    if (st->existing == NULL) return ERR_NOMEM;
+    char name[DIRENT_MAXLEN + 1];
+    uint16_t child_inr = 0;
+    while ((st->nb_existing < nb) && (err = direntv6_readdir(&d, name, &child_inr)) > 0) {
+        st->existing[st->nb_existing].d_inumber = child_inr;
+        strncpy(st->existing[st->nb_existing].d_name, name, DIRENT_MAXLEN);
+        ++st->nb_existing;
+    }
+    return (err < 0) ? err : 0;
+}
+
+/**
+ * @brief tells whether nb entries hold the given name
+ */
+static int import_exists(const struct direntv6 *entries, int nb, const char *name)
+{
+    for (int i = 0; i < nb; ++i) {
+        if (strncmp(entries[i].d_name, name, DIRENT_MAXLEN) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief import one host file into a newly allocated inode
+ * @return 0 on success; <0 on error
+ */
+static int import_file(struct import_state *st, const char *path, int32_t size, struct filev6 *child)
+{
+    FILE *src = fopen(path, "rb");
+    if (src == NULL) return ERR_IO;
+    int err = filev6_append_file(st->u, child, src, size);
+    fclose(src);
+    if (err < 0) return err;
+    ++st->stats->files;
+    st->stats->bytes += size;
+    return 0;
+}
+
+/**
+ * @brief import the content of a host directory into dir, then append
+ *        all the new entries to dir at once (dir->i_node is updated in memory)
+ * @param st the state of the import
+ * @param host_path the host directory (IN)
+ * @param dir the destination directory (IN-OUT)
+ * @param top whether dir is the destination of the whole import
+ * @return 0 on success; <0 on error
+ */
+static int import_dir(struct import_state *st, const char *host_path, struct filev6 *dir, int top)
+{
+    DIR *hd = opendir(host_path);
+    if (hd == NULL) return ERR_IO;
+
+    int err = 0;
+    struct direntv6 *entries = NULL;
+    int nb = 0;
+    int capacity = 0;
+    struct dirent *he = NULL;
+    while ((err == 0) && (he = readdir(hd)) != NULL) {
+        if ((strcmp(he->d_name, ".") == 0) || (strcmp(he->d_name, "..") == 0)) continue;
+
+        char path[PATH_MAX];
+        struct stat hs;
+        if ((strlen(he->d_name) > DIRENT_MAXLEN)
+            || (snprintf(path, sizeof(path), "%s/%s", host_path, he->d_name) >= (int) sizeof(path))
+            || (lstat(path, &hs) != 0)
+            || !(S_ISDIR(hs.st_mode) || S_ISREG(hs.st_mode))
+            || (S_ISREG(hs.st_mode) && hs.st_size > MAX_SIZE_FILE)
+            || (top && import_exists(st->existing, st->nb_existing, he->d_name))
+            || import_exists(entries, nb, he->d_name)) {
+            ++st->stats->skipped;
+            continue;
+        }
+
+        if (nb == capacity) {
+            capacity = capacity ? 2 * capacity : DIRENTRIES_PER_SECTOR;
+            struct direntv6 *bigger = realloc(entries, capacity * sizeof(struct direntv6));
+            if (bigger == NULL) {
+                err = ERR_NOMEM;
+                break;
+            }
+            entries = bigger;
+        }
+
+        int inr = inode_alloc_near(st->u, dir->i_number, S_ISDIR(hs.st_mode) ? IFDIR | IALLOC : IALLOC);
+        if (inr < 0) {
+            err = inr;
+            break;
+        }
+        if ((err = import_track(st, (uint16_t) inr)) < 0) {
+            bm_clear(st->u->ibm, inr);
+            break;
+        }
+        struct filev6 child;
+        memset(&child, 0, sizeof(child));
+        child.u = st->u;
+        child.i_number = inr;
+        if (S_ISDIR(hs.st_mode)) {
+            child.i_node.i_mode = IFDIR | IALLOC;
+            err = import_dir(st, path, &child, 0);
+            if (err == 0) ++st->stats->dirs;
+        } else {
+            child.i_node.i_mode = IALLOC;
+            err = import_file(st, path, (int32_t) hs.st_size, &child);
+        }
+        /* even on error: import_release then gives back the sectors it holds */
+        import_set_inode(st, inr, &child.i_node);
+        if (err < 0) break;
+
+        memset(&entries[nb], 0, sizeof(struct direntv6));
+        entries[nb].d_inumber = inr;
+        strncpy(entries[nb].d_name, he->d_name, DIRENT_MAXLEN);
+        ++nb;
+    }
+    closedir(hd);
+
+    if ((err == 0) && (nb > 0)) {
+        err = filev6_append(st->u, dir, entries, nb * sizeof(struct direntv6));
+    }
+    free(entries);
+    return err;
+}
+
+/**
+ * @brief recursively copy the content of a host directory into a directory
+ *        of the filesystem. The inode table is kept in memory during the import
+ *        and written back once at the end; each directory gets all its entries
+ *        in a single append.
+ * @param u the mounted filesystem
+ * @param host_dir the path of the directory on the host (IN)
+ * @param dst_inr the inode number of the destination directory
+ * @param stats what has been imported (OUT)
+ * @return 0 on success; <0 on error. Before the inode table is written back,
+ *         an error gives back the inodes and sectors allocated by the import
+ *         and leaves the table on disk unchanged; an error while writing it
+ *         back (which may be split over several commits of the journal) can
+ *         leave part of it written, and the allocations are then kept
+ */
+int import_tree(struct unix_filesystem *u, const char *host_dir, uint16_t dst_inr, struct import_stats *stats)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(host_dir);
+    M_REQUIRE_NON_NULL(stats);
+    memset(stats, 0, sizeof(*stats));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct import_state st;
+    memset(&st, 0, sizeof(st));
+    st.u = u;
+    st.stats = stats;
+
+    int err = 0;
+    struct filev6 dst;
+    if ((err = import_load_existing(&st, dst_inr)) == 0
+        && (err = filev6_open(u, dst_inr, &dst)) == 0) {
+        st.inodes = malloc(u->s.s_isize * SECTOR_SIZE);
+        st.dirty = calloc(u->s.s_isize, sizeof(uint8_t));
+        if ((st.inodes == NULL) || (st.dirty == NULL)) {
+            err = ERR_NOMEM;
+        } else {
+            err = inode_read_all(u, st.inodes);
+        }
+    }
+
+    if (err == 0) err = import_dir(&st, host_dir, &dst, 1);
+    if (err == 0) {
+        import_set_inode(&st, dst_inr, &dst.i_node);
+        err = import_flush_table(&st);
+    } else if (st.inodes != NULL) {
+        // rien n'a encore été écrit dans la table : tout ce qui a été alloué est rendu
+        import_release(&st);
+    }
+
+    free(st.allocated);
+    free(st.inodes);
+    free(st.dirty);
+    free(st.existing);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return err;
+}
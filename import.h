@@ -0,0 +1,42 @@
+#pragma once
+
+/**
+ * @file import.h
+ * @brief copying a host directory tree into the UNIX v6 filesystem
+ */
+
+#include <stdint.h>
+#include "mount.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct import_stats {
+    unsigned int files;   /* number of regular files imported */
+    unsigned int dirs;    /* number of directories created */
+    unsigned int skipped; /* host entries which cannot be represented (name too long, special file, too large) */
+    uint64_t bytes;       /* number of bytes of file content copied */
+    double seconds;       /* duration of the whole import */
+};
+
+/**
+ * @brief recursively copy the content of a host directory into a directory
+ *        of the filesystem. The inode table is kept in memory during the import
+ *        and written back once at the end; each directory gets all its entries
+ *        in a single append.
+ * @param u the mounted filesystem
+ * @param host_dir the path of the directory on the host (IN)
+ * @param dst_inr the inode number of the destination directory
+ * @param stats what has been imported (OUT)
+ * @return 0 on success; <0 on error. Before the inode table is written back,
+ *         an error gives back the inodes and sectors allocated by the import
+ *         and leaves the table on disk unchanged; an error while writing it
+ *         back (which may be split over several commits of the journal) can
+ *         leave part of it written, and the allocations are then kept
+ */
+int import_tree(struct unix_filesystem *u, const char *host_dir, uint16_t dst_inr, struct import_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
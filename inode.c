@@ -10,6 +10,7 @@
 #include "error.h"
 #include "sector.h"
 #include "bmblock.h"
+#include "journal.h"
 
 /**
  * @brief read all inodes from disk and print out their content to
@@ -26,7 +27,7 @@ int inode_scan_print(const struct unix_filesystem *u)
     uint8_t secteurs[SECTOR_SIZE];
     int numinode=0;
     for(int m=0; m<(u->s.s_isize); ++m) {
-        if((r=sector_read(u->f,(u->s.s_inode_start+m),secteurs))!=0) {
+        if((r=SECTOR_TAGGED(SECTOR_TAG_INODE, journal_read(u,(u->s.s_inode_start+m),1,secteurs)))!=0) {
             return r;
         }
         for(int i=0; i<SECTOR_SIZE; i+=INODE_SIZE) {
@@ -95,35 +96,24 @@ void inode_print(const struct inode *inode)
 int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inode)
 {
     /* initialisations */
-    int sector_nbr=0;
     int r=1;
     uint8_t my_sector[SECTOR_SIZE];
-    int counter=0;
-    memset(inode, 0, sizeof(*inode));
 
     /* propager les erreurs s'il y en a */
     M_REQUIRE_NON_NULL(u);
     M_REQUIRE_NON_NULL(inode);
-
-    /* si un des secteurs de u n'est pas lisible */
-    for(int i=0; i<(u->s.s_isize); ++i) {
-        if((r=sector_read(u->f,(u->s.s_inode_start+i),my_sector))!=0) return r;
-    }
+    memset(inode, 0, sizeof(*inode));
 
     /* si le numéro d'inode est invalide */
-    if ((inr<0)||(inr>(u->s.s_isize*INODES_PER_SECTOR-1))) {
+    if (inr>(u->s.s_isize*INODES_PER_SECTOR-1)) {
         return ERR_INODE_OUTOF_RANGE;
     }
 
+    /* on lit directement le secteur contenant l'inode */
+    if((r=SECTOR_TAGGED(SECTOR_TAG_INODE, journal_read(u,(u->s.s_inode_start+inr/INODES_PER_SECTOR),1,my_sector)))!=0) return r;
 
-    /* il faut lire secteur par secteur jusqu'a arriver au secteur contenant le bon inode */
-    while(counter<=inr) {
-        sector_read(u->f,(u->s.s_inode_start+sector_nbr),my_sector);
-        counter+=INODES_PER_SECTOR;
-        ++sector_nbr;
-    }
     /* affectation de tout les parametres */
-    int i= (inr-((sector_nbr-1)*INODES_PER_SECTOR))*INODE_SIZE;
+    int i= (inr%INODES_PER_SECTOR)*INODE_SIZE;
     inode->i_mode = ((uint16_t)my_sector[i+1])<<8 | (uint16_t)my_sector[i];
     inode->i_nlink = my_sector[i+2];
     inode->i_uid = my_sector[i+3];
@@ -154,6 +144,19 @@ int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inod
 
 }
 
+/**
+ * @brief read the whole inode table from disk in one I/O
+ * @param u the filesystem (IN)
+ * @param inodes room for u->s.s_isize*INODES_PER_SECTOR inodes (OUT)
+ * @return 0 on success; <0 on error
+ */
+int inode_read_all(const struct unix_filesystem *u, struct inode *inodes)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(inodes);
+    return SECTOR_TAGGED(SECTOR_TAG_INODE, journal_read(u,u->s.s_inode_start,u->s.s_isize,inodes));
+}
+
 /**
  * @brief identify the sector that corresponds to a given portion of a file
  * @param u the filesystem (IN)
@@ -182,7 +185,7 @@ int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int
     if((size_file>(ADDR_SMALL_LENGTH)*SECTOR_SIZE)&&(size_file<=MAX_SIZE*SECTOR_SIZE)) {
         uint16_t adresses[ADDRESSES_PER_SECTOR];
         int secteur_indirect = file_sec_off/ADDRESSES_PER_SECTOR;
-        if((r = sector_read(u->f, i->i_addr[secteur_indirect], adresses))!=0) {
+        if((r = SECTOR_TAGGED(SECTOR_TAG_INODE, journal_read(u, i->i_addr[secteur_indirect], 1, adresses)))!=0) {
             return r;
         }
         /* On retourne le numero du secteur voulu contenu dans l'element d'indice offset mod 256*/
@@ -220,6 +223,32 @@ int inode_alloc(struct unix_filesystem *u)
 	return next;
 }
 
+/**
+ * @brief alloc a new inode close to its parent directory
+ * @param u the filesystem (IN)
+ * @param parent the inode number of the parent directory
+ * @param mode the mode of the new inode
+ * @return the inode number of the new inode or error code on error
+ */
+int inode_alloc_near(struct unix_filesystem *u, uint16_t parent, uint16_t mode)
+{
+    M_REQUIRE_NON_NULL(u);
+    int next = -1;
+    if((mode & IFMT) == IFDIR) {
+        // le premier secteur d'inodes entièrement libre à partir de celui du parent
+        for(int k=0; (k<u->s.s_isize)&&(next<0); ++k) {
+            int first = ((parent/INODES_PER_SECTOR+k)%u->s.s_isize)*INODES_PER_SECTOR;
+            int j=0;
+            while((j<INODES_PER_SECTOR)&&(bm_get(u->ibm,first+j)==0)) ++j;
+            if(j==INODES_PER_SECTOR) next=first;
+        }
+    }
+    if(next<0) next = bm_find_next_from(u->ibm, parent);
+    if(next<0) return ERR_NOMEM;
+    bm_set(u->ibm, next);
+    return next;
+}
+
 /**
  * @brief write the content of an inode to disk
  * @param u the filesystem (IN)
@@ -229,40 +258,26 @@ int inode_alloc(struct unix_filesystem *u)
  */
 int inode_write(struct unix_filesystem *u, uint16_t inr, struct inode *inode)
 {
-	/* initialisations */
-    int index=0;
+    /* initialisations */
     int r=1;
     struct inode inodes[INODES_PER_SECTOR];
-    int counter=0;
-	int err = 0;
 
     /* propager les erreurs s'il y en a */
     M_REQUIRE_NON_NULL(u);
     M_REQUIRE_NON_NULL(inode);
 
-    /* si un des secteurs de u n'est pas lisible */
-    for(int i=0; i<(u->s.s_isize); ++i) {
-        if((r=sector_read(u->f,(u->s.s_inode_start+i),inodes))!=0) return r;
-    }
-	
-	/* si le numéro d'inode est invalide */
-    if ((inr<0)||(inr>(u->s.s_isize*INODES_PER_SECTOR-1))) {
+    /* si le numéro d'inode est invalide */
+    if (inr>(u->s.s_isize*INODES_PER_SECTOR-1)) {
         return ERR_INODE_OUTOF_RANGE;
     }
-    
-    /* il faut lire secteur par secteur jusqu'a arriver au secteur contenant le bon inode */
-    while(counter<=inr) {
-        sector_read(u->f,(u->s.s_inode_start+index),inodes);
-        counter+=INODES_PER_SECTOR;
-        ++index;
-    }
-    --index;
-    int sector_nbr=u->s.s_inode_start+index;
-    
+
+    /* on lit directement le secteur contenant l'inode (lecture-modification-écriture) */
+    int sector_nbr=u->s.s_inode_start+inr/INODES_PER_SECTOR;
+    if((r=SECTOR_TAGGED(SECTOR_TAG_INODE, journal_read(u,sector_nbr,1,inodes)))!=0) return r;
+
     /* écriture du secteur contenant le nouvel inode */
-    inodes[inr]=*inode;
-    if((err = sector_write(u->f,sector_nbr,inodes))<0) return err;
-    
+    inodes[inr%INODES_PER_SECTOR]=*inode;
+    if((r=SECTOR_TAGGED(SECTOR_TAG_INODE, journal_write(u,sector_nbr,1,inodes)))<0) return r;
+
     return 0;
 }
-
@@ -51,6 +51,29 @@ static inline int32_t inode_getsectorsize(const struct inode *inode)
     return (i_size ? ((i_size - 1) / SECTOR_SIZE + 1) * SECTOR_SIZE + 1 : 1);
 }
 
+/**
+ * @brief Return the version of the content of a file: the number of times
+ *        it was modified, kept in i_mtime (see filev6); the Merkle trees
+ *        use it to know whether a file changed since they were built
+ * @param inode the inode
+ * @return the version of the file
+ */
+static inline uint32_t inode_getversion(const struct inode *inode)
+{
+    return ((uint32_t)inode->i_mtime[0] << 16) | inode->i_mtime[1];
+}
+
+/**
+ * @brief count one more modification of the content of a file
+ * @param inode the inode
+ */
+static inline void inode_nextversion(struct inode *inode)
+{
+    uint32_t version = inode_getversion(inode) + 1;
+    inode->i_mtime[0] = (uint16_t)(version >> 16);
+    inode->i_mtime[1] = (uint16_t)version;
+}
+
 /**
  * @brief set the size of a given inode to the given size
  * @param inode the inode
@@ -82,6 +105,14 @@ int inode_scan_print(const struct unix_filesystem *u);
  */
 int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inode);
 
+/**
+ * @brief read the whole inode table from disk in one I/O
+ * @param u the filesystem (IN)
+ * @param inodes room for u->s.s_isize*INODES_PER_SECTOR inodes (OUT)
+ * @return 0 on success; <0 on error
+ */
+int inode_read_all(const struct unix_filesystem *u, struct inode *inodes);
+
 /**
  * @brief identify the sector that corresponds to a given portion of a file
  * @param u the filesystem (IN)
@@ -98,6 +129,20 @@ int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int
  */
 int inode_alloc(struct unix_filesystem *u);
 
+/**
+ * @brief alloc a new inode close to its parent directory: a file takes the
+ *        first free slot from its parent on (i.e. in the sector of its
+ *        siblings when there is room), a directory takes an empty inode
+ *        sector, which its own children will fill
+ * @param u the filesystem (IN)
+ * @param parent the inode number of the parent directory; only its number is
+ *        used (its inode is not read, it may exist only in memory, as in
+ *        import_tree)
+ * @param mode the mode of the new inode
+ * @return the inode number of the new inode or error code on error
+ */
+int inode_alloc_near(struct unix_filesystem *u, uint16_t parent, uint16_t mode);
+
 /**
  * @brief write the content of an inode to disk
  * @param u the filesystem (IN)
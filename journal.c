@@ -0,0 +1,462 @@
+/**
+ * @file journal.c
+ * @brief write-ahead journal of the metadata sectors, with group commit
+ *
+ * Layout of the region: its first sector (JOURNAL_SUPER) gives the sequence
+ * number of the first record; then come the commit records, each one
+ * followed by the sectors it logs. A record is valid if it has the expected
+ * sequence number and its checksum matches: a record torn by a crash ends
+ * the replay. When a record does not fit at the end of the region, the
+ * writes in place of the previous ones are synced and the region starts
+ * again from its first record.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "journal.h"
+#include "error.h"
+#include "sector.h"
+
+/* the number of sectors of a volume (16-bit sector numbers) */
+#define JOURNAL_MAX_SECTORS 65536
+
+/**
+ * @brief sync the disk image
+ * @return 0 on success; <0 on error
+ */
+static int journal_sync(struct unix_filesystem *u)
+{
+    if(u->journal!=NULL) ++u->journal->stats.fsyncs;
+    return (fsync(fileno(u->f))==0) ? 0 : ERR_IO;
+}
+
+/**
+ * @brief checksum (FNV-1a) of a commit record and of the sectors it logs
+ */
+static uint32_t journal_checksum(const struct journal_block *block, const uint8_t *data)
+{
+    struct journal_block copy = *block;
+    copy.checksum = 0;
+    uint32_t h = 2166136261u;
+    const uint8_t *p = (const uint8_t *)&copy;
+    for(size_t i=0; i<sizeof(copy); ++i) h = (h ^ p[i]) * 16777619u;
+    for(size_t i=0; i<(size_t)block->nb*SECTOR_SIZE; ++i) h = (h ^ data[i]) * 16777619u;
+    return h;
+}
+
+/**
+ * @brief write the first sector of the region: the records before seq are forgotten
+ * @return 0 on success; <0 on error
+ */
+static int journal_write_super(struct unix_filesystem *u, uint32_t seq)
+{
+    struct journal *j = u->journal;
+    struct journal_block super;
+    memset(&super,0,sizeof(super));
+    super.magic = JOURNAL_MAGIC;
+    super.kind = JOURNAL_SUPER;
+    super.seq = seq;
+    j->head = 1;
+    memset(j->live,0,JOURNAL_MAX_SECTORS/8);
+    return sector_write(u->f,j->start,&super);
+}
+
+/**
+ * @brief the position of a sector in the running transaction, or -1
+ */
+static int journal_find(const struct journal *j, uint32_t sector)
+{
+    for(int i=0; i<j->nb; ++i) {
+        if(j->sectors[i]==sector) return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief read the commit record at pos of the region and the sectors it logs,
+ *        if it is the valid record of sequence number seq
+ * @param data room for JOURNAL_ENTRIES sectors (OUT)
+ * @return 1 if valid, 0 if not; <0 on error
+ */
+static int journal_read_record(struct unix_filesystem *u, uint32_t pos, uint32_t seq,
+                               struct journal_block *block, uint8_t *data)
+{
+    struct journal *j = u->journal;
+    if(pos+1>j->size) return 0;
+    int err=sector_read(u->f,j->start+pos,block);
+    if(err<0) return err;
+    if((block->magic!=JOURNAL_MAGIC) || (block->kind!=JOURNAL_COMMIT) || (block->seq!=seq)
+       || (block->nb+block->revoked>JOURNAL_ENTRIES) || (pos+1+block->nb>j->size)) {
+        return 0;
+    }
+    if((block->nb>0) && (err=sectors_read(u->f,j->start+pos+1,block->nb,data))<0) return err;
+    return journal_checksum(block,data)==block->checksum;
+}
+
+/**
+ * @brief replay the valid records of the region, in order; a sector revoked
+ *        by a record is not replayed from it nor from the ones before
+ * @return 0 on success; <0 on error
+ */
+static int journal_replay(struct unix_filesystem *u)
+{
+    struct journal *j = u->journal;
+    struct journal_block block;
+    uint8_t *data = malloc((size_t)JOURNAL_ENTRIES*SECTOR_SIZE);
+    uint32_t *revoked_by = calloc(JOURNAL_MAX_SECTORS, sizeof(uint32_t));
+    int err = (data==NULL || revoked_by==NULL) ? ERR_NOMEM : 0;
+
+    // d'abord les révocations de tous les enregistrements valides
+    uint32_t pos=1, seq=j->seq;
+    while((err==0) && (err=journal_read_record(u,pos,seq,&block,data))==1) {
+        for(int k=block.nb; k<block.nb+block.revoked; ++k) revoked_by[block.sectors[k]]=seq;
+        pos+=1+block.nb;
+        ++seq;
+        err=0;
+    }
+    uint32_t end=seq;
+    pos=1;
+    for(seq=j->seq; (err>=0)&&(seq<end); ++seq) {
+        err=journal_read_record(u,pos,seq,&block,data);
+        for(int k=0; (err>=0)&&(k<block.nb); ++k) {
+            if(revoked_by[block.sectors[k]]>=seq) continue;
+            err=sector_write(u->f,block.sectors[k],data+k*SECTOR_SIZE);
+            ++j->stats.replayed;
+        }
+        pos+=1+block.nb;
+    }
+    free(data);
+    free(revoked_by);
+    if(err<0) return err;
+
+    // tout est en place : le journal repart de zéro
+    if(end>j->seq) {
+        j->seq=end;
+        if((err=journal_sync(u))<0) return err;
+        if((err=journal_write_super(u,j->seq))<0) return err;
+        err=journal_sync(u);
+    }
+    return err;
+}
+
+/**
+ * @brief open the journal of a filesystem whose superblock was read, and
+ *        replay its committed records; u->journal stays NULL if the disk has none
+ * @param u the filesystem, before its bitmaps are built
+ * @return 0 on success; <0 on error
+ */
+int journal_open(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+    u->journal=NULL;
+    const struct superblock *s = &u->s;
+    // les anciens disques n'ont pas de journal (et peut-être n'importe quoi dans pad)
+    if((s->s_journal_size<JOURNAL_MIN_SECTORS) || (s->s_journal_start<s->s_inode_start+s->s_isize)
+       || (s->s_journal_start+s->s_journal_size>s->s_block_start)) {
+        return 0;
+    }
+    struct journal_block super;
+    int err=sector_read(u->f,s->s_journal_start,&super);
+    if(err<0) return err;
+    if((super.magic!=JOURNAL_MAGIC) || (super.kind!=JOURNAL_SUPER)) return 0;
+
+    struct journal *j = calloc(1,sizeof(struct journal));
+    if(j==NULL) return ERR_NOMEM;
+    j->data=calloc(JOURNAL_ENTRIES,SECTOR_SIZE);
+    j->live=calloc(JOURNAL_MAX_SECTORS/8,1);
+    if(j->data==NULL || j->live==NULL) {
+        free(j->data);
+        free(j->live);
+        free(j);
+        return ERR_NOMEM;
+    }
+    j->start=s->s_journal_start;
+    j->size=s->s_journal_size;
+    j->head=1;
+    j->seq=super.seq;
+    // un enregistrement doit tenir dans la zone, et laisser de la place aux bitmaps
+    int room = (j->size-2<JOURNAL_ENTRIES) ? j->size-2 : JOURNAL_ENTRIES;
+    j->capacity = room-s->s_fbmsize-s->s_ibmsize;
+    if(j->capacity<1) j->capacity=1;
+    u->journal=j;
+    if((err=journal_replay(u))<0) {
+        free(j->data);
+        free(j->live);
+        free(j);
+        u->journal=NULL;
+    }
+    return err;
+}
+
+/**
+ * @brief commit the running transaction, then forget the records of the
+ *        region (they are all in place and synced) and free the journal
+ * @param u the filesystem
+ * @return 0 on success; <0 on error
+ */
+int journal_close(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+    struct journal *j = u->journal;
+    if(j==NULL) return 0;
+    int err=journal_commit(u);
+    if((err==0) && (j->head>1)) {
+        if((err=journal_write_super(u,j->seq))==0) err=journal_sync(u);
+    }
+    free(j->data);
+    free(j->live);
+    free(j->freed);
+    free(j);
+    u->journal=NULL;
+    return err;
+}
+
+/**
+ * @brief read nb consecutive sectors, as the running transaction left them
+ * @param u the filesystem
+ * @param sector the first sector
+ * @param nb the number of sectors
+ * @param data room for nb*SECTOR_SIZE bytes (OUT)
+ * @return 0 on success; <0 on error
+ */
+int journal_read(const struct unix_filesystem *u, uint32_t sector, uint32_t nb, void *data)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(data);
+    int err=sectors_read(u->f,sector,nb,data);
+    const struct journal *j = u->journal;
+    for(int i=0; (err==0)&&(j!=NULL)&&(i<j->nb); ++i) {
+        if((j->sectors[i]>=sector) && (j->sectors[i]<sector+nb)) {
+            memcpy((uint8_t *)data+(size_t)(j->sectors[i]-sector)*SECTOR_SIZE,j->data[i],SECTOR_SIZE);
+        }
+    }
+    return err;
+}
+
+/**
+ * @brief write nb consecutive metadata sectors into the running transaction
+ *        (directly to the disk without a journal). A full transaction is
+ *        committed first
+ * @param u the filesystem
+ * @param sector the first sector
+ * @param nb the number of sectors
+ * @param data the nb*SECTOR_SIZE bytes (IN)
+ * @return 0 on success; <0 on error
+ */
+int journal_write(struct unix_filesystem *u, uint32_t sector, uint32_t nb, const void *data)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(data);
+    struct journal *j = u->journal;
+    if(j==NULL) return sectors_write(u->f,sector,nb,data);
+    int err=0;
+    for(uint32_t k=0; (err==0)&&(k<nb); ++k) {
+        const uint8_t *src = (const uint8_t *)data+(size_t)k*SECTOR_SIZE;
+        int i=journal_find(j,sector+k);
+        if(i>=0) {
+            ++j->stats.absorbed;
+        } else {
+            // pendant le commit, les bitmaps prennent la place qui leur est réservée
+            if(!j->committing && (j->nb>=j->capacity)) err=journal_commit(u);
+            if((err==0) && (j->nb>=JOURNAL_ENTRIES)) err=ERR_IO;
+            if(err<0) break;
+            i=j->nb++;
+            j->sectors[i]=(uint16_t)(sector+k);
+        }
+        memcpy(j->data[i],src,SECTOR_SIZE);
+    }
+    return err;
+}
+
+/**
+ * @brief free a sector in the free bitmap when the running transaction
+ *        commits (at once without a journal)
+ * @param u the filesystem
+ * @param sector the sector
+ */
+void journal_free(struct unix_filesystem *u, uint32_t sector)
+{
+    if(u==NULL) return;
+    struct journal *j = u->journal;
+    if(j!=NULL && j->nb_freed==j->cap_freed) {
+        int cap = j->cap_freed ? 2*j->cap_freed : 256;
+        uint16_t *bigger = realloc(j->freed,cap*sizeof(uint16_t));
+        // à défaut de mémoire, le secteur est libéré tout de suite
+        if(bigger!=NULL) {
+            j->freed=bigger;
+            j->cap_freed=cap;
+        }
+    }
+    if(j!=NULL && j->nb_freed<j->cap_freed) j->freed[j->nb_freed++]=(uint16_t)sector;
+    else bm_clear(u->fbm,sector);
+}
+
+/**
+ * @brief report that file content was written in place (outside of the
+ *        journal): the next commit syncs it before its record
+ * @param u the filesystem
+ */
+void journal_data(struct unix_filesystem *u)
+{
+    if(u!=NULL && u->journal!=NULL) u->journal->unsynced=1;
+}
+
+/**
+ * @brief start an operation whose writes should be in the same commit: if
+ *        the running transaction has too little room left, it commits first
+ * @param u the filesystem
+ * @return 0 on success; <0 on error
+ */
+int journal_begin(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+    struct journal *j = u->journal;
+    if(j==NULL) return 0;
+    int err=0;
+    if((j->depth==0) && (j->nb>0) && (j->capacity-j->nb<JOURNAL_OP_SECTORS)) err=journal_commit(u);
+    if(err==0) ++j->depth;
+    return err;
+}
+
+/**
+ * @brief end the operation started by journal_begin
+ * @param u the filesystem
+ */
+void journal_end(struct unix_filesystem *u)
+{
+    if(u!=NULL && u->journal!=NULL && u->journal->depth>0) --u->journal->depth;
+}
+
+static int journal_sector_cmp(const void *a, const void *b)
+{
+    const uint16_t *x = a;
+    const uint16_t *y = b;
+    return (*x>*y) - (*x<*y);
+}
+
+/**
+ * @brief write the logged sectors in place, one I/O per run of consecutive sectors
+ * @return 0 on success; <0 on error
+ */
+static int journal_checkpoint(struct unix_filesystem *u)
+{
+    struct journal *j = u->journal;
+    // chaque entrée : le secteur, puis sa position dans la transaction
+    uint16_t order[JOURNAL_ENTRIES][2];
+    for(int i=0; i<j->nb; ++i) {
+        order[i][0]=j->sectors[i];
+        order[i][1]=(uint16_t)i;
+    }
+    qsort(order,j->nb,sizeof(order[0]),journal_sector_cmp);
+    struct iovec iov[JOURNAL_ENTRIES];
+    int err=0;
+    for(int k=0; (err==0)&&(k<j->nb); ) {
+        int last=k;
+        do {
+            iov[last-k].iov_base=j->data[order[last][1]];
+            iov[last-k].iov_len=SECTOR_SIZE;
+            ++last;
+        } while((last<j->nb) && (order[last][0]==order[last-1][0]+1));
+        err=sectors_writev(u->f,order[k][0],iov,last-k);
+        k=last;
+    }
+    return err;
+}
+
+/**
+ * @brief make all the writes so far durable: the running transaction (with
+ *        the bitmaps) is logged in one commit record and synced with one
+ *        fsync, then written in place. Without a journal, the disk is synced
+ * @param u the filesystem
+ * @return 0 on success; <0 on error
+ */
+int journal_commit(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+    struct journal *j = u->journal;
+    if(j==NULL) return journal_sync(u);
+    if(j->committing) return 0;
+    j->committing=1;
+
+    // les secteurs libérés rejoignent la bitmap, journalisée avec le reste
+    for(int k=0; k<j->nb_freed; ++k) bm_clear(u->fbm,j->freed[k]);
+    int err=mountv6_store_bitmaps(u);
+
+    struct journal_block block;
+    memset(&block,0,sizeof(block));
+    block.magic=JOURNAL_MAGIC;
+    block.kind=JOURNAL_COMMIT;
+    block.nb=(uint16_t)j->nb;
+    memcpy(block.sectors,j->sectors,j->nb*sizeof(uint16_t));
+    // un secteur journalisé puis libéré ne doit plus être rejoué : à défaut
+    // de place pour le révoquer, le journal repart de zéro après ce commit
+    int reset=0;
+    for(int k=0; k<j->nb_freed; ++k) {
+        uint16_t s=j->freed[k];
+        if(!((j->live[s/8]>>(s%8))&1) && (journal_find(j,s)<0)) continue;
+        if(block.nb+block.revoked<JOURNAL_ENTRIES) block.sectors[block.nb+block.revoked++]=s;
+        else reset=1;
+    }
+    j->nb_freed=0;
+    if((err<0) || (block.nb+block.revoked==0)) {
+        j->committing=0;
+        if(err<0) return err;
+        j->unsynced=0;
+        return journal_sync(u);
+    }
+
+    // le contenu des fichiers désigné par l'enregistrement est sur le disque avant lui
+    if(j->unsynced) {
+        ++j->stats.fsyncs;
+        if(fdatasync(fileno(u->f))!=0) err=ERR_IO;
+        else j->unsynced=0;
+    }
+
+    // l'enregistrement ne tient plus : les précédents doivent être en place pour être écrasés
+    if((err==0) && (j->head+1+block.nb>j->size)) {
+        if((err=journal_sync(u))==0) err=journal_write_super(u,j->seq);
+    }
+    block.seq=j->seq;
+    block.checksum=journal_checksum(&block,(const uint8_t *)j->data);
+    struct iovec iov[2] = {
+        { &block, SECTOR_SIZE },
+        { j->data, (size_t)block.nb*SECTOR_SIZE }
+    };
+    if(err==0) err=sectors_writev(u->f,j->start+j->head,iov,(block.nb>0) ? 2 : 1);
+    if(err==0) err=journal_sync(u);
+    if(err==0) err=journal_checkpoint(u);
+    if(err==0) {
+        for(int i=0; i<j->nb; ++i) j->live[j->sectors[i]/8] |= (uint8_t)(1<<(j->sectors[i]%8));
+        j->head+=1+block.nb;
+        ++j->seq;
+        ++j->stats.commits;
+        j->stats.logged+=block.nb;
+        j->stats.revoked+=block.revoked;
+        j->nb=0;
+    }
+    if((err==0) && reset) {
+        if((err=journal_sync(u))==0 && (err=journal_write_super(u,j->seq))==0) err=journal_sync(u);
+    }
+    j->committing=0;
+    return err;
+}
+
+/**
+ * @brief the number of sectors of the running transaction
+ * @param u the filesystem
+ */
+int journal_pending(const struct unix_filesystem *u)
+{
+    return (u!=NULL && u->journal!=NULL) ? u->journal->nb : 0;
+}
+
+/**
+ * @brief the number of sectors freed by the running transaction, which go
+ *        back to the free bitmap at its commit
+ * @param u the filesystem
+ */
+int journal_freed(const struct unix_filesystem *u)
+{
+    return (u!=NULL && u->journal!=NULL) ? u->journal->nb_freed : 0;
+}
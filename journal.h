@@ -0,0 +1,184 @@
+#pragma once
+
+/**
+ * @file journal.h
+ * @brief write-ahead journal of the metadata sectors, with group commit
+ *
+ * The metadata writes (inode sectors, indirect sectors, directory content,
+ * bitmaps) go into a transaction kept in memory, which the reads see. A
+ * commit logs all the sectors of the transaction in the journal region of
+ * the disk, after a single commit record, with one fsync; they are then
+ * written in place. At mount, the records of the region which were
+ * committed are replayed, so that the image is the one of the last commit.
+ *
+ * The content of regular files is written in place, outside of the
+ * journal, and reported with journal_data: the commit then syncs it before
+ * writing its record, so that a replayed block map never designates
+ * sectors whose new content did not reach the disk (ordered mode).
+ *
+ * A sector freed by a transaction is only given back to the free bitmap by
+ * its commit, and, if it was logged since the last reset of the journal,
+ * the commit record revokes it: a replay never overwrites its next use.
+ *
+ * The transaction is protected by the lock of the filesystem: journal_read
+ * under the shared lock at least, the others under the exclusive one.
+ */
+
+#include <stdint.h>
+#include "mount.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* size of the journal region created by mountv6_mkfs (at most 1/16 of the disk) */
+#define JOURNAL_SECTORS 1024
+
+/* below this size, mountv6_mkfs creates no journal */
+#define JOURNAL_MIN_SECTORS 64
+
+/* sector numbers (logged or revoked) in a commit record */
+#define JOURNAL_ENTRIES ((SECTOR_SIZE-18)/2)
+
+/* a running operation which starts with fewer than this many free entries commits first */
+#define JOURNAL_OP_SECTORS 32
+
+#define JOURNAL_MAGIC 0x4c4e524aU    /* "JRNL" */
+
+enum journal_kind {
+    JOURNAL_SUPER = 1,   /* first sector of the region: sequence number of the first record */
+    JOURNAL_COMMIT       /* commit record, followed by the nb sectors it logs */
+};
+
+/* first sector of the region, and commit records (one sector) */
+struct journal_block {
+    uint32_t magic;
+    uint32_t seq;        /* sequence number of the record (of the first one for JOURNAL_SUPER) */
+    uint32_t checksum;   /* of the record (with 0 here) and of the logged sectors */
+    uint16_t kind;       /* enum journal_kind */
+    uint16_t nb;         /* number of logged sectors */
+    uint16_t revoked;    /* number of revoked sectors, listed after the logged ones */
+    uint16_t sectors[JOURNAL_ENTRIES];
+};
+
+struct journal_stats {
+    uint64_t commits;    /* commit records written */
+    uint64_t logged;     /* sectors logged by them */
+    uint64_t absorbed;   /* writes to a sector already in the running transaction */
+    uint64_t revoked;    /* freed sectors revoked */
+    uint64_t fsyncs;
+    uint64_t replayed;   /* sectors replayed at mount */
+};
+
+struct journal {
+    uint16_t start;                 /* region of the journal */
+    uint16_t size;
+    uint16_t head;                  /* where the next commit record goes */
+    uint32_t seq;                   /* sequence number of the next commit record */
+    int capacity;                   /* logged sectors per record, room for the bitmaps left aside */
+    int depth;                      /* nesting of journal_begin */
+    int committing;
+    int nb;                         /* sectors of the running transaction */
+    int unsynced;                   /* file content written in place since the last commit */
+    uint16_t sectors[JOURNAL_ENTRIES];
+    uint8_t (*data)[SECTOR_SIZE];   /* their content */
+    uint16_t *freed;                /* sectors freed by the running transaction */
+    int nb_freed;
+    int cap_freed;
+    uint8_t *live;                  /* one bit per sector logged since the first record of the region */
+    struct journal_stats stats;
+};
+
+/**
+ * @brief open the journal of a filesystem whose superblock was read, and
+ *        replay its committed records; u->journal stays NULL if the disk has none
+ * @param u the filesystem, before its bitmaps are built
+ * @return 0 on success; <0 on error
+ */
+int journal_open(struct unix_filesystem *u);
+
+/**
+ * @brief commit the running transaction, then forget the records of the
+ *        region (they are all in place and synced) and free the journal
+ * @param u the filesystem
+ * @return 0 on success; <0 on error
+ */
+int journal_close(struct unix_filesystem *u);
+
+/**
+ * @brief read nb consecutive sectors, as the running transaction left them
+ * @param u the filesystem
+ * @param sector the first sector
+ * @param nb the number of sectors
+ * @param data room for nb*SECTOR_SIZE bytes (OUT)
+ * @return 0 on success; <0 on error
+ */
+int journal_read(const struct unix_filesystem *u, uint32_t sector, uint32_t nb, void *data);
+
+/**
+ * @brief write nb consecutive metadata sectors into the running transaction
+ *        (directly to the disk without a journal). A full transaction is
+ *        committed first
+ * @param u the filesystem
+ * @param sector the first sector
+ * @param nb the number of sectors
+ * @param data the nb*SECTOR_SIZE bytes (IN)
+ * @return 0 on success; <0 on error
+ */
+int journal_write(struct unix_filesystem *u, uint32_t sector, uint32_t nb, const void *data);
+
+/**
+ * @brief free a sector in the free bitmap when the running transaction
+ *        commits (at once without a journal)
+ * @param u the filesystem
+ * @param sector the sector
+ */
+void journal_free(struct unix_filesystem *u, uint32_t sector);
+
+/**
+ * @brief report that file content was written in place (outside of the
+ *        journal): the next commit syncs it before its record
+ * @param u the filesystem
+ */
+void journal_data(struct unix_filesystem *u);
+
+/**
+ * @brief start an operation whose writes should be in the same commit: if
+ *        the running transaction has too little room left, it commits first
+ * @param u the filesystem
+ * @return 0 on success; <0 on error
+ */
+int journal_begin(struct unix_filesystem *u);
+
+/**
+ * @brief end the operation started by journal_begin
+ * @param u the filesystem
+ */
+void journal_end(struct unix_filesystem *u);
+
+/**
+ * @brief make all the writes so far durable: the file content written in
+ *        place is synced, then the running transaction (with the bitmaps) is
+ *        logged in one commit record and synced with one fsync, then written
+ *        in place. Without a journal, the disk is synced
+ * @param u the filesystem
+ * @return 0 on success; <0 on error
+ */
+int journal_commit(struct unix_filesystem *u);
+
+/**
+ * @brief the number of sectors of the running transaction
+ * @param u the filesystem
+ */
+int journal_pending(const struct unix_filesystem *u);
+
+/**
+ * @brief the number of sectors freed by the running transaction, which go
+ *        back to the free bitmap at its commit
+ * @param u the filesystem
+ */
+int journal_freed(const struct unix_filesystem *u);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,97 @@
+/**
+ * @file latency.c
+ * @brief latency histograms with a bounded relative error (HDR-style)
+ */
+
+#include <time.h>
+#include "latency.h"
+
+/**
+ * @brief the bucket of a value
+ */
+static int latency_bucket(uint64_t v)
+{
+    if (v < LATENCY_SUB_BUCKETS) return (int) v;
+    int e = 63 - __builtin_clzll(v);
+    /* the LATENCY_SUB_BITS bits after the leading one select the sub-bucket */
+    return (e - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS
+           + (int) ((v >> (e - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/**
+ * @brief the highest value of a bucket
+ */
+static uint64_t latency_bucket_high(int b)
+{
+    if (b < LATENCY_SUB_BUCKETS) return (uint64_t) b;
+    int e = b / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+    uint64_t low = ((uint64_t) (LATENCY_SUB_BUCKETS + b % LATENCY_SUB_BUCKETS)) << (e - LATENCY_SUB_BITS);
+    return low + ((UINT64_C(1) << (e - LATENCY_SUB_BITS)) - 1);
+}
+
+uint64_t latency_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000u + (uint64_t) t.tv_nsec;
+}
+
+void latency_record(struct latency_hist *h, uint64_t ns)
+{
+    uint64_t *bucket = &h->buckets[latency_bucket(ns)];
+    /* single writer: plain increments, stored atomically for the readers */
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + ns, __ATOMIC_RELAXED);
+    if (ns > h->max) __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+void latency_merge(struct latency_hist *dst, const struct latency_hist *src)
+{
+    uint64_t count = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+        uint64_t n = __atomic_load_n(&src->buckets[b], __ATOMIC_RELAXED);
+        dst->buckets[b] += n;
+        count += n;
+    }
+    /* the count is that of the buckets read, even if src moved meanwhile */
+    dst->count += count;
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max) dst->max = max;
+}
+
+uint64_t latency_percentile(const struct latency_hist *h, double p)
+{
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t) (p * h->count + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t high = latency_bucket_high(b);
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+void latency_print(FILE *out, const char *name, const struct latency_hist *h)
+{
+    fprintf(out, "%-10s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+            (unsigned long long) h->count, h->count ? h->sum / 1e3 / h->count : 0.0,
+            latency_percentile(h, 0.50) / 1e3, latency_percentile(h, 0.90) / 1e3,
+            latency_percentile(h, 0.99) / 1e3, latency_percentile(h, 0.999) / 1e3,
+            h->max / 1e3);
+}
+
+void latency_print_json(FILE *out, const char *name, const struct latency_hist *h)
+{
+    fprintf(out, "\"%s\": {\"count\": %llu, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+            "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}", name,
+            (unsigned long long) h->count, h->count ? h->sum / 1e3 / h->count : 0.0,
+            latency_percentile(h, 0.50) / 1e3, latency_percentile(h, 0.90) / 1e3,
+            latency_percentile(h, 0.99) / 1e3, latency_percentile(h, 0.999) / 1e3,
+            h->max / 1e3);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+/**
+ * @file latency.h
+ * @brief latency histograms with a bounded relative error (HDR-style)
+ *
+ * Values (in nanoseconds) below 2^LATENCY_SUB_BITS have their own bucket;
+ * above, each power of two is split in 2^LATENCY_SUB_BITS buckets, so that a
+ * percentile is given within 1/2^LATENCY_SUB_BITS of the true value with a
+ * fixed amount of memory.
+ *
+ * A histogram has a single writer: latency_record updates it without any
+ * lock nor read-modify-write, and other threads may read it at any time
+ * (each field is read atomically, the whole histogram is not a snapshot).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+struct latency_hist {
+    uint64_t count;
+    uint64_t sum;       /* sum of the values, for the mean */
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+};
+
+/**
+ * @brief the current time in nanoseconds, from a monotonic clock
+ */
+uint64_t latency_now(void);
+
+/**
+ * @brief adds a value to a histogram; only one thread may call it on a given histogram
+ * @param h the histogram
+ * @param ns the value
+ */
+void latency_record(struct latency_hist *h, uint64_t ns);
+
+/**
+ * @brief adds all the values of src to dst
+ * @param dst the histogram written (IN-OUT)
+ * @param src the histogram read, which may be written meanwhile by its thread
+ */
+void latency_merge(struct latency_hist *dst, const struct latency_hist *src);
+
+/**
+ * @brief the value below which a fraction p of the values lie
+ * @param h the histogram
+ * @param p the fraction, between 0 and 1
+ * @return the highest value of the bucket of this percentile (at most the maximum); 0 if empty
+ */
+uint64_t latency_percentile(const struct latency_hist *h, double p);
+
+/**
+ * @brief prints one line: count, mean, p50, p90, p99, p99.9 and max in microseconds
+ * @param out the stream
+ * @param name the name of the line
+ * @param h the histogram
+ */
+void latency_print(FILE *out, const char *name, const struct latency_hist *h);
+
+/**
+ * @brief prints the same values as latency_print, as a JSON object member
+ * @param out the stream
+ * @param name the name of the member
+ * @param h the histogram
+ */
+void latency_print_json(FILE *out, const char *name, const struct latency_hist *h);
+
+#ifdef __cplusplus
+}
+#endif
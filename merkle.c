@@ -0,0 +1,404 @@
+/**
+ * @file merkle.c
+ * @brief per-file Merkle trees over the sectors of files, kept in a sidecar
+ *        file next to the disk image
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include "merkle.h"
+#include "unixv6fs.h"
+#include "error.h"
+#include "sector.h"
+#include "inode.h"
+#include "filev6.h"
+
+#define MERKLE_MAGIC "UV6MRKL2"
+#define MERKLE_MAGIC_LEN 8
+#define MERKLE_CHUNK_SECTORS 128
+
+/* on-disk header of the tree of one file in the sidecar, followed by the
+ * block map (nb_leaves uint16_t) and the leaves (nb_leaves digests) */
+struct merkle_record {
+    uint16_t inr;
+    uint16_t nb_leaves;
+    int32_t size;
+    uint32_t version;
+    uint32_t write_seq;
+    uint64_t mount_id;
+};
+
+/**
+ * @brief number of bytes of the file held by its k-th sector
+ */
+static int merkle_leaf_len(int32_t size, int k)
+{
+    int32_t rest = size - k * SECTOR_SIZE;
+    return (rest < SECTOR_SIZE) ? rest : SECTOR_SIZE;
+}
+
+/**
+ * @brief allocate an empty tree for nb_leaves sectors
+ * @return the tree or NULL on failure
+ */
+static struct merkle_tree *merkle_tree_alloc(uint16_t inr, int32_t size, int nb_leaves)
+{
+    struct merkle_tree *t = calloc(1, sizeof(struct merkle_tree));
+    if (t == NULL) return NULL;
+    t->inr = inr;
+    t->size = size;
+    t->nb_leaves = nb_leaves;
+    t->sectors = calloc(nb_leaves ? nb_leaves : 1, sizeof(uint16_t));
+    t->leaves = calloc(nb_leaves ? nb_leaves : 1, SHA256_DIGEST_LENGTH);
+    if ((t->sectors == NULL) || (t->leaves == NULL)) {
+        free(t->sectors);
+        free(t->leaves);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+/**
+ * @brief free a tree
+ */
+static void merkle_tree_free(struct merkle_tree *t)
+{
+    if (t != NULL) {
+        free(t->sectors);
+        free(t->leaves);
+        free(t);
+    }
+}
+
+/**
+ * @brief number of groups of leaves of a tree
+ */
+static int merkle_nb_groups(const struct merkle_tree *t)
+{
+    return (t->nb_leaves + MERKLE_GROUP_LEAVES - 1) / MERKLE_GROUP_LEAVES;
+}
+
+/**
+ * @brief hash the leaves of group g into its digest
+ * @return 0 on success; <0 on error
+ */
+static int merkle_hash_group(struct merkle_tree *t, int g)
+{
+    int first = g * MERKLE_GROUP_LEAVES;
+    int last = (first + MERKLE_GROUP_LEAVES < t->nb_leaves) ? first + MERKLE_GROUP_LEAVES : t->nb_leaves;
+    return EVP_Digest(t->leaves[first], (size_t) (last - first) * SHA256_DIGEST_LENGTH,
+                      t->groups[g], NULL, EVP_sha256(), NULL) ? 0 : ERR_IO;
+}
+
+/**
+ * @brief hash the size and the groups into the root digest
+ * @return 0 on success; <0 on error
+ */
+static int merkle_hash_root(struct merkle_tree *t)
+{
+    unsigned char buf[sizeof(int32_t) + MERKLE_MAX_GROUPS * SHA256_DIGEST_LENGTH];
+    int nb_groups = merkle_nb_groups(t);
+    memcpy(buf, &t->size, sizeof(int32_t));
+    memcpy(buf + sizeof(int32_t), t->groups, nb_groups * SHA256_DIGEST_LENGTH);
+    return EVP_Digest(buf, sizeof(int32_t) + nb_groups * SHA256_DIGEST_LENGTH,
+                      t->root, NULL, EVP_sha256(), NULL) ? 0 : ERR_IO;
+}
+
+/**
+ * @brief hash the leaves flagged in need, one read per run of contiguous sectors
+ * @return the number of leaves hashed; <0 on error
+ */
+static int merkle_hash_leaves(const struct unix_filesystem *u, struct merkle_tree *t, const uint8_t *need)
+{
+    uint8_t *buf = malloc(MERKLE_CHUNK_SECTORS * SECTOR_SIZE);
+    if (buf == NULL) return ERR_NOMEM;
+    int err = 0;
+    int hashed = 0;
+    int first = 0;
+    while ((err == 0) && (first < t->nb_leaves)) {
+        if (!need[first]) {
+            ++first;
+            continue;
+        }
+        int last = first + 1;
+        while ((last < t->nb_leaves) && need[last] && (last - first < MERKLE_CHUNK_SECTORS)
+               && (t->sectors[last] == t->sectors[last - 1] + 1)) ++last;
+        if ((err = SECTOR_TAGGED(SECTOR_TAG_FILE, sectors_read(u->f, t->sectors[first], last - first, buf))) < 0) break;
+        for (int k = first; k < last; ++k) {
+            if (!EVP_Digest(buf + (k - first) * SECTOR_SIZE, merkle_leaf_len(t->size, k),
+                            t->leaves[k], NULL, EVP_sha256(), NULL)) err = ERR_IO;
+        }
+        hashed += last - first;
+        first = last;
+    }
+    free(buf);
+    return (err < 0) ? err : hashed;
+}
+
+/**
+ * @brief whether the k-th leaf of old still holds for a file whose k-th
+ *        sector is sector: same sector, same length, and not written since
+ *        old was built (see merkle.h)
+ */
+static int merkle_leaf_clean(const struct unix_filesystem *u, const struct merkle_tree *old,
+                             const struct merkle_tree *t, int k, uint16_t sector)
+{
+    if ((old == NULL) || (k >= old->nb_leaves) || (old->sectors[k] != sector)
+        || (merkle_leaf_len(old->size, k) != merkle_leaf_len(t->size, k))) return 0;
+    if (old->version == t->version) return 1;
+    /* the file changed: only the same mount knows which sectors it wrote */
+    return (old->mount_id == u->mount_id) && (u->written != NULL) && (sector < u->s.s_fsize)
+           && (u->written[sector] <= old->write_seq);
+}
+
+/**
+ * @brief build the tree of a file, reusing the leaves of old which still
+ *        hold (old may be NULL, see merkle_leaf_clean)
+ * @param tree the new tree (OUT)
+ * @return the number of sectors hashed; <0 on error
+ */
+static int merkle_build(const struct unix_filesystem *u, uint16_t inr, const struct merkle_tree *old,
+                        struct merkle_tree **tree)
+{
+    struct inode ino;
+    int err = 0;
+    if ((err = inode_read(u, inr, &ino)) < 0) return err;
+    uint16_t sectors[MAX_FILE_SECTORS];
+    int nb = filev6_blockmap(u, &ino, sectors);
+    if (nb < 0) return nb;
+
+    struct merkle_tree *t = merkle_tree_alloc(inr, inode_getsize(&ino), nb);
+    if (t == NULL) return ERR_NOMEM;
+    memcpy(t->sectors, sectors, nb * sizeof(uint16_t));
+    t->version = inode_getversion(&ino);
+    t->mount_id = u->mount_id;
+    t->write_seq = u->write_seq;
+
+    uint8_t need[MAX_FILE_SECTORS];
+    uint8_t dirty[MERKLE_MAX_GROUPS];
+    memset(dirty, 0, sizeof(dirty));
+    for (int k = 0; k < nb; ++k) {
+        need[k] = !merkle_leaf_clean(u, old, t, k, sectors[k]);
+        if (need[k]) {
+            dirty[k / MERKLE_GROUP_LEAVES] = 1;
+        } else {
+            memcpy(t->leaves[k], old->leaves[k], SHA256_DIGEST_LENGTH);
+        }
+    }
+    int hashed = merkle_hash_leaves(u, t, need);
+    if (hashed < 0) {
+        merkle_tree_free(t);
+        return hashed;
+    }
+
+    /* a group also changes when it lost or gained leaves */
+    for (int g = 0; (g < merkle_nb_groups(t)) && (err == 0); ++g) {
+        int end = (g + 1) * MERKLE_GROUP_LEAVES;
+        int reuse = (old != NULL) && !dirty[g]
+                    && (((old->nb_leaves < end) ? old->nb_leaves : end) == ((nb < end) ? nb : end));
+        if (reuse) {
+            memcpy(t->groups[g], old->groups[g], SHA256_DIGEST_LENGTH);
+        } else {
+            err = merkle_hash_group(t, g);
+        }
+    }
+    if (err == 0) err = merkle_hash_root(t);
+    if (err < 0) {
+        merkle_tree_free(t);
+        return err;
+    }
+    *tree = t;
+    return hashed;
+}
+
+/**
+ * @brief bring the tree of a file up to date: only the leaves which are new,
+ *        whose sector moved or changed length or was written since are
+ *        hashed again, then only the groups holding them and the root
+ * @param u the mounted filesystem
+ * @param store the trees (IN-OUT)
+ * @param inr the inode of the file
+ * @return the number of sectors hashed; <0 on error
+ */
+int merkle_update(const struct unix_filesystem *u, struct merkle_store *store, uint16_t inr)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(store);
+    if (inr >= store->nb_inodes) return ERR_INODE_OUTOF_RANGE;
+
+    struct merkle_tree *t = NULL;
+    int hashed = merkle_build(u, inr, store->trees[inr], &t);
+    if (hashed < 0) return hashed;
+    merkle_tree_free(store->trees[inr]);
+    store->trees[inr] = t;
+    return hashed;
+}
+
+/**
+ * @brief compare two trees of the same file: the groups are only descended
+ *        into when their digests differ; one line per differing sector is
+ *        written to out
+ * @param a a tree (IN)
+ * @param b another tree (IN)
+ * @param out where to report the differences (may be NULL)
+ * @return the number of differing sectors (0 if the trees are equal)
+ */
+int merkle_diff(const struct merkle_tree *a, const struct merkle_tree *b, FILE *out)
+{
+    if ((a == NULL) || (b == NULL)) return 0;
+    if (!memcmp(a->root, b->root, SHA256_DIGEST_LENGTH)) return 0;
+
+    int nb = (a->nb_leaves > b->nb_leaves) ? a->nb_leaves : b->nb_leaves;
+    int common = (a->nb_leaves < b->nb_leaves) ? a->nb_leaves : b->nb_leaves;
+    int diffs = 0;
+    for (int g = 0; g * MERKLE_GROUP_LEAVES < nb; ++g) {
+        int first = g * MERKLE_GROUP_LEAVES;
+        int last = (first + MERKLE_GROUP_LEAVES < nb) ? first + MERKLE_GROUP_LEAVES : nb;
+        int complete = (last <= common);
+        if (complete && (a->size == b->size) && !memcmp(a->groups[g], b->groups[g], SHA256_DIGEST_LENGTH)) continue;
+        for (int k = first; k < last; ++k) {
+            if ((k < common) && (merkle_leaf_len(a->size, k) == merkle_leaf_len(b->size, k))
+                && !memcmp(a->leaves[k], b->leaves[k], SHA256_DIGEST_LENGTH)) continue;
+            if (out != NULL) fprintf(out, "inode %d: sector %d of the file differs\n", a->inr, k);
+            ++diffs;
+        }
+    }
+    return diffs;
+}
+
+/**
+ * @brief check the content of a file on disk against its stored tree: as in
+ *        merkle_update, only the leaves which may have changed are hashed,
+ *        and only the groups holding them are compared leaf by leaf
+ * @param u the mounted filesystem
+ * @param store the trees (IN)
+ * @param inr the inode of the file
+ * @param out where to report the differences (may be NULL)
+ * @return the number of differing sectors; <0 on error (ERR_BAD_PARAMETER if no tree is stored)
+ */
+int merkle_verify(const struct unix_filesystem *u, const struct merkle_store *store, uint16_t inr, FILE *out)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(store);
+    if (inr >= store->nb_inodes) return ERR_INODE_OUTOF_RANGE;
+    if (store->trees[inr] == NULL) return ERR_BAD_PARAMETER;
+
+    struct merkle_tree *fresh = NULL;
+    int err = merkle_build(u, inr, store->trees[inr], &fresh);
+    if (err < 0) return err;
+    int diffs = merkle_diff(store->trees[inr], fresh, out);
+    merkle_tree_free(fresh);
+    return diffs;
+}
+
+/**
+ * @brief load the sidecar file of a disk image (an absent sidecar gives an empty store)
+ * @param u the mounted filesystem
+ * @param image the file name of the disk image (IN)
+ * @param store the trees of the sidecar (OUT)
+ * @return 0 on success; <0 on error
+ */
+int merkle_store_load(const struct unix_filesystem *u, const char *image, struct merkle_store *store)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(image);
+    M_REQUIRE_NON_NULL(store);
+    memset(store, 0, sizeof(*store));
+    store->nb_inodes = u->s.s_isize * INODES_PER_SECTOR;
+    store->trees = calloc(store->nb_inodes, sizeof(struct merkle_tree *));
+    store->path = malloc(strlen(image) + strlen(MERKLE_SUFFIX) + 1);
+    if ((store->trees == NULL) || (store->path == NULL)) {
+        merkle_store_free(store);
+        return ERR_NOMEM;
+    }
+    strcpy(store->path, image);
+    strcat(store->path, MERKLE_SUFFIX);
+
+    FILE *f = fopen(store->path, "rb");
+    if (f == NULL) return 0;
+    int err = 0;
+    char magic[MERKLE_MAGIC_LEN];
+    if ((fread(magic, 1, MERKLE_MAGIC_LEN, f) != MERKLE_MAGIC_LEN) || memcmp(magic, MERKLE_MAGIC, MERKLE_MAGIC_LEN)) {
+        err = ERR_IO;
+    }
+    struct merkle_record rec;
+    while ((err == 0) && (fread(&rec, sizeof(rec), 1, f) == 1)) {
+        if ((rec.inr >= store->nb_inodes) || (rec.nb_leaves > MAX_FILE_SECTORS)) {
+            err = ERR_IO;
+            break;
+        }
+        struct merkle_tree *t = merkle_tree_alloc(rec.inr, rec.size, rec.nb_leaves);
+        if (t == NULL) {
+            err = ERR_NOMEM;
+            break;
+        }
+        t->version = rec.version;
+        t->mount_id = rec.mount_id;
+        t->write_seq = rec.write_seq;
+        if ((fread(t->sectors, sizeof(uint16_t), rec.nb_leaves, f) != rec.nb_leaves)
+            || (fread(t->leaves, SHA256_DIGEST_LENGTH, rec.nb_leaves, f) != rec.nb_leaves)) {
+            err = ERR_IO;
+        }
+        /* the inner nodes are not stored: they are cheap to recompute */
+        for (int g = 0; (err == 0) && (g < merkle_nb_groups(t)); ++g) {
+            err = merkle_hash_group(t, g);
+        }
+        if (err == 0) err = merkle_hash_root(t);
+        merkle_tree_free(store->trees[rec.inr]);
+        store->trees[rec.inr] = t;
+    }
+    fclose(f);
+    if (err < 0) merkle_store_free(store);
+    return err;
+}
+
+/**
+ * @brief write back the sidecar file (through a temporary file renamed over it)
+ * @param store the trees to save
+ * @return 0 on success; <0 on error
+ */
+int merkle_store_save(const struct merkle_store *store)
+{
+    M_REQUIRE_NON_NULL(store);
+    M_REQUIRE_NON_NULL(store->path);
+    char tmp[strlen(store->path) + 5];
+    strcpy(tmp, store->path);
+    strcat(tmp, ".tmp");
+
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) return ERR_IO;
+    int err = (fwrite(MERKLE_MAGIC, 1, MERKLE_MAGIC_LEN, f) == MERKLE_MAGIC_LEN) ? 0 : ERR_IO;
+    for (int inr = 0; (err == 0) && (inr < store->nb_inodes); ++inr) {
+        const struct merkle_tree *t = store->trees[inr];
+        if (t == NULL) continue;
+        struct merkle_record rec = { t->inr, (uint16_t) t->nb_leaves, t->size, t->version, t->write_seq, t->mount_id };
+        if ((fwrite(&rec, sizeof(rec), 1, f) != 1)
+            || (fwrite(t->sectors, sizeof(uint16_t), t->nb_leaves, f) != (size_t) t->nb_leaves)
+            || (fwrite(t->leaves, SHA256_DIGEST_LENGTH, t->nb_leaves, f) != (size_t) t->nb_leaves)) {
+            err = ERR_IO;
+        }
+    }
+    if ((fclose(f) != 0) && (err == 0)) err = ERR_IO;
+    if ((err == 0) && (rename(tmp, store->path) != 0)) err = ERR_IO;
+    if (err < 0) remove(tmp);
+    return err;
+}
+
+/**
+ * @brief free the memory of a store
+ * @param store the store
+ */
+void merkle_store_free(struct merkle_store *store)
+{
+    if (store != NULL) {
+        for (int inr = 0; (store->trees != NULL) && (inr < store->nb_inodes); ++inr) {
+            merkle_tree_free(store->trees[inr]);
+        }
+        free(store->trees);
+        free(store->path);
+        memset(store, 0, sizeof(*store));
+    }
+}
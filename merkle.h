@@ -0,0 +1,110 @@
+#pragma once
+
+/**
+ * @file merkle.h
+ * @brief per-file Merkle trees over the sectors of files, kept in a sidecar
+ *        file next to the disk image
+ *
+ * The leaves are the SHA-256 of each sector of a file (only the bytes which
+ * belong to the file); they are grouped by ADDRESSES_PER_SECTOR, i.e. by
+ * indirect sector; the root hashes the size of the file and the groups.
+ *
+ * A tree keeps the version of the file it was built on (see
+ * inode_getversion), and the mount and its count of writes at that time: a
+ * leaf is read again when its sector moved or changed length or, if the file
+ * changed since, when its sector was written by the same mount after the tree
+ * was built (see filev6); a file changed by another mount is read entirely.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+#include "mount.h"
+#include "filev6.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MERKLE_SUFFIX ".merkle"
+#define MERKLE_GROUP_LEAVES ADDRESSES_PER_SECTOR
+#define MERKLE_MAX_GROUPS (MAX_FILE_SECTORS / MERKLE_GROUP_LEAVES)
+
+struct merkle_tree {
+    uint16_t inr;                                              /* the inode of the file */
+    int32_t size;                                              /* the size of the file when hashed */
+    uint32_t version;                                          /* the version of the file when hashed */
+    uint64_t mount_id;                                         /* the mount which hashed it */
+    uint32_t write_seq;                                        /* the write_seq of that mount then */
+    int nb_leaves;                                             /* one leaf per sector of the file */
+    uint16_t *sectors;                                         /* the block map the leaves were computed on */
+    unsigned char (*leaves)[SHA256_DIGEST_LENGTH];
+    unsigned char groups[MERKLE_MAX_GROUPS][SHA256_DIGEST_LENGTH];
+    unsigned char root[SHA256_DIGEST_LENGTH];
+};
+
+struct merkle_store {
+    char *path;                  /* path of the sidecar file */
+    int nb_inodes;
+    struct merkle_tree **trees;  /* one (possibly NULL) tree per inode */
+};
+
+/**
+ * @brief load the sidecar file of a disk image (an absent sidecar gives an empty store)
+ * @param u the mounted filesystem
+ * @param image the file name of the disk image (IN)
+ * @param store the trees of the sidecar (OUT)
+ * @return 0 on success; <0 on error
+ */
+int merkle_store_load(const struct unix_filesystem *u, const char *image, struct merkle_store *store);
+
+/**
+ * @brief write back the sidecar file
+ * @param store the trees to save
+ * @return 0 on success; <0 on error
+ */
+int merkle_store_save(const struct merkle_store *store);
+
+/**
+ * @brief free the memory of a store
+ * @param store the store
+ */
+void merkle_store_free(struct merkle_store *store);
+
+/**
+ * @brief bring the tree of a file up to date: only the leaves which are new,
+ *        whose sector moved or changed length or was written since are
+ *        hashed again, then only the groups holding them and the root
+ * @param u the mounted filesystem
+ * @param store the trees (IN-OUT)
+ * @param inr the inode of the file
+ * @return the number of sectors hashed; <0 on error
+ */
+int merkle_update(const struct unix_filesystem *u, struct merkle_store *store, uint16_t inr);
+
+/**
+ * @brief compare two trees of the same file: the groups are only descended
+ *        into when their digests differ; one line per differing sector is
+ *        written to out
+ * @param a a tree (IN)
+ * @param b another tree (IN)
+ * @param out where to report the differences (may be NULL)
+ * @return the number of differing sectors (0 if the trees are equal)
+ */
+int merkle_diff(const struct merkle_tree *a, const struct merkle_tree *b, FILE *out);
+
+/**
+ * @brief check the content of a file on disk against its stored tree: as in
+ *        merkle_update, only the leaves which may have changed are hashed,
+ *        and only the groups holding them are compared leaf by leaf
+ * @param u the mounted filesystem
+ * @param store the trees (IN)
+ * @param inr the inode of the file
+ * @param out where to report the differences (may be NULL)
+ * @return the number of differing sectors; <0 on error (ERR_BAD_PARAMETER if no tree is stored)
+ */
+int merkle_verify(const struct unix_filesystem *u, const struct merkle_store *store, uint16_t inr, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
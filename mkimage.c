@@ -0,0 +1,293 @@
+/**
+ * @file mkimage.c
+ * @brief generates a synthetic image with mountv6_mkfs and the write path:
+ *        a directory tree, files of sizes drawn from a distribution and an
+ *        adjustable fragmentation, all from a seed
+ *
+ * ./mkimage [-b blocks] [-i inodes] [-n files] [-f fan-out] [-d depth]
+ *           [-s size distribution] [-F fragmentation] [-S seed] <image>
+ *
+ *  -s fixed:<bytes> | uniform:<min>:<max> | exp:<mean> | pareto:<min>:<alpha>
+ *     (sizes are capped to the largest v6 file)
+ *  -F between 0 (each file written in one go, contiguous) and 1 (each
+ *     sector of a file goes after a sector of another random file)
+ *  -d 0 keeps the root as the only directory: -n 0 alone still creates the
+ *     tree, -n 0 -d 0 gives an empty image
+ *
+ * The same arguments always give the same image. The generation stops when
+ * the inodes or the sectors run out; what was written is kept.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+#include "unixv6fs.h"
+#include "mount.h"
+#include "error.h"
+#include "inode.h"
+#include "filev6.h"
+#include "direntv6.h"
+
+enum size_law { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP, SIZE_PARETO };
+
+struct gen_params {
+    uint16_t blocks;
+    uint16_t inodes;
+    int files;
+    int fanout;
+    int depth;
+    enum size_law law;
+    double a;           /* fixed size, uniform min, exp mean or pareto min */
+    double b;           /* uniform max or pareto alpha */
+    double frag;
+    uint64_t seed;
+};
+
+/* a file being written */
+struct gen_file {
+    struct filev6 fv6;
+    int32_t remaining;
+};
+
+struct gen_state {
+    struct unix_filesystem u;
+    uint64_t rng;
+    char (*dirs)[MAXPATHLEN_UV6 + 1];   /* paths of the directories, the root first */
+    int nb_dirs;
+    struct gen_file *files;
+    int nb_files;
+    uint64_t bytes;
+};
+
+/**
+ * @brief a deterministic pseudo-random number of 31 bits
+ */
+static uint32_t gen_rand(struct gen_state *st)
+{
+    st->rng = st->rng * 6364136223846793005u + 1442695040888963407u;
+    return (uint32_t) (st->rng >> 33);
+}
+
+/**
+ * @brief a deterministic pseudo-random number in ]0, 1[
+ */
+static double gen_uniform(struct gen_state *st)
+{
+    return (gen_rand(st) + 0.5) / 2147483648.0;
+}
+
+/**
+ * @brief draws a file size from the distribution of the parameters
+ */
+static int32_t gen_size(struct gen_state *st, const struct gen_params *p)
+{
+    double size = 0;
+    switch (p->law) {
+    case SIZE_FIXED:
+        size = p->a;
+        break;
+    case SIZE_UNIFORM:
+        size = p->a + gen_uniform(st) * (p->b - p->a);
+        break;
+    case SIZE_EXP:
+        size = -p->a * log(gen_uniform(st));
+        break;
+    case SIZE_PARETO:
+        size = p->a / pow(gen_uniform(st), 1.0 / p->b);
+        break;
+    }
+    if (size < 0) size = 0;
+    if (size > MAX_SIZE_FILE) size = MAX_SIZE_FILE;
+    return (int32_t) size;
+}
+
+/**
+ * @brief creates the directories, breadth first: each directory above depth gets fanout children
+ * @return 0 on success; <0 on error
+ */
+static int gen_tree(struct gen_state *st, const struct gen_params *p)
+{
+    int max_dirs = 1, level_dirs = 1;
+    for (int l = 0; l < p->depth && max_dirs < p->inodes; ++l) {
+        level_dirs *= p->fanout;
+        max_dirs += level_dirs;
+    }
+    if (max_dirs > p->inodes) max_dirs = p->inodes;
+    st->dirs = calloc(max_dirs, sizeof(*st->dirs));
+    if (st->dirs == NULL) return ERR_NOMEM;
+    strcpy(st->dirs[0], "");
+    st->nb_dirs = 1;
+    int level_start = 0, level_end = 1;
+    for (int l = 0; l < p->depth; ++l) {
+        for (int parent = level_start; parent < level_end; ++parent) {
+            for (int k = 0; (k < p->fanout) && (st->nb_dirs < max_dirs); ++k) {
+                char *path = st->dirs[st->nb_dirs];
+                if (snprintf(path, MAXPATHLEN_UV6 + 1, "%s/d%d", st->dirs[parent], k) > MAXPATHLEN_UV6) {
+                    return ERR_FILENAME_TOO_LONG;
+                }
+                int err = direntv6_create(&st->u, path, IFDIR | IALLOC);
+                if (err < 0) return err;
+                ++st->nb_dirs;
+            }
+        }
+        level_start = level_end;
+        level_end = st->nb_dirs;
+    }
+    return 0;
+}
+
+/**
+ * @brief creates the files, empty, each in a random directory, and draws their sizes
+ * @return 0 on success; <0 on error
+ */
+static int gen_create_files(struct gen_state *st, const struct gen_params *p)
+{
+    st->files = calloc(p->files > 0 ? p->files : 1, sizeof(struct gen_file));
+    if (st->files == NULL) return ERR_NOMEM;
+    char path[MAXPATHLEN_UV6 + 1];
+    for (int k = 0; k < p->files; ++k) {
+        int dir = gen_rand(st) % st->nb_dirs;
+        if (snprintf(path, sizeof(path), "%s/f%d", st->dirs[dir], k) > MAXPATHLEN_UV6) return ERR_FILENAME_TOO_LONG;
+        int inr = direntv6_create(&st->u, path, IALLOC);
+        if (inr < 0) return inr;
+        int err = filev6_open(&st->u, (uint16_t) inr, &st->files[k].fv6);
+        if (err < 0) return err;
+        st->files[k].remaining = gen_size(st, p);
+        ++st->nb_files;
+    }
+    return 0;
+}
+
+/**
+ * @brief writes the content of the files: with probability frag, the next
+ * sector goes to another random file, which interleaves their sectors
+ * @return 0 on success; <0 on error
+ */
+static int gen_write_files(struct gen_state *st, const struct gen_params *p)
+{
+    uint8_t chunk[SECTOR_SIZE];
+    uint8_t *whole = malloc(MAX_SIZE_FILE);
+    if (whole == NULL) return ERR_NOMEM;
+    /* the files drawn empty have nothing to write */
+    int pending = 0;
+    for (int k = 0; k < st->nb_files; ++k) pending += (st->files[k].remaining > 0);
+    int cur = 0;
+    int err = 0;
+    while (pending > 0 && err >= 0) {
+        if (p->frag > 0 && gen_uniform(st) < p->frag) cur = gen_rand(st) % st->nb_files;
+        while (st->files[cur].remaining == 0) cur = (cur + 1) % st->nb_files;
+        struct gen_file *f = &st->files[cur];
+        /* without fragmentation, a file is written in one go */
+        int32_t len = (p->frag > 0 && f->remaining > SECTOR_SIZE) ? SECTOR_SIZE : f->remaining;
+        uint8_t *data = (len > SECTOR_SIZE) ? whole : chunk;
+        for (int32_t i = 0; i < len; ++i) data[i] = (uint8_t) gen_rand(st);
+        err = filev6_writebytes(&st->u, &f->fv6, data, len);
+        if (err >= 0) {
+            f->remaining -= len;
+            st->bytes += len;
+            if (f->remaining == 0) --pending;
+        }
+    }
+    free(whole);
+    return (err < 0) ? err : 0;
+}
+
+/**
+ * @brief the mean number of extents (runs of contiguous sectors) per non-empty file
+ */
+static double gen_extents(struct gen_state *st)
+{
+    static uint16_t sectors[MAX_FILE_SECTORS];
+    uint64_t extents = 0, nonempty = 0;
+    for (int k = 0; k < st->nb_files; ++k) {
+        struct inode ino;
+        if (inode_read(&st->u, st->files[k].fv6.i_number, &ino) < 0) continue;
+        int nb = filev6_blockmap(&st->u, &ino, sectors);
+        if (nb <= 0) continue;
+        ++nonempty;
+        ++extents;
+        for (int i = 1; i < nb; ++i) {
+            if (sectors[i] != sectors[i - 1] + 1) ++extents;
+        }
+    }
+    return nonempty ? (double) extents / nonempty : 0.0;
+}
+
+/**
+ * @brief parses the size distribution, e.g. "uniform:1000:20000"
+ * @return 0 on success; <0 on error
+ */
+static int parse_law(const char *s, struct gen_params *p)
+{
+    if (sscanf(s, "fixed:%lf", &p->a) == 1) p->law = SIZE_FIXED;
+    else if (sscanf(s, "uniform:%lf:%lf", &p->a, &p->b) == 2 && p->b >= p->a) p->law = SIZE_UNIFORM;
+    else if (sscanf(s, "exp:%lf", &p->a) == 1) p->law = SIZE_EXP;
+    else if (sscanf(s, "pareto:%lf:%lf", &p->a, &p->b) == 2 && p->b > 0) p->law = SIZE_PARETO;
+    else return ERR_BAD_PARAMETER;
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-b blocks] [-i inodes] [-n files] [-f fan-out] [-d depth]\n"
+            "          [-s fixed:<n>|uniform:<min>:<max>|exp:<mean>|pareto:<min>:<alpha>]\n"
+            "          [-F fragmentation 0..1] [-S seed] <image>\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct gen_params p = { 65535, 4096, 1000, 8, 2, SIZE_EXP, 8192, 0, 0.0, 1 };
+    int opt;
+    while ((opt = getopt(argc, argv, "b:i:n:f:d:s:F:S:")) != -1) {
+        switch (opt) {
+        case 'b': p.blocks = (uint16_t) atoi(optarg); break;
+        case 'i': p.inodes = (uint16_t) atoi(optarg); break;
+        case 'n': p.files = atoi(optarg); break;
+        case 'f': p.fanout = atoi(optarg); break;
+        case 'd': p.depth = atoi(optarg); break;
+        case 's':
+            if (parse_law(optarg, &p) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'F': p.frag = atof(optarg); break;
+        case 'S': p.seed = strtoull(optarg, NULL, 10); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || p.fanout < 1 || p.depth < 0 || p.files < 0 || p.frag < 0 || p.frag > 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    static struct gen_state st;
+    st.rng = p.seed;
+    int err = mountv6_mkfs(argv[optind], p.blocks, p.inodes);
+    if (err == 0) err = mountv6(argv[optind], &st.u);
+    if (err < 0) {
+        printf("%s: %s\n", argv[optind], ERR_MESSAGES[err - ERR_FIRST]);
+        return 1;
+    }
+    err = gen_tree(&st, &p);
+    if (err == 0) err = gen_create_files(&st, &p);
+    /* without free inodes (inode_alloc gives ERR_NOMEM), the files created are still filled */
+    if (err == ERR_NOMEM && st.nb_files > 0) {
+        printf("stopped creating files: no more inodes\n");
+        err = 0;
+    }
+    if (err == 0 && st.nb_files > 0) err = gen_write_files(&st, &p);
+    if (err < 0) printf("stopped: %s\n", ERR_MESSAGES[err - ERR_FIRST]);
+
+    printf("%d directories, %d files, %llu bytes, %.2f extents per file\n", st.nb_dirs, st.nb_files,
+           (unsigned long long) st.bytes, gen_extents(&st));
+    umountv6(&st.u);
+    free(st.dirs);
+    free(st.files);
+    return 0;
+}
@@ -4,6 +4,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include "mount.h"
@@ -11,7 +12,14 @@
 #include "error.h"
 #include "sector.h"
 #include "inode.h"
+#include "journal.h"
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+/* nombre de bits d'un secteur des bitmaps sur disque */
+#define MKFS_BITS_PER_SECTOR (SECTOR_SIZE*8)
 
 /**
  * @brief   fill the bmblock array ibm of the struct unix_filesystem u
@@ -21,7 +29,7 @@ void fill_ibm(struct unix_filesystem *u)
 {
     if(u!=NULL) {
         struct inode tab[INODES_PER_SECTOR];
-        for(int i=u->s.s_inode_start; i<u->s.s_inode_start+u->s.s_isize-1; ++i) {
+        for(int i=u->s.s_inode_start; i<u->s.s_inode_start+u->s.s_isize; ++i) {
             if(sector_read(u->f,i,tab)!=0) {
                 for(int j=0; j<INODES_PER_SECTOR; ++j) {
                     bm_set(u->ibm,(i-u->s.s_inode_start)*INODES_PER_SECTOR+j);
@@ -65,6 +73,9 @@ void fill_fbm(struct unix_filesystem* u)
                             //on incremente le offset de SECTOR_SIZE a chaque fois
                             offset+=SECTOR_SIZE;
                             ++file_sec_off;
+                        } else {
+                            // inode corrompue : le reste du fichier est laissé à fsck
+                            break;
                         }
                     }
                 }
@@ -94,18 +105,36 @@ int mountv6(const char *filename, struct unix_filesystem *u)
     FILE* entree = fopen(filename,"r+b");
     if(entree==NULL) return ERR_IO;
     u->f=entree;
+    /* trace optionnelle de tous les accès aux secteurs, jusqu'au démontage */
+    const char *trace_file = getenv("UV6_SECTOR_TRACE");
+    if(trace_file!=NULL) (void)sector_trace_open(trace_file);
+    pthread_rwlock_init(&u->lock, NULL);
 
     if( (r=sector_read(u->f, BOOTBLOCK_SECTOR, bootSector)) != 0 ) return r;
     if(bootSector[BOOTBLOCK_MAGIC_NUM_OFFSET]!=BOOTBLOCK_MAGIC_NUM) return ERR_BADBOOTSECTOR;
 
     if( (r=sector_read(u->f, SUPERBLOCK_SECTOR, &(u->s))) != 0 ) return r;
+    // les transactions validées avant un crash sont rejouées avant tout le reste
+    if( (r=journal_open(u)) != 0 ) return r;
     
     u->fbm = bm_alloc(u->s.s_block_start+1,u->s.s_fsize-1);
     if(u->fbm==NULL) return ERR_NOMEM;
-    u->ibm = bm_alloc(u->s.s_inode_start,u->s.s_isize*INODES_PER_SECTOR-1);
+    // l'inode 0 et la racine ne sont jamais allouées
+    u->ibm = bm_alloc(ROOT_INUMBER+1,u->s.s_isize*INODES_PER_SECTOR-1);
     if(u->ibm==NULL) return ERR_NOMEM;
+    enum sector_tag tag = sector_tag_enter(SECTOR_TAG_BITMAP);
     fill_ibm(u);
     fill_fbm(u);
+    sector_tag_leave(tag);
+    bm_recount(u->ibm);
+    bm_recount(u->fbm);
+
+    // les écritures en place du contenu des fichiers, pour les arbres de Merkle
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    u->mount_id = (uint64_t)now.tv_sec*1000000000ULL+(uint64_t)now.tv_nsec;
+    u->written = calloc(u->s.s_fsize, sizeof(uint32_t));
+    if(u->written==NULL) return ERR_NOMEM;
 
     return 0;
 
@@ -131,9 +160,48 @@ void mountv6_print_superblock(const struct unix_filesystem *u)
     printf("s_fmod              : %" PRIu8 "\n", u->s.s_fmod);
     printf("s_ronly             : %" PRIu8 "\n", u->s.s_ronly);
     printf("s_time              : [0] %" PRIu16 "\n", u->s.s_time[0]); //voir pour print (tableau)
+    printf("s_journal_start     : %" PRIu16 "\n", u->s.s_journal_start);
+    printf("s_journal_size      : %" PRIu16 "\n", u->s.s_journal_size);
     printf("**********FS SUPERBLOCK END**********\n");
 }
 
+/**
+ * @brief write the bitmaps to their regions of the disk, if the filesystem has them
+ *        and they changed
+ * @param u - the mounted filesytem
+ * @return 0 on success; <0 on error
+ */
+int mountv6_store_bitmaps(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+    if((u->s.s_fbmsize==0)||(u->s.s_ibmsize==0)||(u->fbm==NULL)||(u->ibm==NULL)) return 0;
+    size_t fbm_len = (size_t)u->s.s_fbmsize*SECTOR_SIZE;
+    size_t ibm_len = (size_t)u->s.s_ibmsize*SECTOR_SIZE;
+    uint8_t* disk = malloc(2*(fbm_len+ibm_len));
+    if(disk==NULL) return ERR_NOMEM;
+    uint8_t* fbm = disk+fbm_len+ibm_len;
+    uint8_t* ibm = fbm+fbm_len;
+    memset(fbm,0,fbm_len+ibm_len);
+    // mêmes conventions que mountv6_mkfs : les secteurs des métadonnées, l'inode 0 et la racine sont occupés
+    for(uint64_t i=0; (i<fbm_len*8)&&(i<u->s.s_fsize); ++i) {
+        if((i<u->s.s_block_start)||(bm_get(u->fbm,i)==1)) fbm[i/8] |= (uint8_t)(1<<(i%8));
+    }
+    for(uint64_t i=0; (i<ibm_len*8)&&(i<(uint64_t)u->s.s_isize*INODES_PER_SECTOR); ++i) {
+        if((i<=ROOT_INUMBER)||(bm_get(u->ibm,i)==1)) ibm[i/8] |= (uint8_t)(1<<(i%8));
+    }
+    int err=journal_read(u,u->s.s_fbm_start,u->s.s_fbmsize,disk);
+    if(err==0) err=journal_read(u,u->s.s_ibm_start,u->s.s_ibmsize,disk+fbm_len);
+    // seuls les secteurs qui ont changé sont écrits (aucun si monté en lecture seule)
+    for(int k=0; (err==0)&&(k<u->s.s_fbmsize+u->s.s_ibmsize); ++k) {
+        uint32_t sector = (k<u->s.s_fbmsize) ? u->s.s_fbm_start+k : u->s.s_ibm_start+(k-u->s.s_fbmsize);
+        if(memcmp(disk+k*SECTOR_SIZE,fbm+k*SECTOR_SIZE,SECTOR_SIZE)!=0) {
+            err=SECTOR_TAGGED(SECTOR_TAG_BITMAP, journal_write(u,sector,1,fbm+k*SECTOR_SIZE));
+        }
+    }
+    free(disk);
+    return err;
+}
+
 /**
  * @brief umount the given filesystem
  * @param u - the mounted filesytem
@@ -142,11 +210,52 @@ void mountv6_print_superblock(const struct unix_filesystem *u)
 int umountv6(struct unix_filesystem *u)
 {
     M_REQUIRE_NON_NULL(u);
-    int check=fclose(u->f);
+    // le journal écrit les bitmaps avec sa dernière transaction
+    int stored=0;
+    if(u->f!=NULL) stored=(u->journal!=NULL) ? journal_close(u) : mountv6_store_bitmaps(u);
+    int check=(u->f!=NULL) ? fclose(u->f) : 0;
+    u->f=NULL;
+    bm_free(u->fbm);
+    bm_free(u->ibm);
+    u->fbm=NULL;
+    u->ibm=NULL;
+    free(u->written);
+    u->written=NULL;
+    pthread_rwlock_destroy(&u->lock);
+    sector_trace_close();
     if(check!=0) {
         return ERR_IO;
     }
-    return 0;
+    return stored;
+}
+
+/**
+ * @brief take the lock of the filesystem for an operation which only reads it
+ *        (lookup, getattr, read, readdir): such operations run concurrently
+ * @param u - the mounted filesytem
+ */
+void mountv6_lock_shared(struct unix_filesystem *u)
+{
+    if(u!=NULL) pthread_rwlock_rdlock(&u->lock);
+}
+
+/**
+ * @brief take the lock of the filesystem for an operation which allocates
+ *        inodes or sectors or modifies a directory, a file or an inode
+ * @param u - the mounted filesytem
+ */
+void mountv6_lock_exclusive(struct unix_filesystem *u)
+{
+    if(u!=NULL) pthread_rwlock_wrlock(&u->lock);
+}
+
+/**
+ * @brief release the lock taken by mountv6_lock_shared or mountv6_lock_exclusive
+ * @param u - the mounted filesytem
+ */
+void mountv6_unlock(struct unix_filesystem *u)
+{
+    if(u!=NULL) pthread_rwlock_unlock(&u->lock);
 }
 
 /**
@@ -161,33 +270,54 @@ int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes)
 	sblock.s_isize = ceil((double)num_inodes/INODES_PER_SECTOR);
 	sblock.s_fsize = num_blocks;
 	if(sblock.s_fsize<(sblock.s_isize+num_inodes)) return ERR_NOT_ENOUGH_BLOCS;
-	sblock.s_inode_start = SUPERBLOCK_SECTOR+1;
-	sblock.s_block_start = sblock.s_inode_start + sblock.s_isize;
+	// les bitmaps ont un bit par secteur (resp. par inode), juste après le superblock
+	sblock.s_fbm_start = SUPERBLOCK_SECTOR+1;
+	sblock.s_fbmsize = (num_blocks+MKFS_BITS_PER_SECTOR-1)/MKFS_BITS_PER_SECTOR;
+	sblock.s_ibm_start = sblock.s_fbm_start + sblock.s_fbmsize;
+	sblock.s_ibmsize = (sblock.s_isize*INODES_PER_SECTOR+MKFS_BITS_PER_SECTOR-1)/MKFS_BITS_PER_SECTOR;
+	sblock.s_inode_start = sblock.s_ibm_start + sblock.s_ibmsize;
+	// puis le journal des métadonnées, s'il y a de la place
+	sblock.s_journal_start = sblock.s_inode_start + sblock.s_isize;
+	sblock.s_journal_size = (num_blocks/16<JOURNAL_SECTORS) ? num_blocks/16 : JOURNAL_SECTORS;
+	if(sblock.s_journal_size<JOURNAL_MIN_SECTORS) sblock.s_journal_size = 0;
+	sblock.s_block_start = sblock.s_journal_start + sblock.s_journal_size;
+	if(sblock.s_block_start>=sblock.s_fsize) return ERR_NOT_ENOUGH_BLOCS;
 	
-	FILE* entree = fopen(filename,"w+b");
-    if(entree==NULL) return ERR_IO;
-	uint8_t bootSector[SECTOR_SIZE];
-	bootSector[BOOTBLOCK_MAGIC_NUM_OFFSET] = BOOTBLOCK_MAGIC_NUM;
-	int err=0;
-	if( (err=sector_write(entree, BOOTBLOCK_SECTOR, bootSector)) != 0 ) return err;
-	if( (err=sector_write(entree, SUPERBLOCK_SECTOR, &sblock)) != 0 ) return err;
+	// toute la zone des métadonnées est construite en mémoire puis écrite en une fois
+	uint8_t* meta = calloc(sblock.s_block_start, SECTOR_SIZE);
+	if(meta==NULL) return ERR_NOMEM;
+	meta[BOOTBLOCK_SECTOR*SECTOR_SIZE+BOOTBLOCK_MAGIC_NUM_OFFSET] = BOOTBLOCK_MAGIC_NUM;
+	memcpy(meta+SUPERBLOCK_SECTOR*SECTOR_SIZE, &sblock, sizeof(sblock));
 	
-	struct inode ino;
-	memset(&ino,0,sizeof(ino));
-	ino.i_mode = (uint16_t)IFDIR + IALLOC;
-	struct inode inodes[INODES_PER_SECTOR];	
-	for(int j=0;j<INODES_PER_SECTOR;++j){
-		memset(&inodes[j], 0, sizeof(struct inode));
+	// les secteurs des métadonnées sont occupés, de même que l'inode 0 et la racine
+	uint8_t* fbm = meta+sblock.s_fbm_start*SECTOR_SIZE;
+	for(int i=0; i<sblock.s_block_start; ++i) fbm[i/8] |= (uint8_t)(1<<(i%8));
+	uint8_t* ibm = meta+sblock.s_ibm_start*SECTOR_SIZE;
+	ibm[0] |= (uint8_t)(1 | (1<<ROOT_INUMBER));
+	
+	struct inode* inodes = (struct inode*)(meta+sblock.s_inode_start*SECTOR_SIZE);
+	inodes[ROOT_INUMBER].i_mode = (uint16_t)IFDIR + IALLOC;
+	
+	if(sblock.s_journal_size>0) {
+		struct journal_block* super = (struct journal_block*)(meta+sblock.s_journal_start*SECTOR_SIZE);
+		super->magic = JOURNAL_MAGIC;
+		super->kind = JOURNAL_SUPER;
+		super->seq = 1;
 	}
-	inodes[1]=ino;
-	if( (err=sector_write(entree, sblock.s_inode_start, inodes)) != 0 ) return err;
-	for(int j=0;j<INODES_PER_SECTOR;++j){
-		memset(&inodes[j], 0, sizeof(struct inode));
+	
+	FILE* entree = fopen(filename,"w+b");
+	if(entree==NULL) {
+		free(meta);
+		return ERR_IO;
 	}
-	for(int i=sblock.s_inode_start+1; i<sblock.s_block_start;++i){
-		if( (err=sector_write(entree, i, inodes)) != 0 ) return err;	
+	int err=sectors_write(entree, BOOTBLOCK_SECTOR, sblock.s_block_start, meta);
+	free(meta);
+	// la zone des données est réservée d'un coup, sans l'écrire (à défaut, le fichier est agrandi)
+	if(err==0) {
+		off_t size = (off_t)num_blocks*SECTOR_SIZE;
+		if(posix_fallocate(fileno(entree), 0, size)!=0 && ftruncate(fileno(entree), size)!=0) err=ERR_IO;
 	}
-	fclose(entree);
+	if(fclose(entree)!=0 && err==0) err=ERR_IO;
 	
-	return 0;
+	return err;
 }
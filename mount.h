@@ -9,6 +9,7 @@
  */
 
 #include <stdio.h>
+#include <pthread.h>
 #include "unixv6fs.h"
 #include "bmblock.h"
 #include "sector.h"
@@ -17,11 +18,18 @@
 extern "C" {
 #endif
 
+struct journal;
+
 struct unix_filesystem {
     FILE *f;
     struct superblock s;           /* copy of the superblock */
     struct bmblock_array *fbm;     /* block bitmmap */
     struct bmblock_array *ibm;     /* inode bitmap */
+    pthread_rwlock_t lock;         /* shared by readers, exclusive for allocation and mutation */
+    struct journal *journal;       /* metadata journal (see journal.h), NULL if the disk has none */
+    uint64_t mount_id;             /* tells this mount from the other mounts of the disk */
+    uint32_t write_seq;            /* number of writes of file content in place since mountv6 */
+    uint32_t *written;             /* per sector, the write_seq of its last such write (0: none) */
 };
 
 /**
@@ -45,13 +53,50 @@ void mountv6_print_superblock(const struct unix_filesystem *u);
  */
 int umountv6(struct unix_filesystem *u);
 
+/**
+ * @brief write the bitmaps to their regions of the disk (see mountv6_mkfs),
+ *        if the filesystem has them and they changed, through the journal;
+ *        done by each commit and by umountv6
+ * @param u - the mounted filesytem
+ * @return 0 on success; <0 on error
+ */
+int mountv6_store_bitmaps(struct unix_filesystem *u);
+
+/**
+ * @brief take the lock of the filesystem for an operation which only reads it
+ *        (lookup, getattr, read, readdir): such operations run concurrently
+ * @param u - the mounted filesytem
+ */
+void mountv6_lock_shared(struct unix_filesystem *u);
+
+/**
+ * @brief take the lock of the filesystem for an operation which allocates
+ *        inodes or sectors or modifies a directory, a file or an inode
+ * @param u - the mounted filesytem
+ */
+void mountv6_lock_exclusive(struct unix_filesystem *u);
+
+/**
+ * @brief release the lock taken by mountv6_lock_shared or mountv6_lock_exclusive
+ * @param u - the mounted filesytem
+ */
+void mountv6_unlock(struct unix_filesystem *u);
+
 /*
  * staff only; students will not have to implement
  */
 /**
  * @brief create a new filesystem
+ *
+ * The metadata (boot sector, superblock, bitmaps, inodes and the first
+ * sector of the journal region which follows them, see journal.h) is
+ * written in a single I/O and the image is then sized to num_blocks
+ * sectors. Bit n of the data block bitmap is sector n; bit n of the inode
+ * bitmap is inode n.
+ *
  * @param num_blocks the total number of blocks (= max size of disk), in sectors
  * @param num_inodes the total number of inodes
+ * @return 0 on success; <0 on error
  */
 int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes);
 
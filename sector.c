@@ -4,10 +4,226 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include "error.h"
 #include "sector.h"
 #include "unixv6fs.h"
 
+const char * const SECTOR_TAG_NAMES[SECTOR_TAG_LAST] = {
+    "other", "inode", "dir", "file", "bitmap"
+};
+
+/* the counters of one thread, only written by it */
+struct sector_shard {
+    struct sector_stats stats;
+    uint64_t next;                  /* sector following the last I/O */
+    struct sector_shard *link;
+};
+
+/* the shards of the running threads; those of the threads which ended are
+ * added to retired and freed (see sector_shard_retire) */
+static struct sector_shard *shards = NULL;
+static struct sector_stats retired;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+static __thread struct sector_shard *my_shard = NULL;
+static __thread enum sector_tag my_tag = SECTOR_TAG_OTHER;
+
+static FILE *trace = NULL;
+static uint64_t trace_start = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief the current time in nanoseconds
+ */
+static uint64_t sector_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000u + (uint64_t)t.tv_nsec;
+}
+
+/**
+ * @brief adds n to a counter of the calling thread, readable by the others
+ */
+static void sector_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief adds the counters of a shard, which its thread may update meanwhile, to total
+ */
+static void sector_stats_add(struct sector_stats *total, const struct sector_stats *s)
+{
+    total->reads += __atomic_load_n(&s->reads, __ATOMIC_RELAXED);
+    total->writes += __atomic_load_n(&s->writes, __ATOMIC_RELAXED);
+    total->bytes_read += __atomic_load_n(&s->bytes_read, __ATOMIC_RELAXED);
+    total->bytes_written += __atomic_load_n(&s->bytes_written, __ATOMIC_RELAXED);
+    total->seek_distance += __atomic_load_n(&s->seek_distance, __ATOMIC_RELAXED);
+    for(int t=0; t<SECTOR_TAG_LAST; ++t) {
+        total->by_tag[t] += __atomic_load_n(&s->by_tag[t], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief destructor of shard_key, run when a thread ends: its counters go
+ * to the total of the ended threads and its shard is freed
+ */
+static void sector_shard_retire(void *arg)
+{
+    struct sector_shard *s = arg;
+    pthread_mutex_lock(&shards_lock);
+    for(struct sector_shard **p = &shards; *p!=NULL; p = &(*p)->link) {
+        if(*p==s) {
+            *p = s->link;
+            break;
+        }
+    }
+    sector_stats_add(&retired, &s->stats);
+    pthread_mutex_unlock(&shards_lock);
+    my_shard = NULL;
+    free(s);
+}
+
+static void sector_key_create(void)
+{
+    pthread_key_create(&shard_key, sector_shard_retire);
+}
+
+/**
+ * @brief counts an I/O of nb sectors from sector, and logs it if a trace is open
+ * @param write 0 for a read, 1 for a write
+ */
+static void sector_account(int write, uint32_t sector, uint32_t nb)
+{
+    if(my_shard==NULL) {
+        struct sector_shard *s = calloc(1, sizeof(struct sector_shard));
+        if(s==NULL) return;
+        s->next = sector;
+        pthread_once(&shard_once, sector_key_create);
+        pthread_mutex_lock(&shards_lock);
+        s->link = shards;
+        shards = s;
+        pthread_mutex_unlock(&shards_lock);
+        pthread_setspecific(shard_key, s);
+        my_shard = s;
+    }
+    struct sector_stats *st = &my_shard->stats;
+    sector_add(write ? &st->writes : &st->reads, 1);
+    sector_add(write ? &st->bytes_written : &st->bytes_read, (uint64_t)nb*SECTOR_SIZE);
+    sector_add(&st->seek_distance, sector>=my_shard->next ? sector-my_shard->next : my_shard->next-sector);
+    sector_add(&st->by_tag[my_tag], nb);
+    my_shard->next = (uint64_t)sector + nb;
+
+    if(__atomic_load_n(&trace, __ATOMIC_ACQUIRE)!=NULL) {
+        pthread_mutex_lock(&trace_lock);
+        if(trace!=NULL) {
+            struct sector_trace_record r = {
+                sector_now()-trace_start, sector, (uint16_t)nb, (uint8_t)write, (uint8_t)my_tag
+            };
+            fwrite(&r, sizeof(r), 1, trace);
+        }
+        pthread_mutex_unlock(&trace_lock);
+    }
+}
+
+/**
+ * @brief tags the accesses of the calling thread with tag, unless an outer
+ * layer already did: the layer which drives the I/O gets it
+ * @param tag the layer
+ * @return the tag to give back to sector_tag_leave
+ */
+enum sector_tag sector_tag_enter(enum sector_tag tag)
+{
+    enum sector_tag previous = my_tag;
+    if(my_tag==SECTOR_TAG_OTHER) my_tag = tag;
+    return previous;
+}
+
+/**
+ * @brief ends the tag set by sector_tag_enter
+ * @param previous the value returned by sector_tag_enter
+ */
+void sector_tag_leave(enum sector_tag previous)
+{
+    my_tag = previous;
+}
+
+/**
+ * @brief sums the counters of all the threads, running (which may go on
+ *        meanwhile) or ended
+ * @param total the sum (OUT)
+ */
+void sector_stats_get(struct sector_stats *total)
+{
+    if(total==NULL) return;
+    pthread_mutex_lock(&shards_lock);
+    *total = retired;
+    for(struct sector_shard *s = shards; s!=NULL; s = s->link) {
+        sector_stats_add(total, &s->stats);
+    }
+    pthread_mutex_unlock(&shards_lock);
+}
+
+/**
+ * @brief prints the counters of all the threads
+ * @param out the stream
+ */
+void sector_stats_print(FILE *out)
+{
+    struct sector_stats st;
+    sector_stats_get(&st);
+    fprintf(out, "sector reads %llu (%llu bytes), writes %llu (%llu bytes), seek distance %llu sectors\n",
+            (unsigned long long)st.reads, (unsigned long long)st.bytes_read,
+            (unsigned long long)st.writes, (unsigned long long)st.bytes_written,
+            (unsigned long long)st.seek_distance);
+    fputs("sectors by layer:", out);
+    for(int t=0; t<SECTOR_TAG_LAST; ++t) {
+        fprintf(out, " %s %llu", SECTOR_TAG_NAMES[t], (unsigned long long)st.by_tag[t]);
+    }
+    fputs("\n", out);
+}
+
+/**
+ * @brief starts logging every access into a new trace file
+ * @param filename the trace to create
+ * @return 0 on success; <0 on error
+ */
+int sector_trace_open(const char *filename)
+{
+    M_REQUIRE_NON_NULL(filename);
+    FILE *t = fopen(filename, "wb");
+    if(t==NULL) return ERR_IO;
+    if(fwrite(SECTOR_TRACE_MAGIC, strlen(SECTOR_TRACE_MAGIC), 1, t)!=1) {
+        fclose(t);
+        return ERR_IO;
+    }
+    sector_trace_close();
+    pthread_mutex_lock(&trace_lock);
+    trace_start = sector_now();
+    __atomic_store_n(&trace, t, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+/**
+ * @brief stops logging and closes the trace, if any
+ */
+void sector_trace_close(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    if(trace!=NULL) fclose(trace);
+    __atomic_store_n(&trace, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+}
+
 /**
  * @brief read one 512-byte sector from the virtual disk
  * @param f open file of the virtual disk
@@ -17,19 +233,30 @@
  */
 int sector_read(FILE *f, uint32_t sector, void *data)
 {
-    size_t nbr_bytes_read =0;
-    int pos_sector = sector * SECTOR_SIZE; //position in bytes of the sector on the disk
+    return sectors_read(f, sector, 1, data);
+}
 
+/**
+ * @brief read nb consecutive 512-byte sectors from the virtual disk in one I/O,
+ *        with pread on the descriptor of f: the FILE position is not used,
+ *        so several threads may call it at once
+ * @param f open file of the virtual disk
+ * @param sector the location of the first sector (in sector units, not bytes)
+ * @param nb the number of consecutive sectors to read
+ * @param data a pointer to nb*512-bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sectors_read(FILE *f, uint32_t sector, uint32_t nb, void *data)
+{
     M_REQUIRE_NON_NULL(f);
     M_REQUIRE_NON_NULL(data);
-    if(fseek(f,pos_sector,SEEK_SET)!=0) {
+    size_t total = (size_t)nb * SECTOR_SIZE;
+    sector_account(0, sector, nb);
+    ssize_t nbr_bytes_read = pread(fileno(f),data,total,(off_t)sector*SECTOR_SIZE);
+    if((nbr_bytes_read<0)||((size_t)nbr_bytes_read!=total)) {
         return ERR_IO;
     }
-    nbr_bytes_read=fread(data,1,SECTOR_SIZE,f);
-    if(nbr_bytes_read<SECTOR_SIZE) {
-        return ERR_IO;
-    }
-    return 0; //in case of success
+    return 0;
 }
 
 /**
@@ -41,15 +268,50 @@ int sector_read(FILE *f, uint32_t sector, void *data)
  */
 int sector_write(FILE *f, uint32_t sector, void  *data)
 {
-	M_REQUIRE_NON_NULL(f);
+    return sectors_write(f, sector, 1, data);
+}
+
+/**
+ * @brief write nb consecutive 512-byte sectors to the virtual disk in one I/O
+ * @param f open file of the virtual disk
+ * @param sector the location of the first sector (in sector units, not bytes)
+ * @param nb the number of consecutive sectors to write
+ * @param data a pointer to nb*512-bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sectors_write(FILE *f, uint32_t sector, uint32_t nb, const void *data)
+{
+    M_REQUIRE_NON_NULL(f);
     M_REQUIRE_NON_NULL(data);
-    size_t nbr_bytes_written =0;
-    int pos_sector = sector * SECTOR_SIZE; //position in bytes of the sector on the disk
-	if(fseek(f,pos_sector,SEEK_SET)!=0) {
+    size_t total = (size_t)nb * SECTOR_SIZE;
+    sector_account(1, sector, nb);
+    ssize_t nbr_bytes_written = pwrite(fileno(f),data,total,(off_t)sector*SECTOR_SIZE);
+    if((nbr_bytes_written<0)||((size_t)nbr_bytes_written!=total)) {
         return ERR_IO;
     }
-    nbr_bytes_written = fwrite(data,1,SECTOR_SIZE,f);
-    if(nbr_bytes_written!=SECTOR_SIZE) {
+    return 0;
+}
+
+/**
+ * @brief write consecutive sectors gathered from several buffers in one I/O
+ * @param f open file of the virtual disk
+ * @param sector the location of the first sector (in sector units, not bytes)
+ * @param iov the buffers to write, their total length must be a multiple of 512 bytes (IN)
+ * @param iovcnt the number of buffers
+ * @return 0 on success; <0 on error
+ */
+int sectors_writev(FILE *f, uint32_t sector, const struct iovec *iov, int iovcnt)
+{
+    M_REQUIRE_NON_NULL(f);
+    M_REQUIRE_NON_NULL(iov);
+    size_t total = 0;
+    for(int i=0; i<iovcnt; ++i) {
+        total += iov[i].iov_len;
+    }
+    if(total%SECTOR_SIZE!=0) return ERR_BAD_PARAMETER;
+    sector_account(1, sector, total/SECTOR_SIZE);
+    ssize_t nbr_bytes_written = pwritev(fileno(f),iov,iovcnt,(off_t)sector*SECTOR_SIZE);
+    if((nbr_bytes_written<0)||((size_t)nbr_bytes_written!=total)) {
         return ERR_IO;
     }
     return 0;
@@ -4,17 +4,103 @@
  * @file  sector.h
  * @brief block-level accessor function.
  *
+ * All the accessors use pread/pwrite on the descriptor of the FILE: they
+ * never move nor buffer through the FILE, so they may be called by several
+ * threads at once.
+ *
+ * Every access is counted in per-thread counters, added to a common total
+ * when their thread ends (see sector_stats_get) and, if a trace was opened with sector_trace_open, logged with the tag of
+ * the layer which caused it (see sector_tag_enter).
+ *
  * @author Edouard Bugnion
  * @date summer 2016
  */
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* the layer which caused an access */
+enum sector_tag {
+    SECTOR_TAG_OTHER,   /* boot sector, superblock, mkfs... */
+    SECTOR_TAG_INODE,
+    SECTOR_TAG_DIR,
+    SECTOR_TAG_FILE,
+    SECTOR_TAG_BITMAP,  /* rebuilding the bitmaps at mount */
+    SECTOR_TAG_LAST
+};
+
+extern const char * const SECTOR_TAG_NAMES[SECTOR_TAG_LAST];
+
+/* counters of accesses, summed over all the threads */
+struct sector_stats {
+    uint64_t reads;                         /* number of read I/Os */
+    uint64_t writes;                        /* number of write I/Os */
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t seek_distance;                 /* sectors between the end of an I/O and the start of the next one of the same thread */
+    uint64_t by_tag[SECTOR_TAG_LAST];       /* sectors accessed for each layer */
+};
+
+/* binary trace: SECTOR_TRACE_MAGIC then one record per I/O */
+#define SECTOR_TRACE_MAGIC "UV6TRCE1"
+
+struct sector_trace_record {
+    uint64_t ns;        /* time since the trace was opened */
+    uint32_t sector;    /* first sector */
+    uint16_t nb;        /* number of consecutive sectors */
+    uint8_t write;      /* 0 for a read, 1 for a write */
+    uint8_t tag;        /* enum sector_tag */
+};
+
+/**
+ * @brief tags the accesses of the calling thread with tag, unless an outer
+ * layer already did: the layer which drives the I/O gets it
+ * @param tag the layer
+ * @return the tag to give back to sector_tag_leave
+ */
+enum sector_tag sector_tag_enter(enum sector_tag tag);
+
+/**
+ * @brief ends the tag set by sector_tag_enter
+ * @param previous the value returned by sector_tag_enter
+ */
+void sector_tag_leave(enum sector_tag previous);
+
+/* evaluates the I/O expression io (an int) with its accesses tagged tag */
+#define SECTOR_TAGGED(tag, io) \
+    ({ enum sector_tag sector_prev__ = sector_tag_enter(tag); int sector_r__ = (io); \
+       sector_tag_leave(sector_prev__); sector_r__; })
+
+/**
+ * @brief sums the counters of all the threads, running (which may go on
+ *        meanwhile) or ended
+ * @param total the sum (OUT)
+ */
+void sector_stats_get(struct sector_stats *total);
+
+/**
+ * @brief prints the counters of all the threads
+ * @param out the stream
+ */
+void sector_stats_print(FILE *out);
+
+/**
+ * @brief starts logging every access into a new trace file
+ * @param filename the trace to create
+ * @return 0 on success; <0 on error
+ */
+int sector_trace_open(const char *filename);
+
+/**
+ * @brief stops logging and closes the trace, if any
+ */
+void sector_trace_close(void);
+
 // Implemented WEEK 4
 /**
  * @brief read one 512-byte sector from the virtual disk
@@ -26,6 +112,18 @@ extern "C" {
 int sector_read(FILE *f, uint32_t sector, void *data);
 
 
+/**
+ * @brief read nb consecutive 512-byte sectors from the virtual disk in one I/O,
+ *        with pread on the descriptor of f: the FILE position is not used,
+ *        so several threads may call it at once
+ * @param f open file of the virtual disk
+ * @param sector the location of the first sector (in sector units, not bytes)
+ * @param nb the number of consecutive sectors to read
+ * @param data a pointer to nb*512-bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sectors_read(FILE *f, uint32_t sector, uint32_t nb, void *data);
+
 // Implemented WEEK 11
 /**
  * @brief read one 512-byte sector from the virtual disk
@@ -36,6 +134,26 @@ int sector_read(FILE *f, uint32_t sector, void *data);
  */
 int sector_write(FILE *f, uint32_t sector, void  *data);
 
+/**
+ * @brief write nb consecutive 512-byte sectors to the virtual disk in one I/O
+ * @param f open file of the virtual disk
+ * @param sector the location of the first sector (in sector units, not bytes)
+ * @param nb the number of consecutive sectors to write
+ * @param data a pointer to nb*512-bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sectors_write(FILE *f, uint32_t sector, uint32_t nb, const void *data);
+
+/**
+ * @brief write consecutive sectors gathered from several buffers in one I/O
+ * @param f open file of the virtual disk
+ * @param sector the location of the first sector (in sector units, not bytes)
+ * @param iov the buffers to write, their total length must be a multiple of 512 bytes (IN)
+ * @param iovcnt the number of buffers
+ * @return 0 on success; <0 on error
+ */
+int sectors_writev(FILE *f, uint32_t sector, const struct iovec *iov, int iovcnt);
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,10 +4,16 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include "sha.h"
+#include "error.h"
+#include "sector.h"
 #include "inode.h"
 #include "filev6.h"
 #include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <pthread.h>
 
 /**
  * @brief transforms the unsigned char pointer returned by the SHA256 method into a "string" of chars
@@ -33,7 +39,7 @@ static void sha_to_string(const unsigned char *SHA, char *sha_string)
 void print_sha_from_content(const unsigned char *content, size_t length)
 {
     unsigned char hash[SHA256_DIGEST_LENGTH];
-    char sha_string [2*SHA256_DIGEST_LENGTH];
+    char sha_string [2*SHA256_DIGEST_LENGTH+1];
     SHA256(content, length, hash);
     sha_to_string(hash,sha_string);
     if(sha_string == NULL) {
@@ -45,6 +51,49 @@ void print_sha_from_content(const unsigned char *content, size_t length)
     }
 }
 
+/**
+ * @brief compute the sha256 of the content of an inode; the data is hashed
+ *        straight from the read buffer, one read per extent of at most
+ *        SHA_CHUNK_SECTORS contiguous sectors
+ * @param u the filesystem
+ * @param inode the inode of which we want the sha
+ * @param digest SHA256_DIGEST_LENGTH bytes (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sha_inode(const struct unix_filesystem *u, const struct inode *inode, unsigned char *digest)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(inode);
+    M_REQUIRE_NON_NULL(digest);
+
+    uint16_t sectors[MAX_FILE_SECTORS];
+    int nb = filev6_blockmap(u, inode, sectors);
+    if (nb < 0) return nb;
+    int32_t size_file = inode_getsize(inode);
+
+    uint8_t *buf = malloc(SHA_CHUNK_SECTORS * SECTOR_SIZE);
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    int err = 0;
+    if ((buf == NULL) || (ctx == NULL) || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) err = ERR_NOMEM;
+
+    int first = 0;
+    while ((err == 0) && (first < nb)) {
+        int last = first + 1;
+        while ((last < nb) && (last - first < SHA_CHUNK_SECTORS) && (sectors[last] == sectors[last - 1] + 1)) ++last;
+        if ((err = SECTOR_TAGGED(SECTOR_TAG_FILE, sectors_read(u->f, sectors[first], last - first, buf))) < 0) break;
+        /* only the beginning of the last sector belongs to the file */
+        int32_t len = (last - first) * SECTOR_SIZE;
+        if (size_file - first * SECTOR_SIZE < len) len = size_file - first * SECTOR_SIZE;
+        if (!EVP_DigestUpdate(ctx, buf, len)) err = ERR_IO;
+        first = last;
+    }
+    if ((err == 0) && !EVP_DigestFinal_ex(ctx, digest, NULL)) err = ERR_IO;
+
+    EVP_MD_CTX_free(ctx);
+    free(buf);
+    return err;
+}
+
 /**
  * @brief print the sha of the content of an inode
  * @param u the filesystem
@@ -53,10 +102,6 @@ void print_sha_from_content(const unsigned char *content, size_t length)
  */
 void print_sha_inode(struct unix_filesystem *u, struct inode inode, int inr)
 {
-    int32_t size_file = inode_getsize(&inode);
-    uint8_t my_sector[SECTOR_SIZE];
-    uint8_t val[size_file];
-    int index=0;
     struct filev6 file;
     memset(&file, 0, sizeof(struct filev6));
     filev6_open(u,inr,&file);
@@ -65,17 +110,270 @@ void print_sha_inode(struct unix_filesystem *u, struct inode inode, int inr)
         if(inode.i_mode & IFDIR) {
             printf("No SHA for directories.\n");
         } else {
-            for(int i=0; i<size_file; i+=SECTOR_SIZE) {
-                filev6_readblock(&file, my_sector);
-                for(int j=0; j<SECTOR_SIZE; ++j) {
-                    if((j+index)<size_file) {
-                        val[j+index]=my_sector[j];
-                    }
-                }
-                index+=SECTOR_SIZE;
+            unsigned char hash[SHA256_DIGEST_LENGTH];
+            char sha_string[2*SHA256_DIGEST_LENGTH+1];
+            if (sha_inode(u, &inode, hash) == 0) {
+                sha_to_string(hash, sha_string);
+                printf("%s", sha_string);
             }
-            print_sha_from_content((const unsigned char *)val, size_file);
             printf("\n");
         }
     }
 }
+
+struct sha_result {
+    int err;                                 /* 0 once the file has been hashed */
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+};
+
+struct sha_manifest_state {
+    const struct unix_filesystem *u;
+    const struct inode *inodes;              /* copy of the whole inode table */
+    struct sha_result *results;              /* one result per inode */
+    int nb_inodes;
+    int next;                                /* first inode of the next batch to hash */
+    pthread_mutex_t lock;
+};
+
+/**
+ * @brief tells whether the manifest lists the given inode
+ */
+static int sha_listed(const struct inode *ino)
+{
+    return (ino->i_mode & IALLOC) && ((ino->i_mode & IFMT) != IFDIR);
+}
+
+/**
+ * @brief worker thread: hashes batches of one sector of inodes until none is left
+ */
+static void *sha_worker(void *arg)
+{
+    struct sha_manifest_state *st = arg;
+    for (;;) {
+        pthread_mutex_lock(&st->lock);
+        int first = st->next;
+        st->next += INODES_PER_SECTOR;
+        pthread_mutex_unlock(&st->lock);
+        if (first >= st->nb_inodes) break;
+
+        int last = (first + (int) INODES_PER_SECTOR < st->nb_inodes) ? first + (int) INODES_PER_SECTOR : st->nb_inodes;
+        for (int inr = first; inr < last; ++inr) {
+            if (sha_listed(&st->inodes[inr])) {
+                st->results[inr].err = sha_inode(st->u, &st->inodes[inr], st->results[inr].digest);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief hash every allocated regular file of the filesystem with SHA_THREADS
+ *        threads and write the manifest, one line "<inr> <size> <sha256>"
+ *        per file, sorted by inode number
+ * @param u the filesystem
+ * @param out where to write the manifest
+ * @return 0 on success; <0 on error
+ */
+int sha_manifest(const struct unix_filesystem *u, FILE *out)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(out);
+
+    struct sha_manifest_state st;
+    memset(&st, 0, sizeof(st));
+    st.u = u;
+    st.nb_inodes = u->s.s_isize * INODES_PER_SECTOR;
+    struct inode *inodes = malloc(u->s.s_isize * SECTOR_SIZE);
+    st.inodes = inodes;
+    st.results = calloc(st.nb_inodes, sizeof(struct sha_result));
+    int err = 0;
+    if ((inodes == NULL) || (st.results == NULL)) {
+        err = ERR_NOMEM;
+    } else {
+        err = inode_read_all(u, inodes);
+    }
+
+    if (err == 0) {
+        pthread_mutex_init(&st.lock, NULL);
+        pthread_t threads[SHA_THREADS];
+        int nb_threads = 0;
+        while ((nb_threads < SHA_THREADS) && (pthread_create(&threads[nb_threads], NULL, sha_worker, &st) == 0)) {
+            ++nb_threads;
+        }
+        /* no thread could be started: hash in this one */
+        if (nb_threads == 0) sha_worker(&st);
+        for (int i = 0; i < nb_threads; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        pthread_mutex_destroy(&st.lock);
+
+        /* the results are indexed by inode number: the manifest is sorted */
+        char sha_string[2 * SHA256_DIGEST_LENGTH + 1];
+        for (int inr = 0; (inr < st.nb_inodes) && (err == 0); ++inr) {
+            if (!sha_listed(&inodes[inr])) continue;
+            if ((err = st.results[inr].err) == 0) {
+                sha_to_string(st.results[inr].digest, sha_string);
+                fprintf(out, "%d %d %s\n", inr, inode_getsize(&inodes[inr]), sha_string);
+            }
+        }
+    }
+
+    free(inodes);
+    free(st.results);
+    return err;
+}
+
+struct sha_file_key {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    uint16_t inr;
+    int32_t size;
+};
+
+struct sha_sector_key {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    uint16_t sector;
+};
+
+/**
+ * @brief order of file keys: by content, then by inode number
+ */
+static int sha_file_cmp(const void *a, const void *b)
+{
+    const struct sha_file_key *ka = a;
+    const struct sha_file_key *kb = b;
+    int c = memcmp(ka->digest, kb->digest, SHA256_DIGEST_LENGTH);
+    return c ? c : (int) ka->inr - (int) kb->inr;
+}
+
+/**
+ * @brief order of sector keys: by content, then by sector number
+ */
+static int sha_sector_cmp(const void *a, const void *b)
+{
+    const struct sha_sector_key *ka = a;
+    const struct sha_sector_key *kb = b;
+    int c = memcmp(ka->digest, kb->digest, SHA256_DIGEST_LENGTH);
+    return c ? c : (int) ka->sector - (int) kb->sector;
+}
+
+/**
+ * @brief hash each data sector of a file (whole sectors, as on disk)
+ * @param keys room for one key per sector of the file (OUT)
+ * @param buf room for SHA_CHUNK_SECTORS sectors
+ * @return the number of sectors hashed; <0 on error
+ */
+static int sha_file_sectors(const struct unix_filesystem *u, const struct inode *ino,
+                            struct sha_sector_key *keys, uint8_t *buf)
+{
+    uint16_t sectors[MAX_FILE_SECTORS];
+    int nb = filev6_blockmap(u, ino, sectors);
+    int err = 0;
+    int first = 0;
+    while ((nb > 0) && (first < nb)) {
+        int last = first + 1;
+        while ((last < nb) && (last - first < SHA_CHUNK_SECTORS) && (sectors[last] == sectors[last - 1] + 1)) ++last;
+        if ((err = SECTOR_TAGGED(SECTOR_TAG_FILE, sectors_read(u->f, sectors[first], last - first, buf))) < 0) return err;
+        for (int k = first; k < last; ++k) {
+            keys[k].sector = sectors[k];
+            if (!EVP_Digest(buf + (k - first) * SECTOR_SIZE, SECTOR_SIZE, keys[k].digest, NULL, EVP_sha256(), NULL)) return ERR_IO;
+        }
+        first = last;
+    }
+    return nb;
+}
+
+/**
+ * @brief content-addressed duplicate analysis: hash every regular file and
+ *        every data sector of the filesystem, group identical contents and
+ *        write one line "<sha256> <size> <inr> <inr>..." per group of identical
+ *        non-empty files
+ * @param u the filesystem
+ * @param out where to write the groups of duplicate files
+ * @param stats the totals, including the bytes sharing would reclaim (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sha_dedup(const struct unix_filesystem *u, FILE *out, struct sha_dedup_stats *stats)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(stats);
+    memset(stats, 0, sizeof(*stats));
+
+    int nb_inodes = u->s.s_isize * INODES_PER_SECTOR;
+    struct inode *inodes = malloc(u->s.s_isize * SECTOR_SIZE);
+    struct sha_file_key *files = malloc(nb_inodes * sizeof(struct sha_file_key));
+    /* the data sectors of all the files fit in the data area of the disk,
+     * unless sizes are corrupted: the array then grows */
+    unsigned int max_sectors = u->s.s_fsize;
+    struct sha_sector_key *sectors = malloc(max_sectors * sizeof(struct sha_sector_key));
+    uint8_t *buf = malloc(SHA_CHUNK_SECTORS * SECTOR_SIZE);
+    int err = 0;
+    if ((inodes == NULL) || (files == NULL) || (sectors == NULL) || (buf == NULL)) {
+        err = ERR_NOMEM;
+    } else {
+        err = inode_read_all(u, inodes);
+    }
+
+    for (int inr = 0; (inr < nb_inodes) && (err == 0); ++inr) {
+        if (!sha_listed(&inodes[inr])) continue;
+        int32_t size = inode_getsize(&inodes[inr]);
+        unsigned int needed = stats->sectors + (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        if (needed > max_sectors) {
+            while (max_sectors < needed) max_sectors = 2 * max_sectors + 1;
+            struct sha_sector_key *grown = realloc(sectors, max_sectors * sizeof(struct sha_sector_key));
+            if (grown == NULL) {
+                err = ERR_NOMEM;
+                break;
+            }
+            sectors = grown;
+        }
+        struct sha_file_key *fk = &files[stats->files];
+        fk->inr = inr;
+        fk->size = size;
+        if ((err = sha_inode(u, &inodes[inr], fk->digest)) < 0) break;
+        ++stats->files;
+        int nb = sha_file_sectors(u, &inodes[inr], &sectors[stats->sectors], buf);
+        if (nb < 0) {
+            err = nb;
+        } else {
+            stats->sectors += nb;
+        }
+    }
+
+    if (err == 0) {
+        /* groups of identical files: every file after the first one of a group is reclaimable */
+        qsort(files, stats->files, sizeof(struct sha_file_key), sha_file_cmp);
+        char sha_string[2 * SHA256_DIGEST_LENGTH + 1];
+        unsigned int first = 0;
+        while (first < stats->files) {
+            unsigned int last = first + 1;
+            while ((last < stats->files) && !memcmp(files[last].digest, files[first].digest, SHA256_DIGEST_LENGTH)) ++last;
+            if ((last - first > 1) && (files[first].size > 0)) {
+                sha_to_string(files[first].digest, sha_string);
+                fprintf(out, "%s %d", sha_string, files[first].size);
+                for (unsigned int k = first; k < last; ++k) {
+                    fprintf(out, " %d", files[k].inr);
+                }
+                fprintf(out, "\n");
+                stats->dup_files += last - first - 1;
+                stats->file_reclaimable += (uint64_t) (last - first - 1) * files[first].size;
+            }
+            first = last;
+        }
+
+        /* identical sectors: every sector after the first one of a group could be shared */
+        qsort(sectors, stats->sectors, sizeof(struct sha_sector_key), sha_sector_cmp);
+        for (unsigned int k = 1; k < stats->sectors; ++k) {
+            if (!memcmp(sectors[k].digest, sectors[k - 1].digest, SHA256_DIGEST_LENGTH)) {
+                ++stats->dup_sectors;
+            }
+        }
+        stats->sector_reclaimable = (uint64_t) stats->dup_sectors * SECTOR_SIZE;
+    }
+
+    free(inodes);
+    free(files);
+    free(sectors);
+    free(buf);
+    return err;
+}
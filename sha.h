@@ -10,6 +10,7 @@
 
 #include "mount.h"
 #include "unixv6fs.h"
+#include <openssl/sha.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,6 +23,53 @@ extern "C" {
  */
 void print_sha_from_content(const unsigned char *content, size_t length);
 
+/* number of sectors read per I/O by sha_inode (at most one extent) */
+#define SHA_CHUNK_SECTORS 128
+
+/**
+ * @brief compute the sha256 of the content of an inode, incrementally,
+ *        extent by extent (no copy of the whole file in memory)
+ * @param u the filesystem
+ * @param inode the inode of which we want the sha
+ * @param digest SHA256_DIGEST_LENGTH bytes (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sha_inode(const struct unix_filesystem *u, const struct inode *inode, unsigned char *digest);
+
+/* number of threads hashing files in sha_manifest */
+#define SHA_THREADS 8
+
+/**
+ * @brief hash every allocated regular file of the filesystem with SHA_THREADS
+ *        threads and write the manifest, one line "<inr> <size> <sha256>"
+ *        per file, sorted by inode number
+ * @param u the filesystem
+ * @param out where to write the manifest
+ * @return 0 on success; <0 on error
+ */
+int sha_manifest(const struct unix_filesystem *u, FILE *out);
+
+struct sha_dedup_stats {
+    unsigned int files;            /* regular files hashed */
+    unsigned int dup_files;        /* files whose content is already held by a file of smaller inr */
+    uint64_t file_reclaimable;     /* bytes of those duplicate files */
+    unsigned int sectors;          /* data sectors hashed */
+    unsigned int dup_sectors;      /* sectors whose content is already held by another sector */
+    uint64_t sector_reclaimable;   /* bytes of those duplicate sectors */
+};
+
+/**
+ * @brief content-addressed duplicate analysis: hash every regular file and
+ *        every data sector of the filesystem, group identical contents and
+ *        write one line "<sha256> <size> <inr> <inr>..." per group of identical
+ *        non-empty files
+ * @param u the filesystem
+ * @param out where to write the groups of duplicate files
+ * @param stats the totals, including the bytes sharing would reclaim (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sha_dedup(const struct unix_filesystem *u, FILE *out, struct sha_dedup_stats *stats);
+
 /**
  * @brief print the sha of the content of an inode
  * @param u the filesystem
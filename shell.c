@@ -6,15 +6,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include "unixv6fs.h"
 #include "mount.h"
 #include "direntv6.h"
 #include "sha.h"
 #include "inode.h"
 #include "error.h"
+#include "filev6.h"
+#include "import.h"
+#include "export.h"
+#include "merkle.h"
+#include "defrag.h"
+#include "fsck.h"
+#include "journal.h"
 
-#define NBR_CMDS 13
-#define MAX_SIZE 7*256*SECTOR_SIZE
+#define NBR_CMDS 21
 
 /*
  * Definition of the shell errors
@@ -38,6 +45,7 @@ const char * const ERR_SHELL_MSG[] = {
 };
 
 struct unix_filesystem u;
+char disk_name[FILENAME_MAX]; // nom du disque monté, pour les fichiers annexes
 
 /*
  * Definition of the shell_fct which is a pointer
@@ -69,6 +77,14 @@ int do_istat(char** s);
 int do_mkfs(char** s);
 int do_mkdir(char** s);
 int do_add(char** s);
+int do_import(char** s);
+int do_export(char** s);
+int do_manifest(char** s);
+int do_dedup(char** s);
+int do_merkle(char** s);
+int do_verify(char** s);
+int do_defrag(char** s);
+int do_fsck(char** s);
 
 struct shell_map help_cmd = {"help", do_help, "display this help", 0, ""};
 struct shell_map exit_cmd = {"exit", do_exit, "exit shell", 0, ""};
@@ -78,6 +94,14 @@ struct shell_map mount_cmd = {"mount", do_mount, "mount the provided filesystem"
 struct shell_map mkdir_cmd = {"mkdir", do_mkdir, "create a new directory", 1, " <dirname>"};
 struct shell_map lsall_cmd = {"lsall", do_lsall, "list all directories and files contained in the currently mounted filesystem", 0, ""};
 struct shell_map add_cmd = {"add", do_add, "add a new file", 2, " <src-fullpath> <dst>"};
+struct shell_map import_cmd = {"import", do_import, "import the content of a host directory, recursively", 2, " <host-dir> <dst>"};
+struct shell_map export_cmd = {"export", do_export, "export the content of a directory to the host, recursively", 2, " <src> <host-dir>"};
+struct shell_map manifest_cmd = {"manifest", do_manifest, "write the sorted list of the SHA of all the files", 1, " <host-file>"};
+struct shell_map dedup_cmd = {"dedup", do_dedup, "list the duplicate files and the space sharing identical content would save", 0, ""};
+struct shell_map merkle_cmd = {"merkle", do_merkle, "update the Merkle tree of a file in the sidecar of the disk", 1, " <pathname>"};
+struct shell_map verify_cmd = {"verify", do_verify, "check a file against its Merkle tree", 1, " <pathname>"};
+struct shell_map defrag_cmd = {"defrag", do_defrag, "move each fragmented file into contiguous sectors", 0, ""};
+struct shell_map fsck_cmd = {"fsck", do_fsck, "check the consistency of the filesystem, and repair it with repair", 1, " [repair]"};
 struct shell_map cat_cmd = {"cat", do_cat, "display the content of a file", 1, " <pathname>"};
 struct shell_map istat_cmd = {"istat", do_istat, "display information about the provided inode", 1, " <inode_nr>"};
 struct shell_map ino_cmd = {"inode", do_inode, "display the inode number of a file", 1, " <pathname>"};
@@ -104,6 +128,14 @@ void construct_shell_cmds()
     shell_cmds[10] = ino_cmd;
     shell_cmds[11] = sha_cmd;
     shell_cmds[12] = psb_cmd;
+    shell_cmds[13] = import_cmd;
+    shell_cmds[14] = export_cmd;
+    shell_cmds[15] = manifest_cmd;
+    shell_cmds[16] = dedup_cmd;
+    shell_cmds[17] = merkle_cmd;
+    shell_cmds[18] = verify_cmd;
+    shell_cmds[19] = defrag_cmd;
+    shell_cmds[20] = fsck_cmd;
 }
 
 /**
@@ -180,7 +212,9 @@ int do_mount(char** s)
     if ((err= args_test(s))!=1) {
         return WRONG_NBR_ARGS;
     }
+    if(u.f!=NULL) umountv6(&u);
     err=mountv6(s[1],&u);
+    if(err==0) snprintf(disk_name, sizeof(disk_name), "%s", s[1]);
     return err;
 }
 
@@ -238,7 +272,6 @@ int do_cat(char** s)
     struct filev6 fs;
     memset(&fs, 255, sizeof(fs));
     uint8_t secteur[SECTOR_SIZE];
-    secteur[SECTOR_SIZE] = '\0';
     if((err = filev6_open(&u,inode_nbr,&fs))!=0) {
         return err;
     }
@@ -246,7 +279,7 @@ int do_cat(char** s)
         return CAT_DIR;
     } else {
 		while((err = filev6_readblock(&fs,secteur))>0){
-			printf("%s",secteur);
+			fwrite(secteur,1,err,stdout);
 		}
 		if(err<0) {
 				return err;
@@ -279,6 +312,111 @@ int do_sha(char** s)
     return 0;
 }
 
+/**
+ * @brief writes to a local file the SHA of every file of the mounted unix filesystem
+ * @param s contains the input (name of the command + args)
+ * @return 0 on success; >0 for a shell error or <0 on an fs error
+ */
+int do_manifest(char** s)
+{
+    int err =0;
+    if ((err= args_test(s))!=1) {
+        return WRONG_NBR_ARGS;
+    }
+    if(u.f==NULL) {
+        return NOT_MOUNTED;
+    }
+    FILE* sortie = fopen(s[1],"w");
+    if(sortie==NULL) return ERR_IO;
+    err = sha_manifest(&u, sortie);
+    if(fclose(sortie)!=0 && err==0) err = ERR_IO;
+    return err;
+}
+
+/**
+ * @brief prints the groups of identical files and what sharing their content would reclaim
+ * @param s contains the input (name of the command + args)
+ * @return 0 on success; >0 for a shell error or <0 on an fs error
+ */
+int do_dedup(char** s)
+{
+    int err =0;
+    if ((err= args_test(s))!=0) {
+        return WRONG_NBR_ARGS;
+    }
+    if(u.f==NULL) {
+        return NOT_MOUNTED;
+    }
+    struct sha_dedup_stats stats;
+    if((err = sha_dedup(&u, stdout, &stats))<0) return err;
+    printf("files: %u, duplicates: %u, reclaimable: %" PRIu64 " bytes\n",
+           stats.files, stats.dup_files, stats.file_reclaimable);
+    printf("sectors: %u, duplicates: %u, reclaimable: %" PRIu64 " bytes\n",
+           stats.sectors, stats.dup_sectors, stats.sector_reclaimable);
+    return 0;
+}
+
+/**
+ * @brief updates the Merkle tree of a file and saves it in the sidecar of the disk
+ * @param s contains the input (name of the command + args)
+ * @return 0 on success; >0 for a shell error or <0 on an fs error
+ */
+int do_merkle(char** s)
+{
+    int err =0;
+    if ((err= args_test(s))!=1) {
+        return WRONG_NBR_ARGS;
+    }
+    if(u.f==NULL) {
+        return NOT_MOUNTED;
+    }
+    int inode_nbr = direntv6_dirlookup(&u, ROOT_INUMBER, s[1]);
+    if(inode_nbr<0) return inode_nbr;
+    struct merkle_store store;
+    if((err = merkle_store_load(&u, disk_name, &store))<0) return err;
+    int hashed = merkle_update(&u, &store, inode_nbr);
+    if(hashed<0) {
+        err = hashed;
+    } else if((err = merkle_store_save(&store))==0) {
+        char root[2*SHA256_DIGEST_LENGTH+1];
+        for(int i=0; i<SHA256_DIGEST_LENGTH; ++i) {
+            sprintf(&root[2*i], "%02x", store.trees[inode_nbr]->root[i]);
+        }
+        printf("%s: root %s (%d of %d sectors hashed)\n", s[1], root, hashed, store.trees[inode_nbr]->nb_leaves);
+    }
+    merkle_store_free(&store);
+    return err;
+}
+
+/**
+ * @brief checks the content of a file against the Merkle tree saved for it
+ * @param s contains the input (name of the command + args)
+ * @return 0 on success; >0 for a shell error or <0 on an fs error
+ */
+int do_verify(char** s)
+{
+    int err =0;
+    if ((err= args_test(s))!=1) {
+        return WRONG_NBR_ARGS;
+    }
+    if(u.f==NULL) {
+        return NOT_MOUNTED;
+    }
+    int inode_nbr = direntv6_dirlookup(&u, ROOT_INUMBER, s[1]);
+    if(inode_nbr<0) return inode_nbr;
+    struct merkle_store store;
+    if((err = merkle_store_load(&u, disk_name, &store))<0) return err;
+    int diffs = merkle_verify(&u, &store, inode_nbr, stdout);
+    merkle_store_free(&store);
+    if(diffs<0) return diffs;
+    if(diffs==0) {
+        printf("%s: OK\n", s[1]);
+    } else {
+        printf("%s: %d sectors differ\n", s[1], diffs);
+    }
+    return 0;
+}
+
 /**
  * @brief prints the content of an inode
  * @param s contains the input (name of the command + args)
@@ -386,6 +524,17 @@ int do_add(char** s)
     FILE* entree = fopen(child,"rb");
     if(entree==NULL) return ERR_IO;
     
+    /* The size is known up front so that the target sectors can be allocated at once */
+    long size_file = 0;
+    if((fseek(entree,0,SEEK_END)!=0)||((size_file=ftell(entree))<0)||(fseek(entree,0,SEEK_SET)!=0)) {
+        fclose(entree);
+        return ERR_IO;
+    }
+    if(size_file>MAX_SIZE_FILE) {
+        fclose(entree);
+        return ERR_FILE_TOO_LARGE;
+    }
+    
     /* Get the right name */
     char* last_directory = strrchr(child,'/');
     char* child_name =NULL;
@@ -395,36 +544,149 @@ int do_add(char** s)
 		child_name = last_directory+1;
 	}
     
-    strcat(parent,"/");
-    char* new = strcat(parent,child_name);
+    char new[MAXPATHLEN_UV6+1];
+    if(snprintf(new,sizeof(new),"%s/%s",parent,child_name)>=(int)sizeof(new)) {
+        fclose(entree);
+        return ERR_FILENAME_TOO_LONG;
+    }
     
     int child_inode = 0;
-    if((child_inode = direntv6_create(&u, new, file_mode))<0) return child_inode;
-    
-    char data[MAX_SIZE];
-    size_t size_file = 0;
-    
-    if(fseek(entree,0,SEEK_SET)!=0) {
-        return ERR_IO;
-    }
-    int index =0;
-    while(!feof(entree) && !ferror(stdin)){
-		size_file += fread(&data[index],sizeof(char),1,entree);
-		++index;
+    if((child_inode = direntv6_create(&u, new, file_mode))<0) {
+        fclose(entree);
+        return child_inode;
     }
     
     /* initialisation */
     struct filev6 fv6_child;
     memset(&fv6_child,0,sizeof(fv6_child));
-    if((err=filev6_open(&u, child_inode, &fv6_child))<0) return err;
-     
-    if((err=filev6_writebytes(&u, &fv6_child, data, size_file))<0) return err;
+    if((err=filev6_open(&u, child_inode, &fv6_child))>=0) {
+        /* the host file is streamed by chunks, whatever its size */
+        err=filev6_import(&u, &fv6_child, entree, (int32_t)size_file);
+    }
+    fclose(entree);
+    if(err<0) return err;
     
     return 0;
    
 }
 
 
+/**
+ * @brief imports a local directory tree into the mounted unix filesystem
+ * @param s contains the input (name of the command + args)
+ * @return 0 on success; >0 for a shell error or <0 on an fs error
+ */
+int do_import(char** s)
+{
+    int err =0;
+    if ((err= args_test(s))!=2) {
+        return WRONG_NBR_ARGS;
+    }
+    if(u.f==NULL) {
+        return NOT_MOUNTED;
+    }
+    int dst_inode = 0;
+    if((dst_inode=direntv6_dirlookup(&u,ROOT_INUMBER,s[2]))<0) return dst_inode;
+
+    struct import_stats stats;
+    err = import_tree(&u, s[1], (uint16_t)dst_inode, &stats);
+    if(err<0) return err;
+
+    double secs = (stats.seconds>0) ? stats.seconds : 1e-9;
+    printf("imported %u files and %u directories (%" PRIu64 " bytes, %u skipped) in %.3f s: %.1f files/s, %.2f MB/s\n",
+           stats.files, stats.dirs, stats.bytes, stats.skipped, stats.seconds,
+           stats.files/secs, stats.bytes/secs/1e6);
+    return 0;
+}
+
+/**
+ * @brief exports a directory tree of the mounted unix filesystem to the host
+ * @param s contains the input (name of the command + args)
+ * @return 0 on success; >0 for a shell error or <0 on an fs error
+ */
+int do_export(char** s)
+{
+    int err =0;
+    if ((err= args_test(s))!=2) {
+        return WRONG_NBR_ARGS;
+    }
+    if(u.f==NULL) {
+        return NOT_MOUNTED;
+    }
+    int src_inode = 0;
+    if((src_inode=direntv6_dirlookup(&u,ROOT_INUMBER,s[1]))<0) return src_inode;
+
+    struct export_stats stats;
+    err = export_tree(&u, (uint16_t)src_inode, s[2], &stats);
+    if(err<0) return err;
+
+    double secs = (stats.seconds>0) ? stats.seconds : 1e-9;
+    printf("exported %u files and %u directories (%" PRIu64 " bytes) in %.3f s: %.1f files/s, %.2f MB/s\n",
+           stats.files, stats.dirs, stats.bytes, stats.seconds,
+           stats.files/secs, stats.bytes/secs/1e6);
+    return 0;
+}
+
+/**
+ * @brief moves each fragmented file into contiguous sectors and reports the
+ *        fragmentation and the read throughput before and after
+ * @param s contains the input (name of the command + args)
+ * @return 0 on success; >0 for a shell error or <0 on an fs error
+ */
+int do_defrag(char** s)
+{
+    int err =0;
+    if ((err= args_test(s))!=0) {
+        return WRONG_NBR_ARGS;
+    }
+    if(u.f==NULL) {
+        return NOT_MOUNTED;
+    }
+    struct defrag_stats stats;
+    if((err = defrag_all(&u, &stats))<0) return err;
+    printf("files: %u, fragmented: %u, moved: %u (%" PRIu64 " sectors in %.3f s), no room: %u\n",
+           stats.files, stats.fragmented, stats.moved, stats.sectors_moved, stats.seconds, stats.no_room);
+    printf("extents per file: %.2f before, %.2f after\n",
+           stats.files ? (double)stats.extents_before/stats.files : 0.0,
+           stats.files ? (double)stats.extents_after/stats.files : 0.0);
+    printf("sequential read of the fragmented files: %.2f MB/s before, %.2f MB/s after\n",
+           stats.read_before, stats.read_after);
+    return 0;
+}
+
+/**
+ * @brief checks the consistency of the filesystem and prints the problems
+ *        found, then repairs them if asked to
+ * @param s contains the input (name of the command + args)
+ * @return 0 on success; >0 for a shell error or <0 on an fs error
+ */
+int do_fsck(char** s)
+{
+    int err = args_test(s);
+    if (err>1 || (err==1 && strcmp(s[1],"repair")!=0)) {
+        return WRONG_NBR_ARGS;
+    }
+    if(u.f==NULL) {
+        return NOT_MOUNTED;
+    }
+    int repair = (err==1);
+    struct fsck_stats stats;
+    if((err = fsck_check(&u, repair, stdout, &stats))<0) return err;
+    printf("checked %u inodes (%u directories, %" PRIu64 " entries, %" PRIu64 " sectors) with %d threads in %.3f s\n",
+           stats.inodes, stats.dirs, stats.entries, stats.sectors, FSCK_THREADS, stats.seconds);
+    unsigned int found=0;
+    for(int k=0; k<FSCK_LAST; ++k) {
+        if(stats.problems[k]>0) printf("%6u %s\n", stats.problems[k], FSCK_KIND_NAMES[k]);
+        found+=stats.problems[k];
+    }
+    if(repair) {
+        printf("problems: %u found, %u left after %u passes\n", found, stats.remaining, stats.passes);
+    } else {
+        printf("problems: %u found\n", found);
+    }
+    return 0;
+}
+
 /**
  * @brief splits the input into words and puts them in s
  * @param s will contain the tokenized input (name of the command + args)
@@ -489,6 +751,11 @@ int main(int argc, char *argv[])
 				}
 				shell_fct ptr = shell_cmds[index].fct;
 				error = (*ptr)(s);
+				/* une commande est durable quand l'invite revient */
+				if((u.f!=NULL)&&(journal_pending(&u)>0)) {
+					int err = journal_commit(&u);
+					if(error==0) error = err;
+				}
 			}
 			if (error>0) {
 				printf("\nERROR SHELL:");
@@ -503,5 +770,7 @@ int main(int argc, char *argv[])
         free(s);
         s = NULL;
     }
+    /* fin de l'entrée : le disque est démonté comme par exit */
+    if(u.f != NULL) umountv6(&u);
     return error;
 }
@@ -20,6 +20,13 @@ int main (void){
 	}
 	bm_print(bmblock);
 	printf("find_next() = %d\n",bm_find_next(bmblock));
+	bm_set(bmblock,6);
+	bm_clear(bmblock,5);
+	printf("find_next_from(100) = %d, find_next_from(131) = %d\n",bm_find_next_from(bmblock,100),bm_find_next_from(bmblock,131));
+	printf("find_run(3) = %d, find_run(200) = %d\n",bm_find_run(bmblock,3),bm_find_run(bmblock,200));
+	uint64_t counted = bm_count_free(bmblock);
+	bm_recount(bmblock);
+	printf("free = %lu (recount: %lu)\n",counted,bm_count_free(bmblock));
 	bm_free(bmblock);
 	return 0;
 }
@@ -0,0 +1,144 @@
+/**
+ * @file test-concurrent.c
+ * @brief reads all the files of a filesystem from several threads at once,
+ *        through open file handles as the FUSE daemon does, checks that every
+ *        thread sees the content read by filev6_readblock and measures the
+ *        read throughput for 1 to MAX_THREADS threads
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "unixv6fs.h"
+#include "mount.h"
+#include "inode.h"
+#include "error.h"
+#include "filev6.h"
+#include "direntv6.h"
+
+#define MAX_THREADS 8
+#define ROUNDS 4
+#define CHUNK_SIZE (128*1024)
+
+struct reader {
+    struct unix_filesystem *u;
+    const uint16_t *files;    /* the regular files of the filesystem */
+    int nb_files;
+    int first;                /* each thread starts at another file */
+    uint64_t bytes;           /* number of bytes read (OUT) */
+    uint64_t sum;             /* checksum of what has been read (OUT) */
+    int err;                  /* first error met (OUT) */
+};
+
+/**
+ * @brief elapsed time in seconds since start
+ */
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief thread which reads ROUNDS times every file by chunks of CHUNK_SIZE
+ *        bytes, under the shared lock as the FUSE callbacks do
+ */
+static void *reader_run(void *arg)
+{
+    struct reader *r = arg;
+    uint8_t *chunk = malloc(CHUNK_SIZE);
+    if (chunk == NULL) r->err = ERR_NOMEM;
+    for (int round = 0; (round < ROUNDS) && (r->err == 0); ++round) {
+        for (int k = 0; (k < r->nb_files) && (r->err == 0); ++k) {
+            uint16_t inr = r->files[(r->first + k) % r->nb_files];
+            struct filev6_handle *h = NULL;
+            mountv6_lock_shared(r->u);
+            r->err = filev6_handle_open(r->u, inr, &h);
+            mountv6_unlock(r->u);
+            int read = 1;
+            for (int32_t offset = 0; (r->err == 0) && (read > 0); offset += read) {
+                mountv6_lock_shared(r->u);
+                read = filev6_handle_read(h, chunk, CHUNK_SIZE, offset);
+                mountv6_unlock(r->u);
+                if (read < 0) r->err = read;
+                for (int i = 0; i < read; ++i) {
+                    r->sum += chunk[i];
+                }
+                if (read > 0) r->bytes += read;
+            }
+            filev6_handle_close(h);
+        }
+    }
+    free(chunk);
+    return NULL;
+}
+
+/**
+ * @brief checksum of all the files, read sector by sector with filev6_readblock
+ */
+static uint64_t reference_sum(struct unix_filesystem *u, const uint16_t *files, int nb_files)
+{
+    uint64_t sum = 0;
+    uint8_t secteur[SECTOR_SIZE];
+    for (int k = 0; k < nb_files; ++k) {
+        struct filev6 fv6;
+        int read = 0;
+        if (filev6_open(u, files[k], &fv6) < 0) continue;
+        while ((read = filev6_readblock(&fv6, secteur)) > 0) {
+            for (int i = 0; i < read; ++i) {
+                sum += secteur[i];
+            }
+        }
+    }
+    return ROUNDS * sum;
+}
+
+int test(struct unix_filesystem *u)
+{
+    int nb_inodes = u->s.s_isize * INODES_PER_SECTOR;
+    uint16_t *files = calloc(nb_inodes, sizeof(uint16_t));
+    if (files == NULL) return ERR_NOMEM;
+    int nb_files = 0;
+    for (int inr = ROOT_INUMBER; inr < nb_inodes; ++inr) {
+        struct inode ino;
+        if ((inode_read(u, inr, &ino) == 0) && ((ino.i_mode & IFMT) != IFDIR)) files[nb_files++] = inr;
+    }
+
+    printf("\nConcurrent reads of %d files, %d rounds:\n", nb_files, ROUNDS);
+    int err = 0;
+    uint64_t expected = reference_sum(u, files, nb_files);
+    for (int nb_threads = 1; (nb_threads <= MAX_THREADS) && (err == 0); nb_threads *= 2) {
+        struct reader readers[MAX_THREADS];
+        pthread_t threads[MAX_THREADS];
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        /* only the threads which could be started are joined */
+        int started = 0;
+        for (int t = 0; (t < nb_threads) && (err == 0); ++t) {
+            readers[t] = (struct reader) {
+                u, files, nb_files, t * nb_files / nb_threads, 0, 0, 0
+            };
+            if (pthread_create(&threads[t], NULL, reader_run, &readers[t]) != 0) err = ERR_NOMEM;
+            else ++started;
+        }
+        uint64_t bytes = 0;
+        for (int t = 0; t < started; ++t) {
+            pthread_join(threads[t], NULL);
+            if (readers[t].err < 0) err = readers[t].err;
+            if (readers[t].sum != expected) {
+                printf("thread %d read different content\n", t);
+                err = ERR_IO;
+            }
+            bytes += readers[t].bytes;
+        }
+        double secs = elapsed(&start);
+        printf("%d thread(s): %10llu bytes in %8.3f ms, %8.2f MB/s\n", nb_threads,
+               (unsigned long long) bytes, secs * 1e3, secs > 0 ? bytes / secs / 1e6 : 0.0);
+    }
+
+    free(files);
+    return err;
+}
@@ -49,6 +49,10 @@ int test(struct unix_filesystem *u)
         print_sha_inode(u,fs.i_node,i);
     }
 
+    printf("\nManifest:\n");
+    int err = sha_manifest(u, stdout);
+    if (err < 0) return err;
+
 
     return 0;
 }
@@ -0,0 +1,221 @@
+/**
+ * @file test-write.c
+ * @brief tests the write path of filev6.c (appends, and random writes and
+ *        truncations through the write-back cache of open handles) and
+ *        measures its throughput
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "unixv6fs.h"
+#include "inode.h"
+#include "error.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "bmblock.h"
+#include "journal.h"
+
+#define NB_TESTS 6
+#define CHUNK_SIZE (16*SECTOR_SIZE)
+
+/**
+ * @brief elapsed time in seconds since start
+ */
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief creates the file name, writes size bytes to it by chunks of chunk bytes,
+ *        reads it back and prints the write throughput
+ * @return 0 on success; <0 on error
+ */
+static int test_write_file(struct unix_filesystem *u, const char *name, const uint8_t *data, int size, int chunk)
+{
+    int err = 0;
+    int inr = direntv6_create(u, name, IALLOC);
+    if (inr < 0) return inr;
+
+    struct filev6 fv6;
+    if ((err = filev6_open(u, inr, &fv6)) < 0) return err;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int written = 0; written < size; written += chunk) {
+        int len = (size - written < chunk) ? size - written : chunk;
+        if ((err = filev6_writebytes(u, &fv6, (void *)(data + written), len)) < 0) return err;
+    }
+    double secs = elapsed(&start);
+
+    /* read back through a freshly opened file */
+    if ((err = filev6_open(u, inr, &fv6)) < 0) return err;
+    if (inode_getsize(&fv6.i_node) != size) {
+        printf("%s: size %d instead of %d\n", name, inode_getsize(&fv6.i_node), size);
+        return ERR_IO;
+    }
+    uint8_t secteur[SECTOR_SIZE];
+    int offset = 0;
+    while ((err = filev6_readblock(&fv6, secteur)) > 0) {
+        if (memcmp(secteur, data + offset, err) != 0) {
+            printf("%s: content differs at offset %d\n", name, offset);
+            return ERR_IO;
+        }
+        offset += err;
+    }
+    if (err < 0) return err;
+
+    printf("%-10s inode %3d size %7d chunk %6d: %8.3f ms, %8.2f MB/s\n",
+           name, inr, size, chunk, secs * 1e3, secs > 0 ? size / secs / 1e6 : 0.0);
+    return 0;
+}
+
+/**
+ * @brief number of sectors in use according to the free bitmap
+ */
+static int used_sectors(const struct unix_filesystem *u)
+{
+    int used = 0;
+    for (uint64_t i = u->fbm->min; i <= u->fbm->max; ++i) {
+        used += (bm_get(u->fbm, i) == 1);
+    }
+    return used;
+}
+
+/**
+ * @brief flushes the handle, then checks the file on disk against the model
+ * @return 0 on success; <0 on error
+ */
+static int check_handle(struct unix_filesystem *u, struct filev6_handle *h, const uint8_t *model, int size,
+                        const char *step)
+{
+    int err = filev6_handle_flush(u, h);
+    if (err < 0) return err;
+    uint8_t *back = calloc(size + SECTOR_SIZE, 1);
+    if (back == NULL) return ERR_NOMEM;
+    struct filev6 fv6;
+    int offset = 0;
+    if ((err = filev6_open(u, h->fv6.i_number, &fv6)) == 0) {
+        while ((err = filev6_readblock(&fv6, back + offset)) > 0) offset += err;
+    }
+    if (err == 0 && (offset != size || memcmp(back, model, size) != 0)) {
+        printf("%s: content differs (size %d instead of %d)\n", step, offset, size);
+        err = ERR_IO;
+    }
+    if (err == 0 && ((size > ADDR_SMALL_LENGTH * SECTOR_SIZE) != ((fv6.i_node.i_mode & ILARG) != 0))) {
+        printf("%s: wrong layout\n", step);
+        err = ERR_IO;
+    }
+    free(back);
+    if (err == 0) printf("%-40s size %7d: OK\n", step, size);
+    return err;
+}
+
+/**
+ * @brief random writes, overwrites, holes and truncations through a handle
+ * @return 0 on success; <0 on error
+ */
+static int test_handle(struct unix_filesystem *u)
+{
+    int used = used_sectors(u);
+    int inr = direntv6_create(u, "/ha", IALLOC);
+    if (inr < 0) return inr;
+    struct filev6_handle *h = NULL;
+    int err = filev6_handle_open(u, inr, &h);
+    if (err < 0) return err;
+
+    uint8_t *model = calloc(MAX_SIZE_FILE, 1);
+    uint8_t *chunk = malloc(CHUNK_SIZE);
+    if (model == NULL || chunk == NULL) err = ERR_NOMEM;
+
+    /* chunks written in a shuffled order */
+    const int nb_chunks = 200000 / CHUNK_SIZE + 1;
+    int order[nb_chunks];
+    for (int i = 0; i < nb_chunks; ++i) order[i] = i;
+    for (int i = nb_chunks - 1; i > 0; --i) {
+        int j = rand() % (i + 1);
+        int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    int size = 200000;
+    for (int i = 0; i < nb_chunks && err >= 0; ++i) {
+        int offset = order[i] * CHUNK_SIZE;
+        int len = (size - offset < CHUNK_SIZE) ? size - offset : CHUNK_SIZE;
+        for (int k = 0; k < len; ++k) chunk[k] = model[offset + k] = (uint8_t) rand();
+        err = filev6_handle_write(h, chunk, len, offset);
+    }
+    if (err >= 0) err = check_handle(u, h, model, size, "shuffled writes");
+
+    /* overwrite across sector boundaries */
+    for (int k = 0; k < 5000; ++k) chunk[k] = model[12345 + k] = (uint8_t) rand();
+    if (err >= 0) err = filev6_handle_write(h, chunk, 5000, 12345);
+    if (err >= 0) err = check_handle(u, h, model, size, "overwrite");
+
+    /* large to small, then small to large with a hole */
+    if (err >= 0) err = filev6_handle_truncate(h, 3000);
+    memset(model + 3000, 0, size - 3000);
+    size = 3000;
+    if (err >= 0) err = check_handle(u, h, model, size, "truncate to a small file");
+    for (int k = 0; k < 10; ++k) chunk[k] = model[300000 + k] = (uint8_t) rand();
+    size = 300010;
+    if (err >= 0) err = filev6_handle_write(h, chunk, 10, 300000);
+    if (err >= 0) err = check_handle(u, h, model, size, "write after a hole");
+    if (err >= 0) err = filev6_handle_truncate(h, MAX_SIZE_FILE);
+    size = MAX_SIZE_FILE;
+    if (err >= 0) err = check_handle(u, h, model, size, "extend to the largest file");
+
+    /* everything is given back (by the commit) but the data sector of the parent directory */
+    if (err >= 0) err = filev6_handle_truncate(h, 0);
+    if (err >= 0) err = check_handle(u, h, model, 0, "truncate to zero");
+    if (err >= 0) err = journal_commit(u);
+    if (err >= 0 && used_sectors(u) > used + 1) {
+        printf("%d sectors leaked\n", used_sectors(u) - used - 1);
+        err = ERR_IO;
+    }
+
+    filev6_handle_close(h);
+    free(model);
+    free(chunk);
+    return (err < 0) ? err : 0;
+}
+
+int test(struct unix_filesystem *u)
+{
+    const char *names[NB_TESTS] = { "/wa", "/wb", "/wc", "/wd", "/we", "/wf" };
+    const int sizes[NB_TESTS] = {
+        SECTOR_SIZE - 1,
+        ADDR_SMALL_LENGTH * SECTOR_SIZE,
+        ADDR_SMALL_LENGTH * SECTOR_SIZE + 1,
+        100 * 1000,
+        7 * ADDRESSES_PER_SECTOR * SECTOR_SIZE,
+        7 * ADDRESSES_PER_SECTOR * SECTOR_SIZE
+    };
+    const int chunks[NB_TESTS] = { CHUNK_SIZE, CHUNK_SIZE, 1000, CHUNK_SIZE, CHUNK_SIZE,
+                                   7 * ADDRESSES_PER_SECTOR * SECTOR_SIZE
+                                 };
+
+    uint8_t *data = malloc(7 * ADDRESSES_PER_SECTOR * SECTOR_SIZE);
+    if (data == NULL) return ERR_NOMEM;
+    srand(0);
+    for (int i = 0; i < 7 * ADDRESSES_PER_SECTOR * SECTOR_SIZE; ++i) {
+        data[i] = (uint8_t) rand();
+    }
+
+    printf("\nWriting files:\n");
+    int err = 0;
+    for (int i = 0; i < NB_TESTS && err == 0; ++i) {
+        err = test_write_file(u, names[i], data, sizes[i], chunks[i]);
+    }
+
+    free(data);
+    if (err == 0) {
+        printf("\nWriting through a handle:\n");
+        err = test_handle(u);
+    }
+    return err;
+}
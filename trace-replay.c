@@ -0,0 +1,310 @@
+/**
+ * @file trace-replay.c
+ * @brief re-issues the accesses of a sector trace (see sector_trace_open)
+ *        against an image, with several I/O strategies, and reports their
+ *        throughput and latency
+ *
+ * ./trace-replay [-b stdio|pread|mmap|all] [-c cache sectors] [-d] [-t] [-r rounds] <trace> <image>
+ *
+ *  -b  the backend (default: all of them, one after the other)
+ *  -c  puts a direct-mapped, write-through cache of that many sectors in front of the backend
+ *  -d  drops the image from the page cache before each round (cold reads)
+ *  -t  keeps the timing of the trace instead of issuing the I/Os back to back
+ *  -r  number of rounds (default 1)
+ *
+ * The writes of the trace are replayed with a fixed pattern: use a copy of the image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "unixv6fs.h"
+#include "sector.h"
+#include "latency.h"
+
+enum backend { BACKEND_STDIO, BACKEND_PREAD, BACKEND_MMAP, BACKEND_LAST };
+
+static const char * const BACKEND_NAMES[BACKEND_LAST] = { "stdio", "pread", "mmap" };
+
+struct replay {
+    enum backend backend;
+    FILE *f;            /* stdio */
+    int fd;             /* pread */
+    uint8_t *map;       /* mmap */
+    size_t size;        /* of the image, in bytes */
+    uint32_t cache_nb;  /* number of sectors of the cache, 0 without cache */
+    uint32_t *tags;     /* sector held by each cache slot, UINT32_MAX if none */
+    uint8_t *cache;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/**
+ * @brief reads or writes nb sectors from sector with the backend, without the cache
+ * @return 0 on success; -1 on error
+ */
+static int backend_io(struct replay *r, int write, uint32_t sector, uint32_t nb, uint8_t *buf)
+{
+    size_t len = (size_t) nb * SECTOR_SIZE;
+    off_t off = (off_t) sector * SECTOR_SIZE;
+    if ((size_t) off + len > r->size) return -1;
+    switch (r->backend) {
+    case BACKEND_STDIO:
+        if (fseeko(r->f, off, SEEK_SET) != 0) return -1;
+        if (write) return (fwrite(buf, len, 1, r->f) == 1) ? 0 : -1;
+        return (fread(buf, len, 1, r->f) == 1) ? 0 : -1;
+    case BACKEND_PREAD:
+        if (write) return (pwrite(r->fd, buf, len, off) == (ssize_t) len) ? 0 : -1;
+        return (pread(r->fd, buf, len, off) == (ssize_t) len) ? 0 : -1;
+    default:
+        if (write) memcpy(r->map + off, buf, len);
+        else memcpy(buf, r->map + off, len);
+        return 0;
+    }
+}
+
+/**
+ * @brief one access of the trace, through the cache if there is one
+ * @return 0 on success; -1 on error
+ */
+static int replay_io(struct replay *r, int write, uint32_t sector, uint32_t nb, uint8_t *buf)
+{
+    if (r->cache_nb == 0) return backend_io(r, write, sector, nb, buf);
+    if (write) {
+        /* write-through: the cached copies are updated */
+        for (uint32_t k = 0; k < nb; ++k) {
+            uint32_t slot = (sector + k) % r->cache_nb;
+            r->tags[slot] = sector + k;
+            memcpy(r->cache + (size_t) slot * SECTOR_SIZE, buf + (size_t) k * SECTOR_SIZE, SECTOR_SIZE);
+        }
+        return backend_io(r, 1, sector, nb, buf);
+    }
+    /* the missing sectors are read by runs, as they would be without cache */
+    for (uint32_t k = 0; k < nb; ) {
+        uint32_t slot = (sector + k) % r->cache_nb;
+        if (r->tags[slot] == sector + k) {
+            memcpy(buf + (size_t) k * SECTOR_SIZE, r->cache + (size_t) slot * SECTOR_SIZE, SECTOR_SIZE);
+            ++r->hits;
+            ++k;
+            continue;
+        }
+        uint32_t last = k + 1;
+        while ((last < nb) && (r->tags[(sector + last) % r->cache_nb] != sector + last)) ++last;
+        if (backend_io(r, 0, sector + k, last - k, buf + (size_t) k * SECTOR_SIZE) != 0) return -1;
+        for (; k < last; ++k) {
+            slot = (sector + k) % r->cache_nb;
+            r->tags[slot] = sector + k;
+            memcpy(r->cache + (size_t) slot * SECTOR_SIZE, buf + (size_t) k * SECTOR_SIZE, SECTOR_SIZE);
+            ++r->misses;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief opens the image for a backend, and empties the cache
+ * @return 0 on success; -1 on error
+ */
+static int replay_open(struct replay *r, const char *image, enum backend b, int drop)
+{
+    r->backend = b;
+    r->fd = open(image, O_RDWR);
+    if (r->fd < 0) return -1;
+    struct stat st;
+    if (fstat(r->fd, &st) != 0) return -1;
+    r->size = st.st_size;
+    if (drop) {
+        fdatasync(r->fd);
+        posix_fadvise(r->fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    if (b == BACKEND_STDIO) {
+        r->f = fdopen(r->fd, "r+b");
+        if (r->f == NULL) return -1;
+    } else if (b == BACKEND_MMAP) {
+        r->map = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+        if (r->map == MAP_FAILED) return -1;
+    }
+    if (r->cache_nb > 0) memset(r->tags, 0xff, r->cache_nb * sizeof(uint32_t));
+    r->hits = r->misses = 0;
+    return 0;
+}
+
+static void replay_close(struct replay *r)
+{
+    if (r->backend == BACKEND_MMAP) {
+        msync(r->map, r->size, MS_SYNC);
+        munmap(r->map, r->size);
+    }
+    if (r->f != NULL) fclose(r->f);
+    else close(r->fd);
+    r->f = NULL;
+    r->map = NULL;
+}
+
+/**
+ * @brief loads all the records of a trace
+ * @return the number of records; -1 on error
+ */
+static long trace_load(const char *filename, struct sector_trace_record **records, uint32_t *max_nb)
+{
+    FILE *in = fopen(filename, "rb");
+    if (in == NULL) return -1;
+    char magic[sizeof(SECTOR_TRACE_MAGIC) - 1];
+    if ((fread(magic, sizeof(magic), 1, in) != 1) || (memcmp(magic, SECTOR_TRACE_MAGIC, sizeof(magic)) != 0)) {
+        fclose(in);
+        return -1;
+    }
+    long n = 0, capacity = 1024;
+    *records = malloc(capacity * sizeof(struct sector_trace_record));
+    *max_nb = 1;
+    while (*records != NULL && fread(&(*records)[n], sizeof(struct sector_trace_record), 1, in) == 1) {
+        if ((*records)[n].nb > *max_nb) *max_nb = (*records)[n].nb;
+        if (++n == capacity) {
+            capacity *= 2;
+            struct sector_trace_record *more = realloc(*records, capacity * sizeof(struct sector_trace_record));
+            if (more == NULL) {
+                free(*records);
+                *records = NULL;
+            } else {
+                *records = more;
+            }
+        }
+    }
+    fclose(in);
+    return (*records == NULL) ? -1 : n;
+}
+
+/**
+ * @brief waits until the time ns after start
+ */
+static void wait_until(uint64_t start, uint64_t ns)
+{
+    uint64_t now = latency_now();
+    if (now - start >= ns) return;
+    uint64_t delay = ns - (now - start);
+    struct timespec t = { (time_t) (delay / 1000000000u), (long) (delay % 1000000000u) };
+    nanosleep(&t, NULL);
+}
+
+/**
+ * @brief prints how to call the program
+ * @return the exit code of a bad call
+ */
+static int usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-b stdio|pread|mmap|all] [-c cache sectors] [-d] [-t] [-r rounds] <trace> <image>\n", prog);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int first_backend = 0, last_backend = BACKEND_LAST - 1;
+    uint32_t cache_nb = 0;
+    int drop = 0, timed = 0, rounds = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:c:dtr:")) != -1) {
+        switch (opt) {
+        case 'b':
+            first_backend = 0;
+            last_backend = BACKEND_LAST - 1;
+            if (strcmp(optarg, "all") != 0) {
+                first_backend = -1;
+                for (int b = 0; b < BACKEND_LAST; ++b) {
+                    if (strcmp(optarg, BACKEND_NAMES[b]) == 0) first_backend = last_backend = b;
+                }
+                if (first_backend < 0) {
+                    fprintf(stderr, "%s: unknown backend %s\n", argv[0], optarg);
+                    return usage(argv[0]);
+                }
+            }
+            break;
+        case 'c':
+            cache_nb = (uint32_t) strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            drop = 1;
+            break;
+        case 't':
+            timed = 1;
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2) {
+        return usage(argv[0]);
+    }
+
+    struct sector_trace_record *records = NULL;
+    uint32_t max_nb = 0;
+    long nb_records = trace_load(argv[optind], &records, &max_nb);
+    if (nb_records < 0) {
+        fprintf(stderr, "%s: not a sector trace\n", argv[optind]);
+        return 1;
+    }
+    uint8_t *buf = malloc((size_t) max_nb * SECTOR_SIZE);
+    struct replay r;
+    memset(&r, 0, sizeof(r));
+    r.cache_nb = cache_nb;
+    if (cache_nb > 0) {
+        r.tags = malloc(cache_nb * sizeof(uint32_t));
+        r.cache = malloc((size_t) cache_nb * SECTOR_SIZE);
+    }
+    if (buf == NULL || (cache_nb > 0 && (r.tags == NULL || r.cache == NULL))) return 1;
+    memset(buf, 0xa5, (size_t) max_nb * SECTOR_SIZE);
+
+    printf("%ld I/Os, cache %u sectors%s%s\n", nb_records, cache_nb, drop ? ", cold" : "",
+           timed ? ", trace timing" : "");
+    printf("%-6s %10s %10s %10s %10s %10s %10s %10s (us)\n",
+           "", "MB/s", "IOPS", "mean", "p50", "p99", "p99.9", "max");
+    for (int b = first_backend; b <= last_backend; ++b) {
+        struct latency_hist *h = calloc(1, sizeof(struct latency_hist));
+        if (h == NULL) return 1;
+        uint64_t bytes = 0, elapsed = 0, hits = 0, misses = 0;
+        int err = 0;
+        for (int round = 0; (round < rounds) && !err; ++round) {
+            if (replay_open(&r, argv[optind + 1], b, drop) != 0) {
+                perror(argv[optind + 1]);
+                return 1;
+            }
+            uint64_t start = latency_now();
+            for (long i = 0; (i < nb_records) && !err; ++i) {
+                if (timed) wait_until(start, records[i].ns);
+                uint64_t t = latency_now();
+                err = replay_io(&r, records[i].write, records[i].sector, records[i].nb, buf);
+                latency_record(h, latency_now() - t);
+                bytes += (uint64_t) records[i].nb * SECTOR_SIZE;
+            }
+            elapsed += latency_now() - start;
+            hits += r.hits;
+            misses += r.misses;
+            replay_close(&r);
+        }
+        if (err) {
+            fprintf(stderr, "%s: I/O error (is the trace from this image?)\n", BACKEND_NAMES[b]);
+            return 1;
+        }
+        double secs = elapsed / 1e9;
+        printf("%-6s %10.1f %10.0f %10.2f %10.2f %10.2f %10.2f %10.2f", BACKEND_NAMES[b],
+               secs > 0 ? bytes / secs / 1e6 : 0.0, secs > 0 ? h->count / secs : 0.0,
+               h->count ? h->sum / 1e3 / h->count : 0.0, latency_percentile(h, 0.50) / 1e3,
+               latency_percentile(h, 0.99) / 1e3, latency_percentile(h, 0.999) / 1e3, h->max / 1e3);
+        if (cache_nb > 0) printf("  hits %.1f %%", hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+        printf("\n");
+        free(h);
+    }
+    free(r.tags);
+    free(r.cache);
+    free(records);
+    free(buf);
+    return 0;
+}
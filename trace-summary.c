@@ -0,0 +1,120 @@
+/**
+ * @file trace-summary.c
+ * @brief summarizes a sector trace (see sector_trace_open): I/Os per layer,
+ *        access pattern and hottest sectors
+ *
+ * ./trace-summary <trace> [number of hot sectors]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "sector.h"
+
+/* the sector numbers of a v6 filesystem are 16 bits */
+#define MAX_SECTORS 65536
+#define DEFAULT_TOP 10
+
+struct sector_heat {
+    uint32_t sector;
+    uint64_t count;                     /* number of I/Os including this sector */
+    uint64_t by_tag[SECTOR_TAG_LAST];
+};
+
+static int heat_cmp(const void *a, const void *b)
+{
+    const struct sector_heat *x = a;
+    const struct sector_heat *y = b;
+    if (x->count != y->count) return (x->count < y->count) ? 1 : -1;
+    return (x->sector > y->sector) - (x->sector < y->sector);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <trace> [number of hot sectors]\n", argv[0]);
+        return 1;
+    }
+    int top = (argc > 2) ? atoi(argv[2]) : DEFAULT_TOP;
+    FILE *in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    char magic[sizeof(SECTOR_TRACE_MAGIC) - 1];
+    if ((fread(magic, sizeof(magic), 1, in) != 1) || (memcmp(magic, SECTOR_TRACE_MAGIC, sizeof(magic)) != 0)) {
+        fprintf(stderr, "%s: not a sector trace\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+    struct sector_heat *heat = calloc(MAX_SECTORS, sizeof(struct sector_heat));
+    uint8_t *seen = calloc(MAX_SECTORS, 1);
+    if (heat == NULL || seen == NULL) {
+        fclose(in);
+        return 1;
+    }
+
+    uint64_t ios[2][SECTOR_TAG_LAST] = {{0}};
+    uint64_t sectors[2][SECTOR_TAG_LAST] = {{0}};
+    uint64_t nb_ios = 0, sequential = 0, first_touch = 0, seek = 0, last_ns = 0;
+    uint64_t next = 0;
+    struct sector_trace_record r;
+    while (fread(&r, sizeof(r), 1, in) == 1) {
+        int dir = r.write ? 1 : 0;
+        int tag = (r.tag < SECTOR_TAG_LAST) ? r.tag : SECTOR_TAG_OTHER;
+        ++ios[dir][tag];
+        sectors[dir][tag] += r.nb;
+        if (nb_ios > 0) {
+            if (r.sector == next) ++sequential;
+            seek += (r.sector >= next) ? r.sector - next : next - r.sector;
+        }
+        int fresh = 0;
+        for (uint32_t s = r.sector; (s < (uint32_t) r.sector + r.nb) && (s < MAX_SECTORS); ++s) {
+            heat[s].sector = s;
+            ++heat[s].count;
+            ++heat[s].by_tag[tag];
+            if (!seen[s]) fresh = 1;
+            seen[s] = 1;
+        }
+        first_touch += fresh;
+        next = (uint64_t) r.sector + r.nb;
+        last_ns = r.ns;
+        ++nb_ios;
+    }
+    fclose(in);
+
+    printf("%llu I/Os in %.3f s\n", (unsigned long long) nb_ios, last_ns / 1e9);
+    printf("%-8s %12s %12s %12s %12s\n", "layer", "reads", "read secs", "writes", "write secs");
+    for (int t = 0; t < SECTOR_TAG_LAST; ++t) {
+        printf("%-8s %12llu %12llu %12llu %12llu\n", SECTOR_TAG_NAMES[t],
+               (unsigned long long) ios[0][t], (unsigned long long) sectors[0][t],
+               (unsigned long long) ios[1][t], (unsigned long long) sectors[1][t]);
+    }
+    if (nb_ios > 0) {
+        uint64_t total = 0;
+        for (int t = 0; t < SECTOR_TAG_LAST; ++t) total += sectors[0][t] + sectors[1][t];
+        printf("\naccess pattern:\n");
+        printf("  mean I/O size        %10.1f sectors\n", (double) total / nb_ios);
+        printf("  sequential           %10.1f %% (start where the previous I/O ended)\n",
+               nb_ios > 1 ? 100.0 * sequential / (nb_ios - 1) : 0.0);
+        printf("  mean seek distance   %10.1f sectors\n", nb_ios > 1 ? (double) seek / (nb_ios - 1) : 0.0);
+        printf("  repeated             %10.1f %% (only sectors already accessed)\n",
+               100.0 * (nb_ios - first_touch) / nb_ios);
+    }
+
+    qsort(heat, MAX_SECTORS, sizeof(struct sector_heat), heat_cmp);
+    printf("\nhottest sectors:\n");
+    for (int k = 0; (k < top) && (k < MAX_SECTORS) && (heat[k].count > 0); ++k) {
+        int main_tag = 0;
+        for (int t = 1; t < SECTOR_TAG_LAST; ++t) {
+            if (heat[k].by_tag[t] > heat[k].by_tag[main_tag]) main_tag = t;
+        }
+        printf("  %6u %10llu I/Os, mostly %s\n", heat[k].sector, (unsigned long long) heat[k].count,
+               SECTOR_TAG_NAMES[main_tag]);
+    }
+
+    free(heat);
+    free(seen);
+    return 0;
+}
@@ -187,7 +187,9 @@ struct superblock {
     uint8_t	    s_fmod;		    /* super block modified flag */
     uint8_t	    s_ronly;	    /* mounted read-only flag */
     uint16_t	s_time[2];	    /* current date of last update */
-    uint16_t	pad[244];       /* unused entries:
+    uint16_t    s_journal_start; /* first sector of the metadata journal */
+    uint16_t    s_journal_size;  /* size in sectors of the journal (0: none) */
+    uint16_t	pad[242];       /* unused entries:
                                  * padding to ensure sizeof(superblock) == SECTOR_SIZE */
 };
 
@@ -207,7 +209,7 @@ struct inode {
     uint16_t i_size1;					/* contient les 16 bits de poids fort de la taille du fichier */
     uint16_t i_addr[ADDR_SMALL_LENGTH]; /* stocke les numéros de secteurs où se trouvent les données du fichier */
     uint16_t i_atime[2];				/* stocke la date du dernier accès au ficher */
-    uint16_t i_mtime[2];				/* stocke la date de la dernière modification du ficher */
+    uint16_t i_mtime[2];				/* ici le nombre de modifications du fichier (voir inode_getversion) */
 };
 
 #define INODES_PER_SECTOR (SECTOR_SIZE / sizeof(struct inode))